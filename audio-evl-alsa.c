@@ -0,0 +1,335 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief ALSA card bridging non real-time clients into the EVL stream.
+ * Playback is mixed into the hat outputs and capture taps the hat inputs,
+ * once per period of the RT client, so the card is clocked by the EVL
+ * stream itself.
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/platform_device.h>
+#include <linux/spinlock.h>
+#include <sound/core.h>
+#include <sound/pcm.h>
+#include <sound/initval.h>
+
+#include <evl/work.h>
+
+#include "audio-evl-bridge.h"
+
+#define AUDIO_EVL_ALSA_CHANNELS		2
+#define AUDIO_EVL_ALSA_BUFFER_BYTES	(64 * 1024)
+#define AUDIO_EVL_ALSA_PERIOD_BYTES_MIN	(16 * AUDIO_EVL_ALSA_CHANNELS * 4)
+
+/* First hat channel the stereo pair is mixed into / taken from */
+static uint playback_channel = 0;
+module_param(playback_channel, uint, 0644);
+static uint capture_channel = 0;
+module_param(capture_channel, uint, 0644);
+
+struct audio_evl_alsa_stream {
+	/*
+	 * Held oob for a whole transfer pass, so that once the substream
+	 * is detached in-band no pass can still touch its dma_area.
+	 */
+	hard_spinlock_t			lock;
+	struct snd_pcm_substream	*substream;
+	/* Frames into the ALSA buffer, written oob or under lock */
+	snd_pcm_uframes_t		pos;
+	snd_pcm_uframes_t		period_pos;
+	bool				running;
+	struct evl_work			elapsed_work;
+};
+
+struct audio_evl_alsa {
+	struct snd_card			*card;
+	struct snd_pcm			*pcm;
+	struct audio_evl_bridge		bridge;
+	struct audio_evl_alsa_stream	streams[2];
+};
+
+static struct platform_device *audio_evl_alsa_pdev;
+
+static void audio_evl_alsa_elapsed_work(struct evl_work *work)
+{
+	struct audio_evl_alsa_stream *stream = container_of(work,
+				struct audio_evl_alsa_stream, elapsed_work);
+	struct snd_pcm_substream *substream = READ_ONCE(stream->substream);
+
+	if (substream)
+		snd_pcm_period_elapsed(substream);
+}
+
+static inline int32_t audio_evl_alsa_mix(int32_t a, int32_t b)
+{
+	return clamp_t(int64_t, (int64_t)a + b, S32_MIN, S32_MAX);
+}
+
+/* Move one period between the ALSA buffer and the DMA buffers, oob */
+static void audio_evl_alsa_transfer(struct audio_evl_alsa_stream *stream,
+		const int32_t *rx, int32_t *tx, int frames, int stride,
+		uint channel)
+{
+	struct snd_pcm_substream *substream;
+	struct snd_pcm_runtime *runtime;
+	snd_pcm_uframes_t pos;
+	unsigned long flags;
+	bool elapsed = false;
+	int32_t *buf;
+	int i, c;
+
+	if (channel + AUDIO_EVL_ALSA_CHANNELS > stride)
+		return;
+
+	raw_spin_lock_irqsave(&stream->lock, flags);
+	substream = stream->substream;
+	if (!substream || !stream->running)
+		goto out;
+
+	runtime = substream->runtime;
+	buf = (int32_t *)runtime->dma_area;
+	pos = stream->pos;
+	for (i = 0; i < frames; i++) {
+		int32_t *frame = buf + pos * AUDIO_EVL_ALSA_CHANNELS;
+
+		for (c = 0; c < AUDIO_EVL_ALSA_CHANNELS; c++) {
+			if (tx)
+				tx[i * stride + channel + c] = audio_evl_alsa_mix(
+					tx[i * stride + channel + c], frame[c]);
+			else
+				frame[c] = rx[i * stride + channel + c];
+		}
+		if (++pos == runtime->buffer_size)
+			pos = 0;
+	}
+	WRITE_ONCE(stream->pos, pos);
+
+	stream->period_pos += frames;
+	if (stream->period_pos >= runtime->period_size) {
+		stream->period_pos %= runtime->period_size;
+		elapsed = true;
+	}
+out:
+	raw_spin_unlock_irqrestore(&stream->lock, flags);
+	if (elapsed)
+		evl_call_inband(&stream->elapsed_work);
+}
+
+/*
+ * Stop the oob transfers of a stream. Returns once any pass in flight
+ * has completed, the ALSA buffer may then be freed.
+ */
+static void audio_evl_alsa_detach(struct audio_evl_alsa_stream *stream)
+{
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&stream->lock, flags);
+	stream->running = false;
+	WRITE_ONCE(stream->substream, NULL);
+	raw_spin_unlock_irqrestore(&stream->lock, flags);
+}
+
+static void audio_evl_alsa_process(struct audio_evl_bridge *bridge,
+		const int32_t *rx, int32_t *tx, int frames, int stride)
+{
+	struct audio_evl_alsa *alsa = container_of(bridge,
+					struct audio_evl_alsa, bridge);
+
+	audio_evl_alsa_transfer(&alsa->streams[SNDRV_PCM_STREAM_PLAYBACK],
+				NULL, tx, frames, stride, playback_channel);
+	audio_evl_alsa_transfer(&alsa->streams[SNDRV_PCM_STREAM_CAPTURE],
+				rx, NULL, frames, stride, capture_channel);
+}
+
+static int audio_evl_alsa_open(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	int rate = audio_evl_sampling_rate();
+
+	runtime->hw = (struct snd_pcm_hardware) {
+		.info = SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID |
+			SNDRV_PCM_INFO_INTERLEAVED | SNDRV_PCM_INFO_BLOCK_TRANSFER,
+		.formats = SNDRV_PCM_FMTBIT_S32_LE,
+		.rates = snd_pcm_rate_to_rate_bit(rate),
+		.rate_min = rate,
+		.rate_max = rate,
+		.channels_min = AUDIO_EVL_ALSA_CHANNELS,
+		.channels_max = AUDIO_EVL_ALSA_CHANNELS,
+		.buffer_bytes_max = AUDIO_EVL_ALSA_BUFFER_BYTES,
+		.period_bytes_min = AUDIO_EVL_ALSA_PERIOD_BYTES_MIN,
+		.period_bytes_max = AUDIO_EVL_ALSA_BUFFER_BYTES / 2,
+		.periods_min = 2,
+		.periods_max = AUDIO_EVL_ALSA_BUFFER_BYTES /
+				AUDIO_EVL_ALSA_PERIOD_BYTES_MIN,
+	};
+	return 0;
+}
+
+static int audio_evl_alsa_close(struct snd_pcm_substream *substream)
+{
+	struct audio_evl_alsa *alsa = snd_pcm_substream_chip(substream);
+	struct audio_evl_alsa_stream *stream = &alsa->streams[substream->stream];
+
+	audio_evl_alsa_detach(stream);
+	evl_flush_work(&stream->elapsed_work);
+	return 0;
+}
+
+/*
+ * Called by ALSA before the buffer is freed or reallocated, prepare
+ * attaches the substream again.
+ */
+static int audio_evl_alsa_sync_stop(struct snd_pcm_substream *substream)
+{
+	struct audio_evl_alsa *alsa = snd_pcm_substream_chip(substream);
+
+	audio_evl_alsa_detach(&alsa->streams[substream->stream]);
+	return 0;
+}
+
+static int audio_evl_alsa_prepare(struct snd_pcm_substream *substream)
+{
+	struct audio_evl_alsa *alsa = snd_pcm_substream_chip(substream);
+	struct audio_evl_alsa_stream *stream = &alsa->streams[substream->stream];
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&stream->lock, flags);
+	stream->running = false;
+	stream->pos = 0;
+	stream->period_pos = 0;
+	stream->substream = substream;
+	raw_spin_unlock_irqrestore(&stream->lock, flags);
+	return 0;
+}
+
+static int audio_evl_alsa_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	struct audio_evl_alsa *alsa = snd_pcm_substream_chip(substream);
+	struct audio_evl_alsa_stream *stream = &alsa->streams[substream->stream];
+	unsigned long flags;
+	int ret = 0;
+
+	raw_spin_lock_irqsave(&stream->lock, flags);
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+	case SNDRV_PCM_TRIGGER_RESUME:
+		stream->running = true;
+		break;
+	case SNDRV_PCM_TRIGGER_STOP:
+	case SNDRV_PCM_TRIGGER_SUSPEND:
+		stream->running = false;
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	raw_spin_unlock_irqrestore(&stream->lock, flags);
+	return ret;
+}
+
+static snd_pcm_uframes_t audio_evl_alsa_pointer(struct snd_pcm_substream *substream)
+{
+	struct audio_evl_alsa *alsa = snd_pcm_substream_chip(substream);
+
+	return READ_ONCE(alsa->streams[substream->stream].pos);
+}
+
+static const struct snd_pcm_ops audio_evl_alsa_ops = {
+	.open		= audio_evl_alsa_open,
+	.close		= audio_evl_alsa_close,
+	.sync_stop	= audio_evl_alsa_sync_stop,
+	.hw_free	= audio_evl_alsa_sync_stop,
+	.prepare	= audio_evl_alsa_prepare,
+	.trigger	= audio_evl_alsa_trigger,
+	.pointer	= audio_evl_alsa_pointer,
+};
+
+static int audio_evl_alsa_probe(struct platform_device *pdev)
+{
+	struct snd_card *card;
+	struct audio_evl_alsa *alsa;
+	int ret, i;
+
+	ret = snd_devm_card_new(&pdev->dev, SNDRV_DEFAULT_IDX1,
+			"audioevl", THIS_MODULE, sizeof(*alsa), &card);
+	if (ret)
+		return ret;
+	alsa = card->private_data;
+	alsa->card = card;
+	for (i = 0; i < ARRAY_SIZE(alsa->streams); i++) {
+		raw_spin_lock_init(&alsa->streams[i].lock);
+		evl_init_work(&alsa->streams[i].elapsed_work,
+				audio_evl_alsa_elapsed_work);
+	}
+
+	ret = snd_pcm_new(card, "audio_evl bridge", 0, 1, 1, &alsa->pcm);
+	if (ret)
+		return ret;
+	alsa->pcm->private_data = alsa;
+	strscpy(alsa->pcm->name, "audio_evl bridge", sizeof(alsa->pcm->name));
+	snd_pcm_set_ops(alsa->pcm, SNDRV_PCM_STREAM_PLAYBACK, &audio_evl_alsa_ops);
+	snd_pcm_set_ops(alsa->pcm, SNDRV_PCM_STREAM_CAPTURE, &audio_evl_alsa_ops);
+	snd_pcm_set_managed_buffer_all(alsa->pcm, SNDRV_DMA_TYPE_CONTINUOUS,
+			NULL, AUDIO_EVL_ALSA_BUFFER_BYTES,
+			AUDIO_EVL_ALSA_BUFFER_BYTES);
+
+	strscpy(card->driver, "audio_evl", sizeof(card->driver));
+	strscpy(card->shortname, "audio_evl bridge", sizeof(card->shortname));
+	strscpy(card->longname, "audio_evl non real-time bridge",
+			sizeof(card->longname));
+	ret = snd_card_register(card);
+	if (ret)
+		return ret;
+
+	alsa->bridge.owner = THIS_MODULE;
+	alsa->bridge.process = audio_evl_alsa_process;
+	ret = audio_evl_register_bridge(&alsa->bridge);
+	if (ret)
+		return ret;
+	platform_set_drvdata(pdev, alsa);
+	return 0;
+}
+
+static int audio_evl_alsa_remove(struct platform_device *pdev)
+{
+	struct audio_evl_alsa *alsa = platform_get_drvdata(pdev);
+
+	audio_evl_unregister_bridge(&alsa->bridge);
+	return 0;
+}
+
+static struct platform_driver audio_evl_alsa_driver = {
+	.probe		= audio_evl_alsa_probe,
+	.remove		= audio_evl_alsa_remove,
+	.driver		= {
+		.name	= "audio_evl_alsa",
+	},
+};
+
+static int __init audio_evl_alsa_init(void)
+{
+	int ret;
+
+	ret = platform_driver_register(&audio_evl_alsa_driver);
+	if (ret)
+		return ret;
+	audio_evl_alsa_pdev = platform_device_register_simple("audio_evl_alsa",
+							-1, NULL, 0);
+	if (IS_ERR(audio_evl_alsa_pdev)) {
+		platform_driver_unregister(&audio_evl_alsa_driver);
+		return PTR_ERR(audio_evl_alsa_pdev);
+	}
+	return 0;
+}
+
+static void __exit audio_evl_alsa_exit(void)
+{
+	platform_device_unregister(audio_evl_alsa_pdev);
+	platform_driver_unregister(&audio_evl_alsa_driver);
+}
+
+module_init(audio_evl_alsa_init);
+module_exit(audio_evl_alsa_exit);
+MODULE_DESCRIPTION("ALSA bridge for non real-time clients of audio_evl");
+MODULE_LICENSE("GPL");
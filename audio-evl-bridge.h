@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief Hook to bridge non real-time audio into the EVL stream
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#ifndef AUDIO_EVL_BRIDGE_H
+#define AUDIO_EVL_BRIDGE_H
+
+#include <linux/module.h>
+#include <linux/refcount.h>
+#include <linux/completion.h>
+
+struct audio_evl_bridge {
+	struct module	*owner;
+	/*
+	 * Called oob once per period, after the RT client has filled tx.
+	 * rx and tx point to the current period, interleaved by stride
+	 * 32 bit words per frame. Must not block.
+	 */
+	void (*process)(struct audio_evl_bridge *bridge, const int32_t *rx,
+			int32_t *tx, int frames, int stride);
+	/* Owned by the registry, the sessions holding the bridge */
+	refcount_t		users;
+	struct completion	released;
+};
+
+extern int audio_evl_register_bridge(struct audio_evl_bridge *bridge);
+/* Waits for the open sessions to drop the bridge before returning */
+extern void audio_evl_unregister_bridge(struct audio_evl_bridge *bridge);
+extern int audio_evl_sampling_rate(void);
+
+#endif
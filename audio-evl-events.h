@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief Kernel consumer of the output events queued by the RT client
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#ifndef AUDIO_EVL_EVENTS_H
+#define AUDIO_EVL_EVENTS_H
+
+#include <linux/module.h>
+#include <linux/refcount.h>
+#include <linux/completion.h>
+
+#include "rpi-audio-evl.h"
+
+struct audio_evl_event_sink {
+	struct module	*owner;
+	/*
+	 * Called oob once per period, after the RT client has filled tx.
+	 * Events are sorted by frame_offset in the period the current output
+	 * buffer is played in, which starts period_ns after period_ts.
+	 * Must not block.
+	 */
+	void (*process)(struct audio_evl_event_sink *sink,
+			const struct audio_event *events, int num_events,
+			ktime_t period_ts, int64_t period_ns);
+	/* Owned by the registry, the sessions holding the sink */
+	refcount_t		users;
+	struct completion	released;
+};
+
+extern int audio_evl_register_event_sink(struct audio_evl_event_sink *sink);
+/* Waits for the open sessions to drop the sink before returning */
+extern void audio_evl_unregister_event_sink(struct audio_evl_event_sink *sink);
+
+#endif
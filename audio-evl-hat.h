@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief Hat descriptors, one per supported audio board
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#ifndef AUDIO_EVL_HAT_H
+#define AUDIO_EVL_HAT_H
+
+#include <linux/list.h>
+#include <linux/module.h>
+
+#include "rpi-audio-evl.h"
+
+struct audio_evl_hat;
+
+struct audio_evl_hat_ops {
+	int (*codec_init)(const struct audio_evl_hat *hat, bool low_latency);
+	void (*codec_exit)(const struct audio_evl_hat *hat);
+};
+
+/* How the stream is aligned on the frame when it is started */
+enum audio_evl_hat_sync {
+	/* Start right away, the frame sync is reliable */
+	AUDIO_EVL_SYNC_NONE,
+	/* Synch on the last two codec slots, which are always zero */
+	AUDIO_EVL_SYNC_GUARD_SLOTS,
+};
+
+struct audio_evl_hat {
+	const char			*name;
+	struct module			*owner;
+	const struct audio_evl_hat_ops	*ops;
+	int				sampling_rate;
+	enum codec_sample_format	format;
+	/* Default frame, frame_length is computed */
+	struct audio_evl_tdm_config	tdm;
+	/* The I2S block generates the bit clock and the frame sync */
+	bool				clock_master;
+	/* Bit clocks between the frame sync and the first slot */
+	unsigned			data_delay;
+	struct audio_evl_dma_params	dma_params;
+	bool				cv_gates;
+	enum audio_evl_hat_sync		sync;
+	/*
+	 * Group delay of the codec filters in frames, from the datasheets,
+	 * with the default and the low latency filters.
+	 */
+	unsigned			input_delay;
+	unsigned			output_delay;
+	unsigned			input_delay_low_latency;
+	unsigned			output_delay_low_latency;
+	struct list_head		node;
+};
+
+extern int audio_evl_register_hat(struct audio_evl_hat *hat);
+extern void audio_evl_unregister_hat(struct audio_evl_hat *hat);
+extern const struct audio_evl_hat *audio_evl_get_hat(const char *name);
+extern void audio_evl_put_hat(const struct audio_evl_hat *hat);
+
+#endif
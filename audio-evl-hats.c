@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief Descriptors of the hats supported out of the box
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+
+#include "rpi-audio-evl.h"
+#include "audio-evl-hat.h"
+#include "bcm2835-i2s-elk.h"
+#include "elk-pi-config.h"
+#include "hifi-berry-config.h"
+#include "hifi-berry-pro-config.h"
+#include "pcm3168a-elk.h"
+#include "pcm5122-elk.h"
+#include "pcm1863-elk.h"
+
+/* Thresholds the driver has been shipping with, until a hat is re-tuned */
+#define AUDIO_EVL_DEFAULT_DMA_PARAMS {				\
+	.thr_tx = BCM2835_DMA_THR_TX,				\
+	.thr_rx = BCM2835_DMA_THR_RX,				\
+	.tx_panic_thr = BCM2835_DMA_TX_PANIC_THR,		\
+	.rx_panic_thr = BCM2835_DMA_RX_PANIC_THR,		\
+	.burst_size = BCM2835_DMA_BURST_SIZE,			\
+	.fifo_tx_thr = BCM2835_FIFO_THR_TX,			\
+	.fifo_rx_thr = BCM2835_FIFO_THR_RX,			\
+}
+
+static int elk_pi_codec_init(const struct audio_evl_hat *hat, bool low_latency)
+{
+	return pcm3168a_codec_init();
+}
+
+static void elk_pi_codec_exit(const struct audio_evl_hat *hat)
+{
+	pcm3168a_codec_exit();
+}
+
+static const struct audio_evl_hat_ops elk_pi_ops = {
+	.codec_init = elk_pi_codec_init,
+	.codec_exit = elk_pi_codec_exit,
+};
+
+static int hifi_berry_codec_init(const struct audio_evl_hat *hat,
+				bool low_latency)
+{
+	return pcm5122_codec_init(HIFI_BERRY_DAC_MODE, hat->sampling_rate,
+				low_latency);
+}
+
+static void hifi_berry_codec_exit(const struct audio_evl_hat *hat)
+{
+	pcm5122_codec_exit();
+}
+
+static const struct audio_evl_hat_ops hifi_berry_ops = {
+	.codec_init = hifi_berry_codec_init,
+	.codec_exit = hifi_berry_codec_exit,
+};
+
+static int hifi_berry_pro_codec_init(const struct audio_evl_hat *hat,
+				bool low_latency)
+{
+	int ret;
+
+	ret = pcm1863_codec_init(low_latency);
+	if (ret) {
+		printk(KERN_ERR "audio_evl: pcm1863 codec failed\n");
+		return ret;
+	}
+	ret = pcm5122_codec_init(HIFI_BERRY_PRO_DAC_MODE, hat->sampling_rate,
+				low_latency);
+	if (ret) {
+		printk(KERN_ERR "audio_evl: pcm5122 codec failed\n");
+		pcm1863_codec_exit();
+	}
+	return ret;
+}
+
+static void hifi_berry_pro_codec_exit(const struct audio_evl_hat *hat)
+{
+	pcm5122_codec_exit();
+	pcm1863_codec_exit();
+}
+
+static const struct audio_evl_hat_ops hifi_berry_pro_ops = {
+	.codec_init = hifi_berry_pro_codec_init,
+	.codec_exit = hifi_berry_pro_codec_exit,
+};
+
+static struct audio_evl_hat audio_evl_builtin_hats[] = {
+	{
+		.name = "elk-pi",
+		.owner = THIS_MODULE,
+		.ops = &elk_pi_ops,
+		.sampling_rate = ELK_PI_SAMPLING_RATE,
+		.format = ELK_PI_CODEC_FORMAT,
+		.tdm = {
+			.slots = ELK_PI_NUM_CODEC_CHANNELS,
+			.slot_width = 32,
+			.rx_slot_mask = GENMASK(ELK_PI_NUM_INPUT_CHANNELS - 1, 0),
+			.tx_slot_mask = GENMASK(ELK_PI_NUM_OUTPUT_CHANNELS - 1, 0),
+		},
+		.clock_master = false,
+		.data_delay = 0,
+		.dma_params = AUDIO_EVL_DEFAULT_DMA_PARAMS,
+		.cv_gates = true,
+		.sync = AUDIO_EVL_SYNC_GUARD_SLOTS,
+		/* pcm3168a, no low latency filters */
+		.input_delay = 17,
+		.output_delay = 28,
+		.input_delay_low_latency = 17,
+		.output_delay_low_latency = 28,
+	},
+	{
+		.name = "hifi-berry",
+		.owner = THIS_MODULE,
+		.ops = &hifi_berry_ops,
+		.sampling_rate = HIFI_BERRY_SAMPLING_RATE,
+		.format = HIFI_BERRY_CODEC_FORMAT,
+		.tdm = {
+			.slots = HIFI_BERRY_NUM_CODEC_CHANNELS,
+			.slot_width = 32,
+			.rx_slot_mask = GENMASK(HIFI_BERRY_NUM_INPUT_CHANNELS - 1, 0),
+			.tx_slot_mask = GENMASK(HIFI_BERRY_NUM_OUTPUT_CHANNELS - 1, 0),
+		},
+		.clock_master = true,
+		.data_delay = 1,
+		.dma_params = AUDIO_EVL_DEFAULT_DMA_PARAMS,
+		.cv_gates = false,
+		.sync = AUDIO_EVL_SYNC_NONE,
+		/* pcm5122, there is no ADC on the inputs */
+		.output_delay = 22,
+		.output_delay_low_latency = 4,
+	},
+	{
+		.name = "hifi-berry-pro",
+		.owner = THIS_MODULE,
+		.ops = &hifi_berry_pro_ops,
+		.sampling_rate = HIFI_BERRY_PRO_SAMPLING_RATE,
+		.format = HIFI_BERRY_PRO_CODEC_FORMAT,
+		.tdm = {
+			.slots = HIFI_BERRY_PRO_NUM_CODEC_CHANNELS,
+			.slot_width = 32,
+			.rx_slot_mask = GENMASK(HIFI_BERRY_PRO_NUM_INPUT_CHANNELS - 1, 0),
+			.tx_slot_mask = GENMASK(HIFI_BERRY_PRO_NUM_OUTPUT_CHANNELS - 1, 0),
+		},
+		.clock_master = false,
+		.data_delay = 1,
+		.dma_params = AUDIO_EVL_DEFAULT_DMA_PARAMS,
+		.cv_gates = false,
+		.sync = AUDIO_EVL_SYNC_NONE,
+		/* pcm1863 and pcm5122 */
+		.input_delay = 18,
+		.output_delay = 22,
+		.input_delay_low_latency = 6,
+		.output_delay_low_latency = 4,
+	},
+};
+
+static int __init audio_evl_hats_init(void)
+{
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(audio_evl_builtin_hats); i++) {
+		ret = audio_evl_register_hat(&audio_evl_builtin_hats[i]);
+		if (ret) {
+			printk(KERN_ERR "audio_evl: can't register hat %s\n",
+					audio_evl_builtin_hats[i].name);
+			while (--i >= 0)
+				audio_evl_unregister_hat(&audio_evl_builtin_hats[i]);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static void __exit audio_evl_hats_exit(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(audio_evl_builtin_hats); i++)
+		audio_evl_unregister_hat(&audio_evl_builtin_hats[i]);
+}
+
+module_init(audio_evl_hats_init);
+module_exit(audio_evl_hats_exit);
+MODULE_DESCRIPTION("Built-in hat descriptors for the EVL audio driver");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,426 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief Hardware access layer of the EVL audio driver.
+ *	  With hw_backend=sim no register or bus is touched: MMIO goes to a
+ *	  small simulated register file, I2C writes are acknowledged, codec
+ *	  adapters, clients and reset GPIOs are stubbed, and every access is
+ *	  recorded. A toggle of the I2S SYNC bit only reads back after a
+ *	  configurable number of reads, as the hardware takes two PCM clocks.
+ *	  The log and the per-op counters are available in debugfs under
+ *	  audio_evl_hw/.
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/i2c.h>
+#include <linux/gpio.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+
+#include "audio-evl-hw.h"
+#include "bcm2835-i2s-elk.h"
+
+#define AUDIO_EVL_HW_SIM_BLOCKS		4
+#define AUDIO_EVL_HW_SIM_REGS		64
+#define AUDIO_EVL_HW_LOG_SIZE		4096
+
+/* One simulated register block per distinct base address */
+struct audio_evl_hw_sim_block {
+	void *base;
+	uint32_t regs[AUDIO_EVL_HW_SIM_REGS];
+	/* Reads of CS_A left before a written SYNC value shows */
+	unsigned int sync_reads_left;
+	bool sync_pending;
+	uint32_t sync;
+};
+
+static char *hw_backend = "hw";
+module_param(hw_backend, charp, 0444);
+
+DEFINE_STATIC_KEY_FALSE(audio_evl_hw_sim);
+EXPORT_SYMBOL_GPL(audio_evl_hw_sim);
+
+static DEFINE_HARD_SPINLOCK(hw_sim_lock);
+static struct audio_evl_hw_sim_block hw_sim_blocks[AUDIO_EVL_HW_SIM_BLOCKS];
+static struct audio_evl_hw_log_entry *hw_log;
+static unsigned int hw_log_count;
+static unsigned int hw_sim_sync_delay;
+static u64 hw_op_counters[AUDIO_EVL_HW_NUM_OPS];
+static struct dentry *hw_debugfs_dir;
+static struct i2c_adapter hw_sim_adapter;
+
+static const char * const hw_op_names[AUDIO_EVL_HW_NUM_OPS] = {
+	[AUDIO_EVL_HW_MMIO_READ] = "mmio_read",
+	[AUDIO_EVL_HW_MMIO_WRITE] = "mmio_write",
+	[AUDIO_EVL_HW_I2C_WRITE] = "i2c_write",
+	[AUDIO_EVL_HW_GPIO_WRITE] = "gpio_write",
+};
+
+static void hw_record(enum audio_evl_hw_op op, void *base, uint32_t reg,
+			uint32_t value)
+{
+	struct audio_evl_hw_log_entry *entry;
+
+	hw_op_counters[op]++;
+	if (!hw_log || hw_log_count >= AUDIO_EVL_HW_LOG_SIZE)
+		return;
+	entry = &hw_log[hw_log_count++];
+	entry->op = op;
+	entry->base = (uintptr_t)base;
+	entry->reg = reg;
+	entry->value = value;
+}
+
+static struct audio_evl_hw_sim_block *hw_sim_block(void *base)
+{
+	int i;
+
+	for (i = 0; i < AUDIO_EVL_HW_SIM_BLOCKS; i++) {
+		if (hw_sim_blocks[i].base == base)
+			return &hw_sim_blocks[i];
+		if (!hw_sim_blocks[i].base) {
+			hw_sim_blocks[i].base = base;
+			return &hw_sim_blocks[i];
+		}
+	}
+	return NULL;
+}
+
+uint32_t audio_evl_hw_sim_read(void *base_addr, uint32_t reg_addr)
+{
+	unsigned long flags;
+	struct audio_evl_hw_sim_block *block;
+	uint32_t value = 0;
+
+	raw_spin_lock_irqsave(&hw_sim_lock, flags);
+	block = hw_sim_block(base_addr);
+	if (block && reg_addr == BCM2835_I2S_CS_A_REG && block->sync_pending) {
+		if (block->sync_reads_left) {
+			block->sync_reads_left--;
+		} else {
+			block->regs[reg_addr / 4] &= ~BCM2835_I2S_SYNC;
+			block->regs[reg_addr / 4] |= block->sync;
+			block->sync_pending = false;
+		}
+	}
+	if (block && reg_addr / 4 < AUDIO_EVL_HW_SIM_REGS)
+		value = block->regs[reg_addr / 4];
+	/* The simulated I2S rx FIFO always has (zero) data available */
+	if (reg_addr == BCM2835_I2S_CS_A_REG)
+		value |= BCM2835_I2S_RXD;
+	else if (reg_addr == BCM2835_I2S_FIFO_A_REG)
+		value = 0;
+	hw_record(AUDIO_EVL_HW_MMIO_READ, base_addr, reg_addr, value);
+	raw_spin_unlock_irqrestore(&hw_sim_lock, flags);
+
+	return value;
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_sim_read);
+
+void audio_evl_hw_sim_write(void *base_addr, uint32_t reg_addr, uint32_t value)
+{
+	unsigned long flags;
+	struct audio_evl_hw_sim_block *block;
+
+	raw_spin_lock_irqsave(&hw_sim_lock, flags);
+	hw_record(AUDIO_EVL_HW_MMIO_WRITE, base_addr, reg_addr, value);
+	/* FIFO clear bits are self clearing, the FIFO itself is a sink */
+	if (reg_addr == BCM2835_I2S_CS_A_REG)
+		value &= ~(BCM2835_I2S_TXCLR | BCM2835_I2S_RXCLR);
+	block = hw_sim_block(base_addr);
+	if (block && reg_addr == BCM2835_I2S_CS_A_REG) {
+		/* A new SYNC value is delayed, the old one reads back until then */
+		block->sync_pending = hw_sim_sync_delay &&
+			((value ^ block->regs[reg_addr / 4]) & BCM2835_I2S_SYNC);
+		if (block->sync_pending) {
+			block->sync = value & BCM2835_I2S_SYNC;
+			block->sync_reads_left = hw_sim_sync_delay;
+			value = (value & ~BCM2835_I2S_SYNC) |
+				(block->regs[reg_addr / 4] & BCM2835_I2S_SYNC);
+		}
+	}
+	if (block && reg_addr / 4 < AUDIO_EVL_HW_SIM_REGS &&
+	    reg_addr != BCM2835_I2S_FIFO_A_REG)
+		block->regs[reg_addr / 4] = value;
+	raw_spin_unlock_irqrestore(&hw_sim_lock, flags);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_sim_write);
+
+int audio_evl_hw_i2c_write(struct i2c_client *client,
+			unsigned int reg, unsigned int val)
+{
+	unsigned long flags;
+	char cmd[2];
+
+	if (static_branch_unlikely(&audio_evl_hw_sim)) {
+		raw_spin_lock_irqsave(&hw_sim_lock, flags);
+		/* Logged with the device address in place of the base */
+		hw_record(AUDIO_EVL_HW_I2C_WRITE,
+			(void *)(uintptr_t)(client ? client->addr : 0),
+			reg & 0xff, val);
+		raw_spin_unlock_irqrestore(&hw_sim_lock, flags);
+		return 2;
+	}
+
+	hw_op_counters[AUDIO_EVL_HW_I2C_WRITE]++;
+	cmd[0] = reg & 0xff;
+	cmd[1] = val;
+	return i2c_master_send(client, (const char *)cmd, 2);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_i2c_write);
+
+struct i2c_adapter *audio_evl_hw_i2c_get_adapter(int nr)
+{
+	if (static_branch_unlikely(&audio_evl_hw_sim)) {
+		hw_sim_adapter.nr = nr;
+		return &hw_sim_adapter;
+	}
+	return i2c_get_adapter(nr);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_i2c_get_adapter);
+
+void audio_evl_hw_i2c_put_adapter(struct i2c_adapter *adapter)
+{
+	if (adapter == &hw_sim_adapter)
+		return;
+	i2c_put_adapter(adapter);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_i2c_put_adapter);
+
+static struct i2c_client *hw_sim_new_client(struct i2c_adapter *adapter,
+				const struct i2c_board_info *info,
+				unsigned short addr)
+{
+	struct i2c_client *client;
+
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client)
+		return ERR_PTR(-ENOMEM);
+	client->adapter = adapter;
+	client->addr = addr;
+	strscpy(client->name, info->type, sizeof(client->name));
+	return client;
+}
+
+struct i2c_client *audio_evl_hw_i2c_new_client(struct i2c_adapter *adapter,
+				const struct i2c_board_info *info)
+{
+	if (adapter == &hw_sim_adapter)
+		return hw_sim_new_client(adapter, info, info->addr);
+	return i2c_new_client_device(adapter, info);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_i2c_new_client);
+
+struct i2c_client *audio_evl_hw_i2c_new_scanned(struct i2c_adapter *adapter,
+				struct i2c_board_info *info,
+				const unsigned short *addrs)
+{
+	/* Nothing to probe in sim, the first candidate address answers */
+	if (adapter == &hw_sim_adapter)
+		return hw_sim_new_client(adapter, info, addrs[0]);
+	return i2c_new_scanned_device(adapter, info, addrs, NULL);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_i2c_new_scanned);
+
+void audio_evl_hw_i2c_unregister(struct i2c_client *client)
+{
+	if (IS_ERR_OR_NULL(client))
+		return;
+	if (client->adapter == &hw_sim_adapter) {
+		kfree(client);
+		return;
+	}
+	i2c_unregister_device(client);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_i2c_unregister);
+
+int audio_evl_hw_gpio_request(unsigned int gpio, const char *label)
+{
+	if (static_branch_unlikely(&audio_evl_hw_sim))
+		return 0;
+	return gpio_request(gpio, label);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_gpio_request);
+
+void audio_evl_hw_gpio_free(unsigned int gpio)
+{
+	if (static_branch_unlikely(&audio_evl_hw_sim))
+		return;
+	gpio_free(gpio);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_gpio_free);
+
+int audio_evl_hw_gpio_direction_output(unsigned int gpio, int value)
+{
+	unsigned long flags;
+
+	if (static_branch_unlikely(&audio_evl_hw_sim)) {
+		raw_spin_lock_irqsave(&hw_sim_lock, flags);
+		/* Logged with the gpio number in place of the base */
+		hw_record(AUDIO_EVL_HW_GPIO_WRITE, (void *)(uintptr_t)gpio,
+			0, value);
+		raw_spin_unlock_irqrestore(&hw_sim_lock, flags);
+		return 0;
+	}
+
+	hw_op_counters[AUDIO_EVL_HW_GPIO_WRITE]++;
+	return gpio_direction_output(gpio, value);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_gpio_direction_output);
+
+/* Switches the accesses to the sim backend, also used by the KUnit suite */
+int audio_evl_hw_sim_enable(void)
+{
+	struct audio_evl_hw_log_entry *log;
+	unsigned long flags;
+
+	if (static_key_enabled(&audio_evl_hw_sim))
+		return 0;
+	log = kcalloc(AUDIO_EVL_HW_LOG_SIZE, sizeof(*log), GFP_KERNEL);
+	if (!log)
+		return -ENOMEM;
+	raw_spin_lock_irqsave(&hw_sim_lock, flags);
+	hw_log = log;
+	hw_log_count = 0;
+	raw_spin_unlock_irqrestore(&hw_sim_lock, flags);
+	static_branch_enable(&audio_evl_hw_sim);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_sim_enable);
+
+void audio_evl_hw_sim_disable(void)
+{
+	struct audio_evl_hw_log_entry *log;
+	unsigned long flags;
+
+	static_branch_disable(&audio_evl_hw_sim);
+	raw_spin_lock_irqsave(&hw_sim_lock, flags);
+	log = hw_log;
+	hw_log = NULL;
+	hw_log_count = 0;
+	raw_spin_unlock_irqrestore(&hw_sim_lock, flags);
+	kfree(log);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_sim_disable);
+
+void audio_evl_hw_sim_reset(void)
+{
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&hw_sim_lock, flags);
+	hw_log_count = 0;
+	memset(hw_op_counters, 0, sizeof(hw_op_counters));
+	raw_spin_unlock_irqrestore(&hw_sim_lock, flags);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_sim_reset);
+
+/* Number of CS_A reads a written SYNC toggle takes to show, 0 = at once */
+void audio_evl_hw_sim_set_sync_delay(unsigned int reads)
+{
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&hw_sim_lock, flags);
+	hw_sim_sync_delay = reads;
+	raw_spin_unlock_irqrestore(&hw_sim_lock, flags);
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_sim_set_sync_delay);
+
+u64 audio_evl_hw_op_count(enum audio_evl_hw_op op)
+{
+	unsigned long flags;
+	u64 count;
+
+	raw_spin_lock_irqsave(&hw_sim_lock, flags);
+	count = hw_op_counters[op];
+	raw_spin_unlock_irqrestore(&hw_sim_lock, flags);
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_op_count);
+
+/* Copies out log entry idx if present, returns the current log length */
+unsigned int audio_evl_hw_log_get(unsigned int idx,
+				struct audio_evl_hw_log_entry *entry)
+{
+	unsigned long flags;
+	unsigned int count;
+
+	raw_spin_lock_irqsave(&hw_sim_lock, flags);
+	count = hw_log_count;
+	if (entry && idx < count)
+		*entry = hw_log[idx];
+	raw_spin_unlock_irqrestore(&hw_sim_lock, flags);
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(audio_evl_hw_log_get);
+
+static int hw_log_show(struct seq_file *s, void *unused)
+{
+	unsigned long flags;
+	unsigned int i, count;
+	struct audio_evl_hw_log_entry entry;
+
+	raw_spin_lock_irqsave(&hw_sim_lock, flags);
+	count = hw_log_count;
+	raw_spin_unlock_irqrestore(&hw_sim_lock, flags);
+
+	for (i = 0; i < count; i++) {
+		entry = hw_log[i];
+		seq_printf(s, "%u %s %lx %02x %08x\n", i, hw_op_names[entry.op],
+			(unsigned long)entry.base, entry.reg, entry.value);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hw_log);
+
+static ssize_t hw_reset_write(struct file *file, const char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	audio_evl_hw_sim_reset();
+	return count;
+}
+
+static const struct file_operations hw_reset_fops = {
+	.write = hw_reset_write,
+};
+
+static int __init audio_evl_hw_init(void)
+{
+	int i;
+
+	if (!strcmp(hw_backend, "sim")) {
+		if (audio_evl_hw_sim_enable())
+			return -ENOMEM;
+	} else if (strcmp(hw_backend, "hw")) {
+		printk(KERN_ERR "audio-evl-hw: unknown backend %s\n", hw_backend);
+		return -EINVAL;
+	}
+
+	hw_debugfs_dir = debugfs_create_dir("audio_evl_hw", NULL);
+	for (i = 0; i < AUDIO_EVL_HW_NUM_OPS; i++)
+		debugfs_create_u64(hw_op_names[i], 0444, hw_debugfs_dir,
+				&hw_op_counters[i]);
+	debugfs_create_file("log", 0444, hw_debugfs_dir, NULL, &hw_log_fops);
+	debugfs_create_file("reset", 0200, hw_debugfs_dir, NULL,
+			&hw_reset_fops);
+
+	printk(KERN_INFO "audio-evl-hw: %s backend\n", hw_backend);
+	return 0;
+}
+
+static void __exit audio_evl_hw_exit(void)
+{
+	debugfs_remove_recursive(hw_debugfs_dir);
+	audio_evl_hw_sim_disable();
+}
+
+module_init(audio_evl_hw_init)
+module_exit(audio_evl_hw_exit)
+
+MODULE_DESCRIPTION("Hardware access layer of the EVL audio driver");
+MODULE_AUTHOR("Nitin Kulkarni (nitin@elk.audio)");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief Hardware access layer of the EVL audio driver. MMIO and codec I2C
+ *	  accesses go through here so that they can be redirected to a
+ *	  recording, simulated backend.
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#ifndef AUDIO_EVL_HW_H
+#define AUDIO_EVL_HW_H
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+
+struct i2c_client;
+struct i2c_adapter;
+struct i2c_board_info;
+
+enum audio_evl_hw_op {
+	AUDIO_EVL_HW_MMIO_READ = 0,
+	AUDIO_EVL_HW_MMIO_WRITE,
+	AUDIO_EVL_HW_I2C_WRITE,
+	AUDIO_EVL_HW_GPIO_WRITE,
+	AUDIO_EVL_HW_NUM_OPS,
+};
+
+struct audio_evl_hw_log_entry {
+	uint8_t op;
+	uint32_t reg;
+	uint32_t value;
+	uintptr_t base;
+};
+
+/* Enabled when the module is loaded with hw_backend=sim */
+DECLARE_STATIC_KEY_FALSE(audio_evl_hw_sim);
+
+extern uint32_t audio_evl_hw_sim_read(void *base_addr, uint32_t reg_addr);
+extern void audio_evl_hw_sim_write(void *base_addr, uint32_t reg_addr,
+				uint32_t value);
+extern int audio_evl_hw_i2c_write(struct i2c_client *client,
+				unsigned int reg, unsigned int val);
+
+/* Codec bus and reset line setup, stubbed out by the sim backend */
+extern struct i2c_adapter *audio_evl_hw_i2c_get_adapter(int nr);
+extern void audio_evl_hw_i2c_put_adapter(struct i2c_adapter *adapter);
+extern struct i2c_client *audio_evl_hw_i2c_new_client(
+				struct i2c_adapter *adapter,
+				const struct i2c_board_info *info);
+extern struct i2c_client *audio_evl_hw_i2c_new_scanned(
+				struct i2c_adapter *adapter,
+				struct i2c_board_info *info,
+				const unsigned short *addrs);
+extern void audio_evl_hw_i2c_unregister(struct i2c_client *client);
+extern int audio_evl_hw_gpio_request(unsigned int gpio, const char *label);
+extern void audio_evl_hw_gpio_free(unsigned int gpio);
+extern int audio_evl_hw_gpio_direction_output(unsigned int gpio, int value);
+
+/* Sim log access, for the debugfs interface and the KUnit suite */
+extern int audio_evl_hw_sim_enable(void);
+extern void audio_evl_hw_sim_disable(void);
+extern void audio_evl_hw_sim_reset(void);
+extern void audio_evl_hw_sim_set_sync_delay(unsigned int reads);
+extern u64 audio_evl_hw_op_count(enum audio_evl_hw_op op);
+extern unsigned int audio_evl_hw_log_get(unsigned int idx,
+				struct audio_evl_hw_log_entry *entry);
+
+#endif
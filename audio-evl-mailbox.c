@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief Transports of the per period control mailbox. The SPI one talks
+ * to the board's microcontroller with out-of-band transfers, the loopback
+ * one echoes the out mailbox back one period later and stands in for it
+ * when there is no microcontroller.
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/of.h>
+#include <linux/spi/spi.h>
+
+#include "rpi-audio-evl.h"
+#include "audio-evl-mailbox.h"
+
+/* "spi" or "loopback" */
+static char *transport = "spi";
+module_param(transport, charp, 0444);
+/* Fixed length of the SPI frames, both ways */
+static uint frame_len = 64;
+module_param(frame_len, uint, 0444);
+static uint spi_speed_hz = 10000000;
+module_param(spi_speed_hz, uint, 0444);
+
+struct audio_evl_loopback {
+	struct audio_evl_mailbox_transport transport;
+	size_t len;
+	uint8_t data[AUDIO_MAILBOX_SIZE];
+};
+
+static int audio_evl_loopback_exchange(struct audio_evl_mailbox_transport *t,
+				const void *tx, size_t tx_len, void *rx)
+{
+	struct audio_evl_loopback *lb = container_of(t,
+					struct audio_evl_loopback, transport);
+	size_t len = lb->len;
+
+	memcpy(rx, lb->data, len);
+	memcpy(lb->data, tx, tx_len);
+	lb->len = tx_len;
+	return len;
+}
+
+static struct audio_evl_loopback audio_evl_loopback = {
+	.transport = {
+		.name = "loopback",
+		.owner = THIS_MODULE,
+		.exchange = audio_evl_loopback_exchange,
+	},
+};
+
+struct audio_evl_spi {
+	struct audio_evl_mailbox_transport transport;
+	struct spi_oob_transfer xfer;
+	/* Set by the DMA completion, cleared when a frame is pulsed */
+	bool done;
+	bool received;
+};
+
+static void audio_evl_spi_xfer_done(struct spi_oob_transfer *xfer)
+{
+	struct audio_evl_spi *mb = container_of(xfer, struct audio_evl_spi,
+						xfer);
+
+	WRITE_ONCE(mb->done, true);
+}
+
+static int audio_evl_spi_exchange(struct audio_evl_mailbox_transport *t,
+				const void *tx, size_t tx_len, void *rx)
+{
+	struct audio_evl_spi *mb = container_of(t, struct audio_evl_spi,
+						transport);
+	uint8_t *txbuf = spi_get_oob_txbuf(&mb->xfer);
+	int ret = 0;
+
+	/* The previous frame is still on the wire, skip this period */
+	if (mb->received && !READ_ONCE(mb->done))
+		return -EBUSY;
+	if (mb->received) {
+		memcpy(rx, spi_get_oob_rxbuf(&mb->xfer), frame_len);
+		ret = frame_len;
+	}
+
+	tx_len = min_t(size_t, tx_len, frame_len);
+	memcpy(txbuf, tx, tx_len);
+	memset(txbuf + tx_len, 0, frame_len - tx_len);
+	WRITE_ONCE(mb->done, false);
+	mb->received = true;
+	spi_pulse_oob_transfer(&mb->xfer);
+	return ret;
+}
+
+static int audio_evl_spi_probe(struct spi_device *spi)
+{
+	struct audio_evl_spi *mb;
+	int ret;
+
+	mb = devm_kzalloc(&spi->dev, sizeof(*mb), GFP_KERNEL);
+	if (!mb)
+		return -ENOMEM;
+
+	mb->xfer.setup.frame_len = frame_len;
+	mb->xfer.setup.speed_hz = spi_speed_hz;
+	mb->xfer.setup.bits_per_word = 8;
+	mb->xfer.setup.xfer_done = audio_evl_spi_xfer_done;
+	ret = spi_prepare_oob_transfer(spi, &mb->xfer);
+	if (ret) {
+		dev_err(&spi->dev, "no oob transfer support (%d)\n", ret);
+		return ret;
+	}
+	spi_start_oob_transfer(&mb->xfer);
+
+	mb->transport.name = "spi";
+	mb->transport.owner = THIS_MODULE;
+	mb->transport.exchange = audio_evl_spi_exchange;
+	ret = audio_evl_register_mailbox(&mb->transport);
+	if (ret) {
+		spi_terminate_oob_transfer(&mb->xfer);
+		return ret;
+	}
+	spi_set_drvdata(spi, mb);
+	return 0;
+}
+
+static void audio_evl_spi_remove(struct spi_device *spi)
+{
+	struct audio_evl_spi *mb = spi_get_drvdata(spi);
+
+	audio_evl_unregister_mailbox(&mb->transport);
+	spi_terminate_oob_transfer(&mb->xfer);
+}
+
+static const struct of_device_id audio_evl_spi_of_match[] = {
+	{ .compatible = "elk,audio-evl-uc" },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, audio_evl_spi_of_match);
+
+static struct spi_driver audio_evl_spi_driver = {
+	.probe		= audio_evl_spi_probe,
+	.remove		= audio_evl_spi_remove,
+	.driver		= {
+		.name		= "audio_evl_uc",
+		.of_match_table	= audio_evl_spi_of_match,
+	},
+};
+
+static int __init audio_evl_mailbox_init(void)
+{
+	if (!frame_len || frame_len > AUDIO_MAILBOX_SIZE) {
+		printk(KERN_ERR "audio_evl: invalid mailbox frame_len %u\n",
+				frame_len);
+		return -EINVAL;
+	}
+	if (!strcmp(transport, "loopback"))
+		return audio_evl_register_mailbox(&audio_evl_loopback.transport);
+	if (!strcmp(transport, "spi"))
+		return spi_register_driver(&audio_evl_spi_driver);
+
+	printk(KERN_ERR "audio_evl: unknown mailbox transport %s\n", transport);
+	return -EINVAL;
+}
+
+static void __exit audio_evl_mailbox_exit(void)
+{
+	if (!strcmp(transport, "loopback"))
+		audio_evl_unregister_mailbox(&audio_evl_loopback.transport);
+	else
+		spi_unregister_driver(&audio_evl_spi_driver);
+}
+
+module_init(audio_evl_mailbox_init);
+module_exit(audio_evl_mailbox_exit);
+MODULE_DESCRIPTION("Control mailbox transports for the EVL audio driver");
+MODULE_LICENSE("GPL");
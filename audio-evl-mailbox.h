@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief Transport of the per period control mailbox
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#ifndef AUDIO_EVL_MAILBOX_H
+#define AUDIO_EVL_MAILBOX_H
+
+#include <linux/module.h>
+#include <linux/refcount.h>
+#include <linux/completion.h>
+
+struct audio_evl_mailbox_transport {
+	const char	*name;
+	struct module	*owner;
+	/*
+	 * Called oob once per period. Queues tx_len bytes of tx and copies
+	 * to rx what the previous exchange received, returning its length
+	 * or a negative error. Must not block.
+	 */
+	int (*exchange)(struct audio_evl_mailbox_transport *transport,
+			const void *tx, size_t tx_len, void *rx);
+	/* Owned by the registry, the sessions holding the transport */
+	refcount_t		users;
+	struct completion	released;
+};
+
+extern int audio_evl_register_mailbox(struct audio_evl_mailbox_transport *transport);
+/* Waits for the open sessions to drop the transport before returning */
+extern void audio_evl_unregister_mailbox(struct audio_evl_mailbox_transport *transport);
+
+#endif
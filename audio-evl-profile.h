@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief Execution time statistics of the RT paths of the driver, built in
+ * with -DAUDIO_EVL_PROFILING. Results are in debugfs, audio_evl/profile/.
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#ifndef AUDIO_EVL_PROFILE_H
+#define AUDIO_EVL_PROFILE_H
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+
+#ifdef AUDIO_EVL_PROFILING
+
+#include <linux/spinlock.h>
+#include <evl/clock.h>
+
+/* 4 buckets per power of two of ns, i.e. 25% resolution up to 4 s */
+#define AUDIO_EVL_PROF_BUCKETS		124
+
+struct audio_evl_prof {
+	const char		*name;
+	hard_spinlock_t		lock;
+	uint64_t		count;
+	uint32_t		min_ns;
+	uint32_t		max_ns;
+	uint32_t		hist[AUDIO_EVL_PROF_BUCKETS];
+	struct dentry		*dentry;
+};
+
+#define AUDIO_EVL_PROF(_name)	struct audio_evl_prof _name = { .name = #_name }
+
+static inline ktime_t audio_evl_prof_begin(void)
+{
+	return evl_read_clock(&evl_mono_clock);
+}
+
+extern void audio_evl_prof_end(struct audio_evl_prof *prof, ktime_t start);
+extern void audio_evl_prof_add(struct audio_evl_prof *prof);
+extern void audio_evl_prof_remove(struct audio_evl_prof *prof);
+
+#else
+
+struct audio_evl_prof {
+};
+
+#define AUDIO_EVL_PROF(_name)	struct audio_evl_prof _name
+
+static inline ktime_t audio_evl_prof_begin(void)
+{
+	return 0;
+}
+
+static inline void audio_evl_prof_end(struct audio_evl_prof *prof,
+				ktime_t start)
+{
+}
+
+static inline void audio_evl_prof_add(struct audio_evl_prof *prof)
+{
+}
+
+static inline void audio_evl_prof_remove(struct audio_evl_prof *prof)
+{
+}
+
+#endif
+
+#endif
@@ -0,0 +1,404 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief KUnit suite of the EVL audio driver. Runs the I2S and codec
+ *	  register sequences against the simulated backend of audio-evl-hw
+ *	  and checks the resulting register file, access log and op
+ *	  counters. The suite switches audio-evl-hw to the sim backend for
+ *	  its run if it was not loaded with hw_backend=sim.
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/i2c.h>
+
+#include "rpi-audio-evl.h"
+#include "audio-evl-hat.h"
+#include "audio-evl-hw.h"
+#include "bcm2835-i2s-elk.h"
+#include "pcm3168a-elk.h"
+
+/* Only used as a key of the simulated register file, never accessed */
+static uint32_t test_i2s_block[16];
+/* Set when the suite switched the backend to sim itself */
+static bool test_sim_enabled;
+
+static struct audio_evl_hat test_hat = {
+	.name = "kunit",
+	.clock_master = false,
+	.data_delay = 1,
+};
+
+struct audio_evl_test_ctx {
+	struct audio_evl_dev dev;
+	struct i2c_adapter *adapter;
+};
+
+static const uint32_t test_i2s_regs[] = {
+	BCM2835_I2S_CS_A_REG,
+	BCM2835_I2S_MODE_A_REG,
+	BCM2835_I2S_RXC_A_REG,
+	BCM2835_I2S_TXC_A_REG,
+	BCM2835_I2S_DREQ_A_REG,
+};
+
+static uint32_t test_reg(struct audio_evl_dev *dev, uint32_t reg)
+{
+	uint32_t value;
+
+	rpi_reg_read(dev->i2s_base_addr, reg, &value);
+	return value;
+}
+
+/* Index of the next log entry matching op and reg from start, or -1 */
+static int test_log_find(enum audio_evl_hw_op op, uint32_t reg,
+			unsigned int start)
+{
+	struct audio_evl_hw_log_entry entry;
+	unsigned int i, count = audio_evl_hw_log_get(0, NULL);
+
+	for (i = start; i < count; i++) {
+		audio_evl_hw_log_get(i, &entry);
+		if (entry.op == op && entry.reg == reg)
+			return i;
+	}
+	return -1;
+}
+
+static struct audio_evl_hw_log_entry test_log_entry(unsigned int idx)
+{
+	struct audio_evl_hw_log_entry entry = {};
+
+	audio_evl_hw_log_get(idx, &entry);
+	return entry;
+}
+
+/* Number of op accesses to reg logged between the entries start and end */
+static int test_log_count(enum audio_evl_hw_op op, uint32_t reg,
+			unsigned int start, unsigned int end)
+{
+	int idx, count = 0;
+
+	for (idx = test_log_find(op, reg, start); idx >= 0 && idx < end;
+	     idx = test_log_find(op, reg, idx + 1))
+		count++;
+	return count;
+}
+
+static void test_expect_ops(struct kunit *test, u64 mmio_reads,
+			u64 mmio_writes, u64 i2c_writes)
+{
+	KUNIT_EXPECT_EQ(test, audio_evl_hw_op_count(AUDIO_EVL_HW_MMIO_READ),
+			mmio_reads);
+	KUNIT_EXPECT_EQ(test, audio_evl_hw_op_count(AUDIO_EVL_HW_MMIO_WRITE),
+			mmio_writes);
+	KUNIT_EXPECT_EQ(test, audio_evl_hw_op_count(AUDIO_EVL_HW_I2C_WRITE),
+			i2c_writes);
+	KUNIT_EXPECT_EQ(test, audio_evl_hw_op_count(AUDIO_EVL_HW_GPIO_WRITE),
+			0);
+}
+
+static int audio_evl_test_suite_init(struct kunit_suite *suite)
+{
+	int ret;
+
+	if (static_key_enabled(&audio_evl_hw_sim))
+		return 0;
+	ret = audio_evl_hw_sim_enable();
+	test_sim_enabled = !ret;
+	return ret;
+}
+
+static void audio_evl_test_suite_exit(struct kunit_suite *suite)
+{
+	if (test_sim_enabled)
+		audio_evl_hw_sim_disable();
+	test_sim_enabled = false;
+}
+
+static int audio_evl_test_init(struct kunit *test)
+{
+	struct audio_evl_test_ctx *ctx;
+	int i;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+
+	ctx->dev.i2s_base_addr = (void __iomem *)test_i2s_block;
+	ctx->dev.hat = &test_hat;
+	ctx->dev.tdm.slots = 8;
+	ctx->dev.tdm.slot_width = 32;
+	ctx->dev.tdm.frame_length = 256;
+	ctx->dev.sampling_rate = 48000;
+	ctx->dev.dma_params.thr_tx = BCM2835_DMA_THR_TX;
+	ctx->dev.dma_params.thr_rx = BCM2835_DMA_THR_RX;
+	ctx->dev.dma_params.tx_panic_thr = BCM2835_DMA_TX_PANIC_THR;
+	ctx->dev.dma_params.rx_panic_thr = BCM2835_DMA_RX_PANIC_THR;
+	ctx->dev.dma_params.fifo_tx_thr = BCM2835_FIFO_THR_TX;
+	ctx->dev.dma_params.fifo_rx_thr = BCM2835_FIFO_THR_RX;
+
+	/* Every case starts from a cleared block and an empty log */
+	audio_evl_hw_sim_set_sync_delay(0);
+	for (i = 0; i < ARRAY_SIZE(test_i2s_regs); i++)
+		rpi_reg_write(ctx->dev.i2s_base_addr, test_i2s_regs[i], 0);
+	audio_evl_hw_sim_reset();
+
+	test->priv = ctx;
+	return 0;
+}
+
+static void audio_evl_test_configure(struct kunit *test)
+{
+	struct audio_evl_test_ctx *ctx = test->priv;
+	struct audio_evl_dev *dev = &ctx->dev;
+	uint32_t format, chpos, mode;
+	int mode_write, rxc, txc, clkdis, cs, dreq;
+
+	bcm2835_i2s_configure(dev);
+
+	/* 32 bit slots, data delayed by one bit clock on both channels */
+	format = BCM2835_I2S_CHEN | BCM2835_I2S_CHWEX | BCM2835_I2S_CHWID(8);
+	format = BCM2835_I2S_CH1(format) | BCM2835_I2S_CH2(format);
+	chpos = BCM2835_I2S_CH1_POS(1) | BCM2835_I2S_CH2_POS(33);
+	/* Slave of the codec clocks */
+	mode = BCM2835_I2S_FLEN(63) | BCM2835_I2S_FSLEN(32) |
+		BCM2835_I2S_CLKM | BCM2835_I2S_CLKI | BCM2835_I2S_FSM;
+
+	mode_write = test_log_find(AUDIO_EVL_HW_MMIO_WRITE,
+				BCM2835_I2S_MODE_A_REG, 0);
+	KUNIT_ASSERT_GE(test, mode_write, 0);
+	/* The clock stays disabled while the channels are set up */
+	KUNIT_EXPECT_EQ(test, test_log_entry(mode_write).value,
+			mode | BCM2835_I2S_CLKDIS);
+
+	rxc = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_RXC_A_REG,
+			mode_write);
+	txc = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_TXC_A_REG,
+			mode_write);
+	clkdis = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_MODE_A_REG,
+			mode_write + 1);
+	cs = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_CS_A_REG, 0);
+	dreq = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_DREQ_A_REG, 0);
+	KUNIT_EXPECT_GT(test, rxc, mode_write);
+	KUNIT_EXPECT_GT(test, txc, rxc);
+	KUNIT_EXPECT_GT(test, clkdis, txc);
+	KUNIT_EXPECT_GT(test, cs, clkdis);
+	KUNIT_EXPECT_GT(test, dreq, cs);
+
+	KUNIT_EXPECT_EQ(test, test_reg(dev, BCM2835_I2S_MODE_A_REG), mode);
+	KUNIT_EXPECT_EQ(test, test_reg(dev, BCM2835_I2S_RXC_A_REG),
+			format | chpos);
+	KUNIT_EXPECT_EQ(test, test_reg(dev, BCM2835_I2S_TXC_A_REG),
+			format | chpos);
+	KUNIT_EXPECT_EQ(test, test_reg(dev, BCM2835_I2S_CS_A_REG) &
+			~BCM2835_I2S_RXD,
+			BCM2835_I2S_RXTHR(BCM2835_FIFO_THR_RX) |
+			BCM2835_I2S_TXTHR(BCM2835_FIFO_THR_TX) |
+			BCM2835_I2S_DMAEN);
+	KUNIT_EXPECT_EQ(test, test_reg(dev, BCM2835_I2S_DREQ_A_REG),
+			BCM2835_I2S_TX_PANIC(BCM2835_DMA_TX_PANIC_THR) |
+			BCM2835_I2S_RX_PANIC(BCM2835_DMA_RX_PANIC_THR) |
+			BCM2835_I2S_TX(BCM2835_DMA_THR_TX) |
+			BCM2835_I2S_RX(BCM2835_DMA_THR_RX));
+	/* Three plain writes and three read-modify-writes */
+	test_expect_ops(test, 3, 6, 0);
+}
+
+static void audio_evl_test_configure_packed(struct kunit *test)
+{
+	struct audio_evl_test_ctx *ctx = test->priv;
+	struct audio_evl_dev *dev = &ctx->dev;
+	uint32_t format, chpos;
+
+	dev->packed_16bit = true;
+	bcm2835_i2s_configure(dev);
+
+	/* Only the top 16 bits of each 32 bit slot are transferred */
+	format = BCM2835_I2S_CHEN | BCM2835_I2S_CHWID(8);
+	chpos = BCM2835_I2S_CH1_POS(1) | BCM2835_I2S_CH2_POS(33);
+	format = BCM2835_I2S_CH1(format) | BCM2835_I2S_CH2(format);
+	KUNIT_EXPECT_EQ(test, test_reg(dev, BCM2835_I2S_MODE_A_REG) &
+			(BCM2835_I2S_FTXP | BCM2835_I2S_FRXP),
+			BCM2835_I2S_FTXP | BCM2835_I2S_FRXP);
+	KUNIT_EXPECT_EQ(test, test_reg(dev, BCM2835_I2S_RXC_A_REG),
+			format | chpos);
+	KUNIT_EXPECT_EQ(test, test_reg(dev, BCM2835_I2S_TXC_A_REG),
+			format | chpos);
+	test_expect_ops(test, 3, 6, 0);
+}
+
+/*
+ * Reads of CS_A by the SYNC wait loop of clear_fifos, the reads between
+ * the SYNC write and the restore, less the read of the restore itself.
+ */
+static int test_sync_wait_reads(int sync, int restore)
+{
+	return test_log_count(AUDIO_EVL_HW_MMIO_READ, BCM2835_I2S_CS_A_REG,
+			sync + 1, restore) - 1;
+}
+
+static void audio_evl_test_clear_fifos(struct kunit *test)
+{
+	struct audio_evl_test_ctx *ctx = test->priv;
+	struct audio_evl_dev *dev = &ctx->dev;
+	uint32_t on = BCM2835_I2S_TXON | BCM2835_I2S_RXON;
+	uint32_t clr = BCM2835_I2S_TXCLR | BCM2835_I2S_RXCLR;
+	int stop, clear, sync, restore;
+
+	rpi_reg_write(dev->i2s_base_addr, BCM2835_I2S_CS_A_REG,
+		BCM2835_I2S_EN | on);
+	audio_evl_hw_sim_reset();
+	/* SYNC shows after three reads, the loop polls four times */
+	audio_evl_hw_sim_set_sync_delay(3);
+
+	bcm2835_i2s_clear_fifos(dev, true, true);
+
+	/* Stop, clear, toggle SYNC and then restore the running state */
+	stop = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_CS_A_REG, 0);
+	KUNIT_ASSERT_GE(test, stop, 0);
+	KUNIT_EXPECT_EQ(test, test_log_entry(stop).value & on, 0);
+
+	clear = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_CS_A_REG,
+			stop + 1);
+	KUNIT_ASSERT_GT(test, clear, stop);
+	KUNIT_EXPECT_EQ(test, test_log_entry(clear).value & clr, clr);
+	KUNIT_EXPECT_EQ(test, test_log_entry(clear).value & on, 0);
+
+	sync = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_CS_A_REG,
+			clear + 1);
+	KUNIT_ASSERT_GT(test, sync, clear);
+	KUNIT_EXPECT_EQ(test, test_log_entry(sync).value & BCM2835_I2S_SYNC,
+			BCM2835_I2S_SYNC);
+
+	restore = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_CS_A_REG,
+			sync + 1);
+	KUNIT_ASSERT_GT(test, restore, sync);
+	KUNIT_EXPECT_EQ(test, test_log_entry(restore).value & on, on);
+	KUNIT_EXPECT_LT(test, test_log_find(AUDIO_EVL_HW_MMIO_WRITE,
+			BCM2835_I2S_CS_A_REG, restore + 1), 0);
+
+	KUNIT_EXPECT_EQ(test, test_reg(dev, BCM2835_I2S_CS_A_REG) &
+			(BCM2835_I2S_EN | on | clr), BCM2835_I2S_EN | on);
+	KUNIT_EXPECT_EQ(test, test_sync_wait_reads(sync, restore), 4);
+	/* Backup, SYNC and four read-modify-writes, plus the wait loop */
+	test_expect_ops(test, 6 + 4, 4, 0);
+}
+
+static void audio_evl_test_clear_fifos_timeout(struct kunit *test)
+{
+	struct audio_evl_test_ctx *ctx = test->priv;
+	struct audio_evl_dev *dev = &ctx->dev;
+	int sync, restore;
+
+	/* SYNC never toggles within the loop, which gives up */
+	audio_evl_hw_sim_set_sync_delay(2000);
+	bcm2835_i2s_clear_fifos(dev, true, true);
+
+	sync = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_CS_A_REG, 0);
+	sync = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_CS_A_REG,
+			sync + 1);
+	sync = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_CS_A_REG,
+			sync + 1);
+	KUNIT_ASSERT_GE(test, sync, 0);
+	restore = test_log_find(AUDIO_EVL_HW_MMIO_WRITE, BCM2835_I2S_CS_A_REG,
+			sync + 1);
+	KUNIT_ASSERT_GT(test, restore, sync);
+	KUNIT_EXPECT_EQ(test, test_sync_wait_reads(sync, restore), 999);
+	test_expect_ops(test, 6 + 999, 4, 0);
+}
+
+static void audio_evl_test_clear_fifos_idle(struct kunit *test)
+{
+	struct audio_evl_test_ctx *ctx = test->priv;
+	struct audio_evl_dev *dev = &ctx->dev;
+
+	bcm2835_i2s_clear_fifos(dev, true, false);
+
+	/* A stopped block is not started by the restore */
+	KUNIT_EXPECT_EQ(test, test_reg(dev, BCM2835_I2S_CS_A_REG) &
+			(BCM2835_I2S_TXON | BCM2835_I2S_RXON), 0);
+	/* SYNC shows at once, a single poll */
+	test_expect_ops(test, 6 + 1, 4, 0);
+}
+
+/* Register and value of each write of pcm3168a_config_codec(), in order */
+static const uint8_t test_pcm3168a_seq[][2] = {
+	{ PCM_DAC_CNTRL_TWO_REG, DAC_CHAN_0_1_DISABLED_MODE_MASK |
+		DAC_CHAN_2_3_DISABLED_MODE_MASK |
+		DAC_CHAN_4_5_DISABLED_MODE_MASK |
+		DAC_CHAN_6_7_DISABLED_MODE_MASK },
+	{ PCM_ADC_CNTRL_TWO_REG, ADC_CHAN_0_1_POWER_SAVE_ENABLE_MASK |
+		ADC_CHAN_2_3_POWER_SAVE_ENABLE_MASK |
+		ADC_CHAN_4_5_POWER_SAVE_ENABLE_MASK },
+	{ PCM_DAC_CNTRL_ONE_REG, DAC_SLAVE_MODE_MASK |
+		DAC_LJ_24_BIT_TDM_MODE_MASK },
+	{ PCM_DAC_CNTRL_THREE_REG, DAC_MASTER_VOLUME_CONTROL_MODE_MASK |
+		DAC_ATTEN_SPEED_SLOW_MASK | DAC_DEMPH_DISABLE_MASK },
+	{ PCM_ADC_CONTROL_THREE_REG, ADC_MASTER_VOLUME_CONTROL_MODE_MASK |
+		ADC_ATTEN_SPEED_SLOW_MASK },
+	{ PCM_ADC_CNTRL_ONE_REG, ADC_MASTER_MODE_512xFS |
+		ADC_LJ_24_BIT_TDM_MODE_MASK },
+	{ PCM_ADC_CNTRL_TWO_REG, ADC_CHAN_0_1_POWER_SAVE_DISABLE_MASK |
+		ADC_CHAN_2_3_POWER_SAVE_DISABLE_MASK |
+		ADC_CHAN_4_5_POWER_SAVE_DISABLE_MASK |
+		ADC_CHAN_4_5_NO_HPF_MASK },
+	{ PCM_DAC_CNTRL_TWO_REG, DAC_CHAN_0_1_NORMAL_MODE_MASK |
+		DAC_CHAN_2_3_NORMAL_MODE_MASK |
+		DAC_CHAN_4_5_NORMAL_MODE_MASK |
+		DAC_CHAN_6_7_NORMAL_MODE_MASK },
+};
+
+static void audio_evl_test_pcm3168a_config(struct kunit *test)
+{
+	struct audio_evl_test_ctx *ctx = test->priv;
+	struct i2c_board_info info = {
+		I2C_BOARD_INFO("pcm-3168a", 0x44),
+	};
+	struct audio_evl_hw_log_entry entry;
+	struct i2c_client *client;
+	int i;
+
+	ctx->adapter = audio_evl_hw_i2c_get_adapter(1);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->adapter);
+	client = audio_evl_hw_i2c_new_client(ctx->adapter, &info);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(client));
+
+	KUNIT_EXPECT_EQ(test, pcm3168a_config_codec(client), 0);
+	audio_evl_hw_i2c_unregister(client);
+	audio_evl_hw_i2c_put_adapter(ctx->adapter);
+
+	KUNIT_ASSERT_EQ(test, audio_evl_hw_log_get(0, NULL),
+			ARRAY_SIZE(test_pcm3168a_seq));
+	for (i = 0; i < ARRAY_SIZE(test_pcm3168a_seq); i++) {
+		audio_evl_hw_log_get(i, &entry);
+		KUNIT_EXPECT_EQ(test, entry.op, AUDIO_EVL_HW_I2C_WRITE);
+		KUNIT_EXPECT_EQ(test, entry.base, 0x44);
+		KUNIT_EXPECT_EQ(test, entry.reg, test_pcm3168a_seq[i][0]);
+		KUNIT_EXPECT_EQ(test, entry.value, test_pcm3168a_seq[i][1]);
+	}
+	test_expect_ops(test, 0, 0, ARRAY_SIZE(test_pcm3168a_seq));
+}
+
+static struct kunit_case audio_evl_test_cases[] = {
+	KUNIT_CASE(audio_evl_test_configure),
+	KUNIT_CASE(audio_evl_test_configure_packed),
+	KUNIT_CASE(audio_evl_test_clear_fifos),
+	KUNIT_CASE(audio_evl_test_clear_fifos_timeout),
+	KUNIT_CASE(audio_evl_test_clear_fifos_idle),
+	KUNIT_CASE(audio_evl_test_pcm3168a_config),
+	{}
+};
+
+static struct kunit_suite audio_evl_test_suite = {
+	.name = "audio-evl",
+	.suite_init = audio_evl_test_suite_init,
+	.suite_exit = audio_evl_test_suite_exit,
+	.init = audio_evl_test_init,
+	.test_cases = audio_evl_test_cases,
+};
+kunit_test_suite(audio_evl_test_suite);
+
+MODULE_DESCRIPTION("KUnit tests of the EVL audio driver");
+MODULE_AUTHOR("Nitin Kulkarni (nitin@elk.audio)");
+MODULE_LICENSE("GPL");
+MODULE_IMPORT_NS(EXPORTED_FOR_KUNIT_TESTING);
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief Tracepoints of the EVL audio driver period lifecycle
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM audio_evl
+
+#if !defined(AUDIO_EVL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define AUDIO_EVL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define AUDIO_EVL_TRACE_STEP_LEN	32
+
+DECLARE_EVENT_CLASS(audio_evl_period,
+	TP_PROTO(uint64_t period, unsigned int buffer_idx),
+	TP_ARGS(period, buffer_idx),
+
+	TP_STRUCT__entry(
+		__field(uint64_t, period)
+		__field(unsigned int, buffer_idx)
+	),
+
+	TP_fast_assign(
+		__entry->period = period;
+		__entry->buffer_idx = buffer_idx;
+	),
+
+	TP_printk("period=%llu buffer_idx=%u",
+		(unsigned long long)__entry->period, __entry->buffer_idx)
+);
+
+DEFINE_EVENT(audio_evl_period, audio_evl_dma_callback_entry,
+	TP_PROTO(uint64_t period, unsigned int buffer_idx),
+	TP_ARGS(period, buffer_idx)
+);
+
+DEFINE_EVENT(audio_evl_period, audio_evl_dma_callback_exit,
+	TP_PROTO(uint64_t period, unsigned int buffer_idx),
+	TP_ARGS(period, buffer_idx)
+);
+
+DEFINE_EVENT(audio_evl_period, audio_evl_raise_flag,
+	TP_PROTO(uint64_t period, unsigned int buffer_idx),
+	TP_ARGS(period, buffer_idx)
+);
+
+DEFINE_EVENT(audio_evl_period, audio_evl_irq_wait_return,
+	TP_PROTO(uint64_t period, unsigned int buffer_idx),
+	TP_ARGS(period, buffer_idx)
+);
+
+DEFINE_EVENT(audio_evl_period, audio_evl_proc_start,
+	TP_PROTO(uint64_t period, unsigned int buffer_idx),
+	TP_ARGS(period, buffer_idx)
+);
+
+DEFINE_EVENT(audio_evl_period, audio_evl_proc_stop,
+	TP_PROTO(uint64_t period, unsigned int buffer_idx),
+	TP_ARGS(period, buffer_idx)
+);
+
+TRACE_EVENT(audio_evl_userproc_finished,
+	TP_PROTO(uint64_t period, unsigned int buffer_idx, int under_runs),
+	TP_ARGS(period, buffer_idx, under_runs),
+
+	TP_STRUCT__entry(
+		__field(uint64_t, period)
+		__field(unsigned int, buffer_idx)
+		__field(int, under_runs)
+	),
+
+	TP_fast_assign(
+		__entry->period = period;
+		__entry->buffer_idx = buffer_idx;
+		__entry->under_runs = under_runs;
+	),
+
+	TP_printk("period=%llu buffer_idx=%u under_runs=%d",
+		(unsigned long long)__entry->period, __entry->buffer_idx,
+		__entry->under_runs)
+);
+
+DECLARE_EVENT_CLASS(audio_evl_init_step,
+	TP_PROTO(const char *step, int ret),
+	TP_ARGS(step, ret),
+
+	TP_STRUCT__entry(
+		__array(char, step, AUDIO_EVL_TRACE_STEP_LEN)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->step, step, AUDIO_EVL_TRACE_STEP_LEN);
+		__entry->ret = ret;
+	),
+
+	TP_printk("step=%s ret=%d", __entry->step, __entry->ret)
+);
+
+DEFINE_EVENT(audio_evl_init_step, audio_evl_init_step_begin,
+	TP_PROTO(const char *step, int ret),
+	TP_ARGS(step, ret)
+);
+
+DEFINE_EVENT(audio_evl_init_step, audio_evl_init_step_end,
+	TP_PROTO(const char *step, int ret),
+	TP_ARGS(step, ret)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE audio-evl-trace
+#include <trace/define_trace.h>
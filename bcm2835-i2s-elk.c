@@ -9,6 +9,7 @@
 #include <linux/device.h>
 #include <linux/slab.h>
 #include <linux/of_address.h>
+#include <linux/of.h>
 #include <linux/delay.h>
 #include <linux/module.h>
 #include <linux/dmaengine.h>
@@ -16,22 +17,129 @@
 #include <asm/io.h>
 #include <linux/gpio.h>
 #include <linux/clk.h>
+#include <linux/math64.h>
+#include <linux/interrupt.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/kernel_stat.h>
+#include <linux/seq_file.h>
+#include <kunit/visibility.h>
+
+#include <evl/clock.h>
+#include <evl/timer.h>
+#include <evl/work.h>
 
 #include "pcm3168a-elk.h"
 #include "rpi-audio-evl.h"
 #include "bcm2835-i2s-elk.h"
+#include "audio-evl-hat.h"
+#include "audio-evl-profile.h"
 #include "elk-pi-config.h"
-#include "hifi-berry-config.h"
-#include "hifi-berry-pro-config.h"
+
+#define CREATE_TRACE_POINTS
+#include "audio-evl-trace.h"
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(audio_evl_irq_wait_return);
+EXPORT_TRACEPOINT_SYMBOL_GPL(audio_evl_userproc_finished);
+EXPORT_TRACEPOINT_SYMBOL_GPL(audio_evl_proc_start);
+EXPORT_TRACEPOINT_SYMBOL_GPL(audio_evl_proc_stop);
+EXPORT_TRACEPOINT_SYMBOL_GPL(audio_evl_init_step_begin);
+EXPORT_TRACEPOINT_SYMBOL_GPL(audio_evl_init_step_end);
 
 #define BCM2835_PCM_WORD_LEN 	32
+#define BCM2835_PCM_PACKED_WORD_LEN	16
 #define BCM2835_PCM_SLOTS	2
 
-static struct audio_evl_dev *audio_dev_static;
+/* Probed I2S interfaces, indexed by id, a removed one frees its slot */
+static struct audio_evl_dev *audio_devs[AUDIO_EVL_MAX_DEVS];
+static int num_audio_devs;
+static DEFINE_MUTEX(audio_devs_lock);
+
+/* Consecutive periods with FIFO errors before the stream is restarted, 0 = never */
+static uint fifo_error_recovery_periods = 4;
+module_param(fifo_error_recovery_periods, uint, 0644);
+/* Consecutive periods with a channel slip before re-aligning, 0 = never */
+static uint frame_slip_confirm_periods = 2;
+module_param(frame_slip_confirm_periods, uint, 0644);
+/*
+ * Frames from the end of a capture period to the start of the output the
+ * client computes from it, -1 = a full period. Lower values cut the
+ * round-trip latency, the client has to finish within that time.
+ */
+static int tx_phase_frames = -1;
+module_param(tx_phase_frames, int, 0644);
+/* Capture what the outputs play instead of the inputs, a cable stand-in */
+static bool soft_loopback;
+module_param(soft_loopback, bool, 0644);
+/* Missing DMA callbacks, in periods, before restarting the stream, 0 = never */
+static uint watchdog_periods = 4;
+module_param(watchdog_periods, uint, 0644);
+/* Periods kept before and after an xrun by the flight recorder, 0 = off */
+static uint flight_window = 16;
+module_param(flight_window, uint, 0644);
+
+static struct dentry *bcm2835_i2s_debugfs_dir;
+
+static AUDIO_EVL_PROF(dma_callback);
+static AUDIO_EVL_PROF(cv_gates);
+
+/* DMA/FIFO thresholds, applied when the device is opened, -1 = hat default */
+static int dma_thr_tx = -1;
+module_param(dma_thr_tx, int, 0644);
+static int dma_thr_rx = -1;
+module_param(dma_thr_rx, int, 0644);
+static int dma_tx_panic_thr = -1;
+module_param(dma_tx_panic_thr, int, 0644);
+static int dma_rx_panic_thr = -1;
+module_param(dma_rx_panic_thr, int, 0644);
+static int dma_burst_size = -1;
+module_param(dma_burst_size, int, 0644);
+static int fifo_tx_thr = -1;
+module_param(fifo_tx_thr, int, 0644);
+static int fifo_rx_thr = -1;
+module_param(fifo_rx_thr, int, 0644);
+
+static LIST_HEAD(audio_evl_hats);
+static DEFINE_MUTEX(audio_evl_hats_lock);
 
 #ifdef BCM2835_I2S_CVGATES_SUPPORT
 static int cv_gate_out[NUM_OF_CVGATE_OUTS] = { CVGATE_OUTS_LIST };
 static int cv_gate_in[NUM_OF_CVGATE_INS] = { CVGATE_INS_LIST };
+/* GPIO block mapping, lets all gates be updated with single register accesses */
+static void __iomem *cv_gate_gpio_base;
+static uint32_t cv_gate_out_pins;
+/* Maps the cv_gate_out word to the GPSET0 mask of the corresponding pins */
+static uint32_t cv_gate_out_lut[BIT(NUM_OF_CVGATE_OUTS)];
+
+/* Gate output events of the current period, played by cv_gate_timer */
+struct cv_gate_pending_event {
+	ktime_t date;
+	uint32_t mask;
+};
+static struct evl_timer cv_gate_timer;
+static DEFINE_HARD_SPINLOCK(cv_gate_lock);
+static struct cv_gate_pending_event cv_gate_pending[AUDIO_MAX_CV_GATE_EVENTS];
+static int cv_gate_num_pending;
+static int cv_gate_next_pending;
+
+/* Gate input edges seen since the start of the current period */
+struct cv_gate_edge {
+	ktime_t date;
+	uint32_t mask;
+};
+static DEFINE_HARD_SPINLOCK(cv_gate_in_lock);
+static struct cv_gate_edge cv_gate_edges[AUDIO_MAX_CV_GATE_EVENTS];
+static int cv_gate_num_edges;
+static uint32_t cv_gate_dropped_edges;
+static int cv_gate_in_irq[NUM_OF_CVGATE_INS];
+static ktime_t cv_gate_in_period_ts;
+
+static const struct of_device_id bcm2835_gpio_of_match[] = {
+	{ .compatible = "brcm,bcm2835-gpio", },
+	{ .compatible = "brcm,bcm2711-gpio", },
+	{},
+};
 #endif
 
 void bcm2835_i2s_clear_fifos(struct audio_evl_dev *audio_dev,
@@ -79,79 +187,749 @@ void bcm2835_i2s_clear_fifos(struct audio_evl_dev *audio_dev,
 	rpi_reg_update_bits(audio_dev->i2s_base_addr, BCM2835_I2S_CS_A_REG,
 			BCM2835_I2S_RXON | BCM2835_I2S_TXON, i2s_active_state);
 }
+EXPORT_SYMBOL_IF_KUNIT(bcm2835_i2s_clear_fifos);
 
-static void bcm2835_i2s_synch_frame(struct audio_evl_dev *audio_dev,
+static inline int bcm2835_i2s_words_per_frame(struct audio_evl_dev *audio_dev)
+{
+	return audio_dev->packed_16bit ? audio_dev->num_channels / 2 :
+					audio_dev->num_channels;
+}
+
+static int bcm2835_i2s_synch_frame(struct audio_evl_dev *audio_dev,
 					uint32_t mask)
 {
+	ktime_t timeout = ktime_add_ms(evl_read_clock(&evl_mono_clock),
+				BCM2835_I2S_SYNCH_TIMEOUT_MS);
 	uint32_t val, discarded = 0;
-	int32_t tmp[9], samples[2] = {0xff, 0xff};
+	int32_t sample, history[BCM2835_I2S_SYNCH_MAX_LAG];
+	int i, pos = 0, lag = 1;
+	bool aligned = false;
+
+	/*
+	 * In packed mode both guard slots share one FIFO word, so compare it
+	 * with the same word one frame earlier instead of the previous one.
+	 */
+	if (audio_dev->packed_16bit)
+		lag = clamp(audio_dev->num_channels / 2, 1,
+				BCM2835_I2S_SYNCH_MAX_LAG);
+	for (i = 0; i < lag; i++)
+		history[i] = 0xff;
 
 	rpi_reg_update_bits(audio_dev->i2s_base_addr,
 		BCM2835_I2S_CS_A_REG, mask, mask);
 	/* Make sure channels are aligned in right order.
 	Last two channels from pcm3168 are always zero &
 	the probability of getting two successive zero values is nearly impossible */
-	while (samples[0] != 0 || samples[1] != 0) {
+	while (!aligned) {
+		if (ktime_after(evl_read_clock(&evl_mono_clock), timeout)) {
+			rpi_reg_update_bits(audio_dev->i2s_base_addr,
+				BCM2835_I2S_CS_A_REG, mask, 0);
+			printk(KERN_ERR "bcm2835-i2s: frame synch timed out, "
+				"%d samples discarded\n", discarded);
+			return -ETIMEDOUT;
+		}
 		rpi_reg_read(audio_dev->i2s_base_addr, BCM2835_I2S_CS_A_REG,
 					&val);
 		if (val & BCM2835_I2S_RXD) {
 			rpi_reg_write(audio_dev->i2s_base_addr, BCM2835_I2S_FIFO_A_REG,
 					0x00);
-			samples[1] = samples[0];
 			rpi_reg_read(audio_dev->i2s_base_addr, BCM2835_I2S_FIFO_A_REG,
-					&samples[0]);
-					tmp[discarded] = samples[0];
-					discarded++;
+					&sample);
+			aligned = !sample && !history[pos];
+			history[pos] = sample;
+			pos = (pos + 1) % lag;
+			discarded++;
 		}
 	}
 	printk(KERN_INFO "bcm2835-i2s: %d samples discarded\n",
 							discarded);
+	return 0;
 }
 
-void bcm2835_i2s_start_stop(struct audio_evl_dev *audio_dev, int cmd)
+static void bcm2835_i2s_arm_watchdog(struct audio_evl_dev *audio_dev,
+				ktime_t now)
+{
+	uint periods = READ_ONCE(watchdog_periods);
+
+	if (periods && audio_dev->period_ns)
+		evl_start_timer(&audio_dev->watchdog_timer,
+			ktime_add_ns(now, periods * audio_dev->period_ns),
+			EVL_INFINITE);
+}
+
+/* Returns -ETIMEDOUT if the stream could not be aligned on the frame */
+int bcm2835_i2s_start_stop(struct audio_evl_dev *audio_dev, int cmd)
 {
 	uint32_t mask;
+	int ret = 0;
 	wmb();
 	mask = BCM2835_I2S_RXON | BCM2835_I2S_TXON;
 
 	if (cmd == BCM2835_I2S_START_CMD) {
-		if (!strcmp(audio_dev->audio_hat, "elk-pi")) {
-			bcm2835_i2s_synch_frame(audio_dev, mask);
+		bcm2835_i2s_arm_watchdog(audio_dev,
+				evl_read_clock(&evl_mono_clock));
+		if (audio_dev->hat->sync == AUDIO_EVL_SYNC_GUARD_SLOTS) {
+			ret = bcm2835_i2s_synch_frame(audio_dev, mask);
+			if (ret)
+				evl_stop_timer(&audio_dev->watchdog_timer);
 		} else {
 			rpi_reg_update_bits(audio_dev->i2s_base_addr,
 				BCM2835_I2S_CS_A_REG, mask, mask);
 		}
 	} else {
+		evl_stop_timer(&audio_dev->watchdog_timer);
 		rpi_reg_update_bits(audio_dev->i2s_base_addr,
 			BCM2835_I2S_CS_A_REG, mask, 0);
 	}
+	return ret;
 }
 EXPORT_SYMBOL_GPL(bcm2835_i2s_start_stop);
 
-static void bcm2835_i2s_dma_callback(void *data)
+/*
+ * Start or stop several interfaces sharing the same bit clock and frame
+ * sync. The enables are written back to back with hard irqs off so that
+ * all of them start on the same frame.
+ */
+void bcm2835_i2s_start_stop_group(struct audio_evl_dev **devs, int num_devs,
+				int cmd)
 {
+	unsigned long flags;
+	uint32_t mask = BCM2835_I2S_RXON | BCM2835_I2S_TXON;
+	ktime_t now = evl_read_clock(&evl_mono_clock);
 	int i;
-	uint32_t val;
-	struct audio_evl_dev *audio_dev = data;
 
-	audio_dev->kinterrupts++;
-	audio_dev->buffer_idx = ~(audio_dev->buffer_idx) & 0x1;
+	/* Each interface has its own watchdog, as in bcm2835_i2s_start_stop() */
+	for (i = 0; i < num_devs; i++) {
+		if (cmd == BCM2835_I2S_START_CMD)
+			bcm2835_i2s_arm_watchdog(devs[i], now);
+		else
+			evl_stop_timer(&devs[i]->watchdog_timer);
+	}
+	wmb();
+	flags = hard_local_irq_save();
+	for (i = 0; i < num_devs; i++)
+		rpi_reg_update_bits(devs[i]->i2s_base_addr,
+			BCM2835_I2S_CS_A_REG, mask,
+			cmd == BCM2835_I2S_START_CMD ? mask : 0);
+	hard_local_irq_restore(flags);
+}
+EXPORT_SYMBOL_GPL(bcm2835_i2s_start_stop_group);
 
-	evl_raise_flag(&audio_dev->event_flag);
 #ifdef BCM2835_I2S_CVGATES_SUPPORT
-	if (audio_dev->cv_gate_enabled) {
-		for (i = 0; i < NUM_OF_CVGATE_OUTS; i++) {
-			val = (unsigned long) *audio_dev->buffer->cv_gate_out &
-			BIT(i);
-			gpio_set_value(cv_gate_out[i], val);
+/* Called oob, so through the mapped GPIO block only, never gpiolib */
+static void bcm2835_i2s_write_cv_gates(uint32_t val)
+{
+	uint32_t set;
+
+	set = cv_gate_out_lut[val & (BIT(NUM_OF_CVGATE_OUTS) - 1)];
+	rpi_reg_write(cv_gate_gpio_base, BCM2835_GPIO_GPSET0_REG, set);
+	rpi_reg_write(cv_gate_gpio_base, BCM2835_GPIO_GPCLR0_REG,
+			cv_gate_out_pins & ~set);
+}
+
+static uint32_t bcm2835_i2s_read_cv_gates(void)
+{
+	int i;
+	uint32_t lev, val = 0;
+
+	rpi_reg_read(cv_gate_gpio_base, BCM2835_GPIO_GPLEV0_REG, &lev);
+	for (i = 0; i < NUM_OF_CVGATE_INS; i++)
+		val |= ((lev >> cv_gate_in[i]) & 0x1) << i;
+	return val;
+}
+
+static void bcm2835_i2s_cv_gate_timer_handler(struct evl_timer *timer)
+{
+	unsigned long flags;
+	ktime_t now;
+	struct cv_gate_pending_event *event;
+
+	raw_spin_lock_irqsave(&cv_gate_lock, flags);
+	now = evl_read_clock(&evl_mono_clock);
+	while (cv_gate_next_pending < cv_gate_num_pending) {
+		event = &cv_gate_pending[cv_gate_next_pending];
+		if (ktime_after(event->date, now)) {
+			evl_start_timer(timer, event->date, EVL_INFINITE);
+			break;
 		}
-		val = 0;
-		for (i = 0; i < NUM_OF_CVGATE_INS; i++) {
-		val |= gpio_get_value(cv_gate_in[i]) << i;
+		bcm2835_i2s_write_cv_gates(event->mask);
+		cv_gate_next_pending++;
+	}
+	raw_spin_unlock_irqrestore(&cv_gate_lock, flags);
+}
+
+/*
+ * Take the gate events the client queued with its output buffer and
+ * schedule them relative to the time that buffer starts playing. That is
+ * the start of the current period, or tx_phase_frames after the start of
+ * the previous one with a tx lead-in, in which case the events already
+ * due are played at once.
+ */
+static void bcm2835_i2s_schedule_cv_gates(struct audio_evl_dev *audio_dev)
+{
+	unsigned long flags;
+	uint32_t i, num_events, frame_offset;
+	struct audio_cv_gate_events *events =
+				audio_dev->buffer->cv_gate_out_events;
+	ktime_t play_ts = audio_dev->period_ts;
+
+	if (audio_dev->tx_phase_frames < audio_dev->period_frames)
+		play_ts = ktime_sub_ns(play_ts, div_u64((uint64_t)
+			(audio_dev->period_frames - audio_dev->tx_phase_frames) *
+			NSEC_PER_SEC, audio_dev->sampling_rate));
+
+	num_events = min_t(uint32_t, READ_ONCE(events->num_events),
+				AUDIO_MAX_CV_GATE_EVENTS);
+
+	raw_spin_lock_irqsave(&cv_gate_lock, flags);
+	evl_stop_timer(&cv_gate_timer);
+	cv_gate_num_pending = 0;
+	cv_gate_next_pending = 0;
+	for (i = 0; i < num_events; i++) {
+		frame_offset = events->events[i].frame_offset;
+		if (frame_offset >= audio_dev->period_frames)
+			break;
+		cv_gate_pending[i].date = ktime_add_ns(play_ts,
+			div_u64((uint64_t)frame_offset * NSEC_PER_SEC,
+				audio_dev->sampling_rate));
+		cv_gate_pending[i].mask = events->events[i].mask;
+		cv_gate_num_pending++;
+	}
+	if (cv_gate_num_pending)
+		evl_start_timer(&cv_gate_timer, cv_gate_pending[0].date,
+				EVL_INFINITE);
+	raw_spin_unlock_irqrestore(&cv_gate_lock, flags);
+
+	WRITE_ONCE(events->num_events, 0);
+}
+
+static irqreturn_t bcm2835_i2s_cv_gate_in_irq(int irq, void *data)
+{
+	unsigned long flags;
+	ktime_t now = evl_read_clock(&evl_mono_clock);
+	uint32_t mask = bcm2835_i2s_read_cv_gates();
+	struct audio_event event = {
+		.type = AUDIO_EVENT_GATE,
+		.size = sizeof(mask),
+	};
+
+	raw_spin_lock_irqsave(&cv_gate_in_lock, flags);
+	if (cv_gate_num_edges < AUDIO_MAX_CV_GATE_EVENTS) {
+		cv_gate_edges[cv_gate_num_edges].date = now;
+		cv_gate_edges[cv_gate_num_edges].mask = mask;
+		cv_gate_num_edges++;
+	} else {
+		cv_gate_dropped_edges++;
+	}
+	raw_spin_unlock_irqrestore(&cv_gate_in_lock, flags);
+
+	memcpy(event.data, &mask, sizeof(mask));
+	if (audio_devs[0])
+		bcm2835_i2s_post_event(audio_devs[0], &event, now);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Hand the input edges of the period which just ended to the client,
+ * with their dates converted to frame offsets in that period.
+ */
+static void bcm2835_i2s_publish_cv_gate_edges(struct audio_evl_dev *audio_dev)
+{
+	unsigned long flags;
+	int i;
+	int64_t delta;
+	uint32_t frame_offset;
+	struct audio_cv_gate_events *events =
+				audio_dev->buffer->cv_gate_in_events;
+
+	raw_spin_lock_irqsave(&cv_gate_in_lock, flags);
+	for (i = 0; i < cv_gate_num_edges; i++) {
+		delta = ktime_to_ns(ktime_sub(cv_gate_edges[i].date,
+					cv_gate_in_period_ts));
+		if (delta < 0 || !cv_gate_in_period_ts)
+			delta = 0;
+		frame_offset = div_u64((uint64_t)delta * audio_dev->sampling_rate,
+					NSEC_PER_SEC);
+		if (frame_offset >= audio_dev->period_frames)
+			frame_offset = audio_dev->period_frames - 1;
+		events->events[i].frame_offset = frame_offset;
+		events->events[i].mask = cv_gate_edges[i].mask;
+	}
+	events->dropped = cv_gate_dropped_edges;
+	smp_store_release(&events->num_events, cv_gate_num_edges);
+	cv_gate_num_edges = 0;
+	cv_gate_dropped_edges = 0;
+	cv_gate_in_period_ts = audio_dev->period_ts;
+	raw_spin_unlock_irqrestore(&cv_gate_in_lock, flags);
+}
+
+/*
+ * Runs before the client is woken up: it mustn't see the gate inputs half
+ * published, and the output events it queues for the next period mustn't
+ * be reset under it.
+ */
+static void bcm2835_i2s_update_cv_gates(struct audio_evl_dev *audio_dev)
+{
+	struct audio_evl_buffers *audio_buffer = audio_dev->buffer;
+	ktime_t prof_start = audio_evl_prof_begin();
+
+	/* Queued events set the gates themselves, from the state they are in */
+	if (!READ_ONCE(audio_buffer->cv_gate_out_events->num_events))
+		bcm2835_i2s_write_cv_gates(*audio_buffer->cv_gate_out);
+	*audio_buffer->cv_gate_in = bcm2835_i2s_read_cv_gates();
+	bcm2835_i2s_publish_cv_gate_edges(audio_dev);
+	bcm2835_i2s_schedule_cv_gates(audio_dev);
+	audio_evl_prof_end(&cv_gates, prof_start);
+}
+#endif
+
+/* Returns the AUDIO_EVL_FLIGHT_* error flags of the period */
+static uint16_t bcm2835_i2s_check_fifo_errors(struct audio_evl_dev *audio_dev)
+{
+	uint32_t csreg, intstc;
+	uint16_t flags = 0;
+
+	rpi_reg_read(audio_dev->i2s_base_addr, BCM2835_I2S_CS_A_REG, &csreg);
+	if (likely(!(csreg & (BCM2835_I2S_CS_TXERR | BCM2835_I2S_CS_RXERR)))) {
+		audio_dev->fifo_error_periods = 0;
+		return 0;
+	}
+
+	if (csreg & BCM2835_I2S_CS_TXERR) {
+		audio_dev->tx_fifo_errors++;
+		flags |= AUDIO_EVL_FLIGHT_TX_ERR;
+	}
+	if (csreg & BCM2835_I2S_CS_RXERR) {
+		audio_dev->rx_fifo_errors++;
+		flags |= AUDIO_EVL_FLIGHT_RX_ERR;
+	}
+
+	/* Error flags are cleared by writing them back as 1 */
+	rpi_reg_write(audio_dev->i2s_base_addr, BCM2835_I2S_CS_A_REG, csreg);
+	rpi_reg_read(audio_dev->i2s_base_addr, BCM2835_I2S_INTSTC_A_REG, &intstc);
+	rpi_reg_write(audio_dev->i2s_base_addr, BCM2835_I2S_INTSTC_A_REG, intstc);
+
+	/*
+	 * Clearing the FIFOs mid-stream would rotate the channels, the work
+	 * restarts the stream in-band like a resync instead.
+	 */
+	audio_dev->fifo_error_periods++;
+	if (fifo_error_recovery_periods &&
+	    audio_dev->fifo_error_periods >= fifo_error_recovery_periods &&
+	    !READ_ONCE(audio_dev->fifo_recovery_pending)) {
+		WRITE_ONCE(audio_dev->fifo_recovery_pending, true);
+		evl_call_inband(&audio_dev->fifo_recovery_work);
+		audio_dev->fifo_error_periods = 0;
+	}
+	return flags;
+}
+
+/* Freeze the records around the next period, unless a freeze is pending */
+void bcm2835_i2s_flight_trigger(struct audio_evl_dev *audio_dev)
+{
+	if (flight_window && !READ_ONCE(audio_dev->flight_trigger))
+		WRITE_ONCE(audio_dev->flight_trigger, audio_dev->kinterrupts);
+}
+EXPORT_SYMBOL_GPL(bcm2835_i2s_flight_trigger);
+
+static void bcm2835_i2s_flight_freeze(struct audio_evl_dev *audio_dev)
+{
+	unsigned long flags;
+	uint64_t trigger = audio_dev->flight_trigger;
+	uint window = min_t(uint, flight_window, AUDIO_EVL_FLIGHT_RING / 2 - 1);
+	uint64_t period = trigger > window ? trigger - window : 1;
+	int n = 0;
+
+	if (audio_dev->kinterrupts <= trigger + window)
+		return;
+
+	raw_spin_lock_irqsave(&audio_dev->flight_lock, flags);
+	for (; period <= trigger + window; period++) {
+		struct audio_evl_flight_record *record =
+				bcm2835_i2s_flight_record(audio_dev, period);
+
+		if (record)
+			audio_dev->flight_frozen[n++] = *record;
+	}
+	audio_dev->flight_header.magic = AUDIO_EVL_FLIGHT_MAGIC;
+	audio_dev->flight_header.version = AUDIO_EVL_FLIGHT_VERSION;
+	audio_dev->flight_header.record_size =
+				sizeof(struct audio_evl_flight_record);
+	audio_dev->flight_header.num_records = n;
+	audio_dev->flight_header.triggers = ++audio_dev->flight_triggers;
+	audio_dev->flight_header.trigger_period = trigger;
+	raw_spin_unlock_irqrestore(&audio_dev->flight_lock, flags);
+
+	WRITE_ONCE(audio_dev->flight_trigger, 0);
+}
+
+/*
+ * Claim the period's record before the client is woken up, it stamps its
+ * wakeup and finish dates there.
+ */
+static void bcm2835_i2s_flight_begin(struct audio_evl_dev *audio_dev,
+				ktime_t start)
+{
+	struct audio_evl_flight_record *record = &audio_dev->flight_ring[
+			audio_dev->kinterrupts & (AUDIO_EVL_FLIGHT_RING - 1)];
+	unsigned int irqs = kstat_cpu_irqs_sum(raw_smp_processor_id());
+
+	record->callback_ns = ktime_to_ns(start);
+	record->wakeup_ns = 0;
+	record->finish_ns = 0;
+	record->flags = 0;
+	record->callback_duration_ns = 0;
+	record->irqs = irqs - audio_dev->flight_irqs;
+	audio_dev->flight_irqs = irqs;
+	record->period = audio_dev->kinterrupts;
+}
+
+/* The rest of the callback's figures, the client may be running already */
+static void bcm2835_i2s_flight_update(struct audio_evl_dev *audio_dev,
+				ktime_t start, uint16_t flags)
+{
+	struct audio_evl_flight_record *record = &audio_dev->flight_ring[
+			audio_dev->kinterrupts & (AUDIO_EVL_FLIGHT_RING - 1)];
+
+	record->flags |= flags;
+	record->callback_duration_ns = ktime_to_ns(ktime_sub(
+				evl_read_clock(&evl_mono_clock), start));
+
+	if (flags)
+		bcm2835_i2s_flight_trigger(audio_dev);
+	if (audio_dev->flight_trigger)
+		bcm2835_i2s_flight_freeze(audio_dev);
+}
+
+static int bcm2835_i2s_flight_open(struct inode *inode, struct file *file)
+{
+	struct audio_evl_dev *audio_dev = inode->i_private;
+	struct audio_evl_flight_header *header;
+	unsigned long flags;
+	size_t len;
+
+	/* Snapshot, so the dump is consistent over several reads */
+	header = kvmalloc(sizeof(*header) + sizeof(audio_dev->flight_frozen),
+			GFP_KERNEL);
+	if (!header)
+		return -ENOMEM;
+
+	raw_spin_lock_irqsave(&audio_dev->flight_lock, flags);
+	*header = audio_dev->flight_header;
+	len = header->num_records * sizeof(struct audio_evl_flight_record);
+	memcpy(header + 1, audio_dev->flight_frozen, len);
+	raw_spin_unlock_irqrestore(&audio_dev->flight_lock, flags);
+
+	file->private_data = header;
+	return 0;
+}
+
+static ssize_t bcm2835_i2s_flight_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct audio_evl_flight_header *header = file->private_data;
+
+	if (!header->magic)
+		return 0;
+	return simple_read_from_buffer(buf, count, ppos, header,
+		sizeof(*header) +
+		header->num_records * sizeof(struct audio_evl_flight_record));
+}
+
+static int bcm2835_i2s_flight_release(struct inode *inode, struct file *file)
+{
+	kvfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations bcm2835_i2s_flight_fops = {
+	.owner		= THIS_MODULE,
+	.open		= bcm2835_i2s_flight_open,
+	.read		= bcm2835_i2s_flight_read,
+	.release	= bcm2835_i2s_flight_release,
+	.llseek		= default_llseek,
+};
+
+/*
+ * Queue an input event for the client, it is published on the next period
+ * with its date converted to a frame offset. Callable from any context.
+ */
+int bcm2835_i2s_post_event(struct audio_evl_dev *audio_dev,
+			const struct audio_event *event, ktime_t date)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	raw_spin_lock_irqsave(&audio_dev->event_lock, flags);
+	if (audio_dev->num_pending_events < AUDIO_MAX_EVENTS) {
+		struct audio_evl_pending_event *pending =
+			&audio_dev->pending_events[audio_dev->num_pending_events++];
+
+		pending->date = date;
+		pending->event = *event;
+	} else {
+		audio_dev->dropped_events++;
+		ret = -ENOSPC;
+	}
+	raw_spin_unlock_irqrestore(&audio_dev->event_lock, flags);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(bcm2835_i2s_post_event);
+
+static void bcm2835_i2s_publish_events(struct audio_evl_dev *audio_dev)
+{
+	unsigned long flags;
+	int i;
+	int64_t delta;
+	uint32_t frame_offset;
+	struct audio_event_queue *queue = audio_dev->buffer->events_in;
+
+	raw_spin_lock_irqsave(&audio_dev->event_lock, flags);
+	for (i = 0; i < audio_dev->num_pending_events; i++) {
+		struct audio_evl_pending_event *pending =
+						&audio_dev->pending_events[i];
+
+		delta = ktime_to_ns(ktime_sub(pending->date,
+					audio_dev->events_period_ts));
+		if (delta < 0 || !audio_dev->events_period_ts)
+			delta = 0;
+		frame_offset = div_u64((uint64_t)delta * audio_dev->sampling_rate,
+					NSEC_PER_SEC);
+		if (frame_offset >= audio_dev->period_frames)
+			frame_offset = audio_dev->period_frames - 1;
+		queue->events[i] = pending->event;
+		queue->events[i].frame_offset = frame_offset;
+	}
+	queue->dropped = audio_dev->dropped_events;
+	/* The events before their count, the client may read it right away */
+	smp_store_release(&queue->num_events, audio_dev->num_pending_events);
+	audio_dev->num_pending_events = 0;
+	audio_dev->dropped_events = 0;
+	audio_dev->events_period_ts = audio_dev->period_ts;
+	raw_spin_unlock_irqrestore(&audio_dev->event_lock, flags);
+}
+
+/*
+ * The last two slots of the pcm3168a TDM frame are always zero, any other
+ * value there in the first or the last frame of the period means the
+ * channels are rotated.
+ */
+static void bcm2835_i2s_check_frame_slip(struct audio_evl_dev *audio_dev)
+{
+	struct audio_evl_buffers *audio_buffer = audio_dev->buffer;
+	uint32_t *rx, *last, guard;
+	int wpf = bcm2835_i2s_words_per_frame(audio_dev);
+
+	if (READ_ONCE(audio_dev->resync_pending))
+		return;
+
+	rx = audio_buffer->rx_buf +
+		(audio_dev->buffer_idx ? 0 : audio_buffer->period_len);
+	last = rx + (audio_dev->period_frames - 1) * wpf;
+	/* Packed mode has both guard slots in the last word of the frame */
+	guard = rx[wpf - 1] | last[wpf - 1];
+	if (!audio_dev->packed_16bit)
+		guard |= rx[wpf - 2] | last[wpf - 2];
+	if (likely(!guard)) {
+		audio_dev->slip_periods = 0;
+		return;
+	}
+
+	if (++audio_dev->slip_periods >= frame_slip_confirm_periods) {
+		WRITE_ONCE(audio_dev->resync_pending, true);
+		evl_call_inband(&audio_dev->resync_work);
+	}
+}
+
+void bcm2835_i2s_set_monitor(struct audio_evl_dev *audio_dev,
+			const struct audio_evl_monitor_route *routes,
+			int num_routes)
+{
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&audio_dev->monitor_lock, flags);
+	memcpy(audio_dev->monitor_routes, routes, num_routes * sizeof(*routes));
+	audio_dev->num_monitor_routes = num_routes;
+	raw_spin_unlock_irqrestore(&audio_dev->monitor_lock, flags);
+}
+EXPORT_SYMBOL_GPL(bcm2835_i2s_set_monitor);
+
+/*
+ * Add the monitor routes of the idx rx half to the idx tx half, with
+ * saturation. With replace the tx half is silenced first, for periods the
+ * client didn't fill.
+ */
+void bcm2835_i2s_monitor_mix(struct audio_evl_dev *audio_dev, int idx,
+			bool replace)
+{
+	struct audio_evl_buffers *buffers = audio_dev->buffer;
+	int frames = audio_dev->period_frames;
+	int stride = audio_dev->num_channels;
+	void *rx = buffers->rx_buf + idx * buffers->period_len;
+	void *tx = buffers->tx_buf + idx * buffers->period_len;
+	enum codec_sample_format format = audio_dev->hat->format;
+	int64_t max, sample;
+	unsigned long flags;
+	int i, r;
+
+	if (audio_dev->packed_16bit)
+		max = S16_MAX;
+	else if (format == INT24_RJ || format == INT24_32RJ)
+		max = 0x7fffff;
+	else
+		max = S32_MAX;
+
+	raw_spin_lock_irqsave(&audio_dev->monitor_lock, flags);
+	if (audio_dev->num_monitor_routes && replace)
+		memset(tx, 0, buffers->period_len);
+	for (r = 0; r < audio_dev->num_monitor_routes; r++) {
+		const struct audio_evl_monitor_route *route =
+						&audio_dev->monitor_routes[r];
+		int in = route->in_slot, out = route->out_slot;
+
+		for (i = 0; i < frames; i++, in += stride, out += stride) {
+			if (audio_dev->packed_16bit) {
+				int16_t *tx16 = tx;
+
+				sample = tx16[out] + ((((int16_t *)rx)[in] *
+						(int64_t)route->gain) >> 15);
+				tx16[out] = clamp(sample, -max - 1, max);
+			} else {
+				int32_t *tx32 = tx;
+
+				sample = tx32[out] + ((((int32_t *)rx)[in] *
+						(int64_t)route->gain) >> 15);
+				tx32[out] = clamp(sample, -max - 1, max);
+			}
 		}
-		*audio_dev->buffer->cv_gate_in = val;
 	}
+	raw_spin_unlock_irqrestore(&audio_dev->monitor_lock, flags);
+}
+EXPORT_SYMBOL_GPL(bcm2835_i2s_monitor_mix);
+
+/*
+ * Overwrite the period just captured with what the tx DMA played during
+ * it, the tx ring lags the rx one by a period plus the tx phase when a
+ * lead-in is used.
+ */
+static void bcm2835_i2s_soft_loopback(struct audio_evl_dev *audio_dev)
+{
+	struct audio_evl_buffers *buffers = audio_dev->buffer;
+	int frames = audio_dev->period_frames;
+	size_t frame_len = buffers->period_len / frames;
+	void *rx = buffers->rx_buf +
+			(audio_dev->buffer_idx ? 0 : 1) * buffers->period_len;
+	int pos, len;
+
+	pos = ((audio_dev->kinterrupts - 1) & 0x1) * frames;
+	if (audio_dev->tx_phase_frames < frames)
+		pos -= frames + audio_dev->tx_phase_frames;
+	if (pos < 0)
+		pos += 2 * frames;
+	len = min(frames, 2 * frames - pos);
+	memcpy(rx, buffers->tx_buf + pos * frame_len, len * frame_len);
+	if (len < frames)
+		memcpy(rx + len * frame_len, buffers->tx_buf,
+			(frames - len) * frame_len);
+}
+
+/*
+ * Play the impulse at the start of the half the client would fill now, as
+ * the output of the first frame just captured, then look for it on the
+ * input. The latency is counted from that first frame.
+ */
+static void bcm2835_i2s_calibrate_period(struct audio_evl_dev *audio_dev)
+{
+	struct audio_evl_calibration *calib = &audio_dev->calib;
+	int frames = audio_dev->period_frames;
+	int stride = audio_dev->num_channels;
+	size_t offset = (audio_dev->buffer_idx ? 0 : 1) * frames * stride;
+	int32_t *rx = (int32_t *)audio_dev->buffer->rx_buf + offset;
+	int32_t *tx = (int32_t *)audio_dev->buffer->tx_buf + offset;
+	int i;
+
+	for (i = 0; i < frames; i++) {
+		if (abs(rx[i * stride + calib->rx_slot]) > calib->threshold)
+			break;
+	}
+
+	switch (calib->state) {
+	case AUDIO_EVL_CALIB_ARMED:
+		if (i < frames) {
+			WRITE_ONCE(calib->state, AUDIO_EVL_CALIB_NOISY);
+		} else if (audio_dev->kinterrupts >=
+				BCM2835_I2S_CALIB_SETTLE_PERIODS) {
+			tx[calib->tx_slot] = calib->impulse;
+			calib->emit_period = audio_dev->kinterrupts;
+			WRITE_ONCE(calib->state, AUDIO_EVL_CALIB_WAITING);
+		}
+		break;
+	case AUDIO_EVL_CALIB_WAITING:
+		/* The half has been played, silence it for the next round */
+		if (audio_dev->kinterrupts == calib->emit_period + 2)
+			tx[calib->tx_slot] = 0;
+		if (i < frames) {
+			calib->latency_frames = (audio_dev->kinterrupts -
+					calib->emit_period) * frames + i;
+			WRITE_ONCE(calib->state, AUDIO_EVL_CALIB_DONE);
+		}
+		break;
+	}
+}
+
+static void bcm2835_i2s_dma_callback(void *data)
+{
+	struct audio_evl_dev *audio_dev = data;
+	ktime_t now = evl_read_clock(&evl_mono_clock);
+	int64_t interval;
+	uint16_t errors;
+
+	if (audio_dev->kinterrupts) {
+		interval = ktime_to_ns(ktime_sub(now, audio_dev->period_ts));
+		if (interval < audio_dev->period_interval_min_ns)
+			audio_dev->period_interval_min_ns = interval;
+		if (interval > audio_dev->period_interval_max_ns)
+			audio_dev->period_interval_max_ns = interval;
+	}
+	audio_dev->period_ts = now;
+	bcm2835_i2s_arm_watchdog(audio_dev, now);
+	audio_dev->kinterrupts++;
+	audio_dev->buffer_idx = ~(audio_dev->buffer_idx) & 0x1;
+	audio_dev->buffer->status->period_count = audio_dev->kinterrupts;
+	audio_dev->buffer->status->period_ts_ns = ktime_to_ns(now);
+	trace_audio_evl_dma_callback_entry(audio_dev->kinterrupts,
+					audio_dev->buffer_idx);
+	if (READ_ONCE(soft_loopback))
+		bcm2835_i2s_soft_loopback(audio_dev);
+	if (audio_dev->calib.state == AUDIO_EVL_CALIB_ARMED ||
+	    audio_dev->calib.state == AUDIO_EVL_CALIB_WAITING) {
+		bcm2835_i2s_calibrate_period(audio_dev);
+	} else if (audio_dev->num_monitor_routes &&
+		   audio_dev->monitor_period + 1 < audio_dev->kinterrupts) {
+		/* No client output for the previous period, keep monitoring */
+		bcm2835_i2s_monitor_mix(audio_dev,
+				audio_dev->buffer_idx ? 0 : 1, true);
+	}
+
+	bcm2835_i2s_publish_events(audio_dev);
+#ifdef BCM2835_I2S_CVGATES_SUPPORT
+	if (audio_dev->cv_gate_enabled)
+		bcm2835_i2s_update_cv_gates(audio_dev);
 #endif
+
+	bcm2835_i2s_flight_begin(audio_dev, now);
+	trace_audio_evl_raise_flag(audio_dev->kinterrupts,
+					audio_dev->buffer_idx);
+	evl_raise_flag(&audio_dev->event_flag);
+	errors = bcm2835_i2s_check_fifo_errors(audio_dev);
+	if (audio_dev->frame_slip_check && frame_slip_confirm_periods)
+		bcm2835_i2s_check_frame_slip(audio_dev);
+	bcm2835_i2s_flight_update(audio_dev, now, errors);
+	trace_audio_evl_dma_callback_exit(audio_dev->kinterrupts,
+					audio_dev->buffer_idx);
+	audio_evl_prof_end(&dma_callback, now);
 }
 
 static struct dma_async_tx_descriptor *
@@ -170,9 +948,14 @@ bcm2835_i2s_dma_prepare_cyclic(struct audio_evl_dev *audio_dev,
 	if (dir == DMA_MEM_TO_DEV) {
 		cfg.dst_addr = audio_dev->fifo_dma_addr;
 		cfg.dst_addr_width = audio_dev->addr_width;
-		cfg.dst_maxburst = audio_dev->dma_burst_size;
+		cfg.dst_maxburst = audio_dev->dma_params.burst_size;
 		chan = audio_dev->dma_tx;
-		flags = DMA_PREP_INTERRUPT | DMA_CTRL_ACK | DMA_OOB_INTERRUPT;
+		/*
+		 * Only the rx side has a callback, keep the tx ring's
+		 * interrupts off. The lead-in played before it, if any,
+		 * still completes with an oob interrupt.
+		 */
+		flags = DMA_CTRL_ACK;
 
 		if (dmaengine_slave_config(chan, &cfg)) {
 			dev_warn(audio_dev->dev, "DMA slave config failed\n");
@@ -184,7 +967,7 @@ bcm2835_i2s_dma_prepare_cyclic(struct audio_evl_dev *audio_dev,
 	} else if (dir == DMA_DEV_TO_MEM) {
 		cfg.src_addr = audio_dev->fifo_dma_addr;
 		cfg.src_addr_width = audio_dev->addr_width;
-		cfg.src_maxburst = audio_dev->dma_burst_size;
+		cfg.src_maxburst = audio_dev->dma_params.burst_size;
 		chan = audio_dev->dma_rx;
 		flags = DMA_PREP_INTERRUPT | DMA_CTRL_ACK | DMA_OOB_INTERRUPT;
 
@@ -204,6 +987,7 @@ bcm2835_i2s_dma_prepare_cyclic(struct audio_evl_dev *audio_dev,
 
 static int bcm2835_i2s_dma_prepare(struct audio_evl_dev *audio_dev)
 {
+	struct audio_evl_buffers *audio_buffers = audio_dev->buffer;
 	int err;
 	audio_dev->tx_desc = bcm2835_i2s_dma_prepare_cyclic(audio_dev, DMA_MEM_TO_DEV);
 	if (!audio_dev->tx_desc) {
@@ -223,12 +1007,40 @@ static int bcm2835_i2s_dma_prepare(struct audio_evl_dev *audio_dev)
 	}
 	audio_dev->rx_desc->callback = bcm2835_i2s_dma_callback;
 	audio_dev->rx_desc->callback_param = audio_dev;
+
+	/*
+	 * Delay the tx ring by a period plus the phase, so that the half the
+	 * client fills after a capture period starts playing tx_phase_frames
+	 * later. The lead-in plays the end of the zeroed tx buffer.
+	 */
+	audio_dev->tx_lead_desc = NULL;
+	if (audio_dev->tx_phase_frames < audio_dev->period_frames) {
+		size_t frame_len = audio_buffers->period_len /
+					audio_dev->period_frames;
+
+		audio_dev->tx_lead_desc = dmaengine_prep_slave_single(
+			audio_dev->dma_tx, audio_buffers->tx_phys_addr +
+			(audio_dev->period_frames - audio_dev->tx_phase_frames) *
+				frame_len,
+			(audio_dev->period_frames + audio_dev->tx_phase_frames) *
+				frame_len, DMA_MEM_TO_DEV,
+			DMA_PREP_INTERRUPT | DMA_CTRL_ACK | DMA_OOB_INTERRUPT);
+		if (!audio_dev->tx_lead_desc) {
+			dev_err(audio_dev->dev,
+				"failed to get DMA TX lead-in descriptor\n");
+			dmaengine_terminate_async(audio_dev->dma_tx);
+			dmaengine_terminate_async(audio_dev->dma_rx);
+			return -EBUSY;
+		}
+	}
 	return 0;
 }
 
 static void bcm2835_i2s_submit_dma(struct audio_evl_dev *audio_dev)
 {
 	dmaengine_submit(audio_dev->rx_desc);
+	if (audio_dev->tx_lead_desc)
+		dmaengine_submit(audio_dev->tx_lead_desc);
 	dmaengine_submit(audio_dev->tx_desc);
 
 	dma_async_issue_pending(audio_dev->dma_rx);
@@ -270,39 +1082,120 @@ static int bcm2835_i2s_dma_setup(struct audio_evl_dev *audio_dev)
 }
 
 #ifdef BCM2835_I2S_CVGATES_SUPPORT
+static int bcm2835_map_cv_gates(void)
+{
+	struct device_node *np;
+	uint32_t mask;
+	int i;
+
+	np = of_find_matching_node(NULL, bcm2835_gpio_of_match);
+	if (!np) {
+		printk(KERN_ERR "bcm2835-i2s: no gpio node for the cv gates\n");
+		return -ENODEV;
+	}
+	cv_gate_gpio_base = of_iomap(np, 0);
+	of_node_put(np);
+	if (!cv_gate_gpio_base) {
+		printk(KERN_ERR "bcm2835-i2s: failed to map the cv gate gpios\n");
+		return -ENOMEM;
+	}
+
+	/* All gate pins live in the first GPIO bank */
+	cv_gate_out_pins = 0;
+	for (i = 0; i < NUM_OF_CVGATE_OUTS; i++)
+		cv_gate_out_pins |= BIT(cv_gate_out[i]);
+
+	for (mask = 0; mask < ARRAY_SIZE(cv_gate_out_lut); mask++) {
+		cv_gate_out_lut[mask] = 0;
+		for (i = 0; i < NUM_OF_CVGATE_OUTS; i++) {
+			if (mask & BIT(i))
+				cv_gate_out_lut[mask] |= BIT(cv_gate_out[i]);
+		}
+	}
+	return 0;
+}
+
 static int bcm2835_init_cv_gates(void)
 {
-	int  i, ret;
-	for (i = 0; i < NUM_OF_CVGATE_OUTS; i++) {
-		ret = gpio_request(cv_gate_out[i], "cv_out_gate");
+	int outs = 0, ins = 0, irqs = 0, ret;
+
+	for (outs = 0; outs < NUM_OF_CVGATE_OUTS; outs++) {
+		ret = gpio_request(cv_gate_out[outs], "cv_out_gate");
 		if (ret < 0) {
 			printk(KERN_ERR "bcm2835-i2s: failed to get cv out\n");
-			return ret;
+			goto fail;
 		}
-		ret = gpio_direction_output(cv_gate_out[i], 0);
+		ret = gpio_direction_output(cv_gate_out[outs], 0);
 		if (ret < 0) {
 			printk(KERN_ERR "bcm2835-i2s: failed to set gpio dir\n");
-			return ret;
+			outs++;
+			goto fail;
 		}
 	}
-	for (i = 0; i < NUM_OF_CVGATE_INS; i++) {
-		ret = gpio_request(cv_gate_in[i], "cv_in_gate");
+	for (ins = 0; ins < NUM_OF_CVGATE_INS; ins++) {
+		ret = gpio_request(cv_gate_in[ins], "cv_in_gate");
 		if (ret < 0) {
-			printk(KERN_ERR "bcm2835-i2s: failed to get cv out\n");
-			return ret;
+			printk(KERN_ERR "bcm2835-i2s: failed to get cv in\n");
+			goto fail;
 		}
-		ret = gpio_direction_input(cv_gate_in[i]);
+		ret = gpio_direction_input(cv_gate_in[ins]);
 		if (ret < 0) {
 			printk(KERN_ERR "bcm2835-i2s: failed to set gpio dir\n");
-			return ret;
+			ins++;
+			goto fail;
+		}
+	}
+	/* The gates are driven oob, where gpiolib can't be used */
+	ret = bcm2835_map_cv_gates();
+	if (ret)
+		goto fail;
+	for (irqs = 0; irqs < NUM_OF_CVGATE_INS; irqs++) {
+		cv_gate_in_irq[irqs] = gpio_to_irq(cv_gate_in[irqs]);
+		if (cv_gate_in_irq[irqs] < 0) {
+			printk(KERN_ERR "bcm2835-i2s: no irq for cv in\n");
+			ret = cv_gate_in_irq[irqs];
+			goto fail;
+		}
+		ret = request_irq(cv_gate_in_irq[irqs], bcm2835_i2s_cv_gate_in_irq,
+				IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING |
+				IRQF_OOB, "cv_in_gate", NULL);
+		if (ret < 0) {
+			printk(KERN_ERR "bcm2835-i2s: failed to get cv in irq\n");
+			goto fail;
 		}
 	}
+	evl_init_timer(&cv_gate_timer, bcm2835_i2s_cv_gate_timer_handler);
+	return 0;
+
+fail:
+	while (--irqs >= 0)
+		free_irq(cv_gate_in_irq[irqs], NULL);
+	for (irqs = 0; irqs < NUM_OF_CVGATE_INS; irqs++)
+		cv_gate_in_irq[irqs] = -1;
+	if (cv_gate_gpio_base) {
+		iounmap(cv_gate_gpio_base);
+		cv_gate_gpio_base = NULL;
+	}
+	while (--ins >= 0)
+		gpio_free(cv_gate_in[ins]);
+	while (--outs >= 0)
+		gpio_free(cv_gate_out[outs]);
 	return ret;
 }
 
 static void bcm2835_free_cv_gates(void)
 {
 	int i;
+
+	evl_destroy_timer(&cv_gate_timer);
+	for (i = 0; i < NUM_OF_CVGATE_INS; i++) {
+		if (cv_gate_in_irq[i] > 0)
+			free_irq(cv_gate_in_irq[i], NULL);
+	}
+	if (cv_gate_gpio_base) {
+		iounmap(cv_gate_gpio_base);
+		cv_gate_gpio_base = NULL;
+	}
 	for (i = 0; i < NUM_OF_CVGATE_OUTS; i++)
 		gpio_free(cv_gate_out[i]);
 
@@ -311,7 +1204,7 @@ static void bcm2835_free_cv_gates(void)
 }
 #endif
 
-static void bcm2835_i2s_configure(struct audio_evl_dev *audio_dev)
+VISIBLE_IF_KUNIT void bcm2835_i2s_configure(struct audio_evl_dev *audio_dev)
 {
 	unsigned int data_length, framesync_length;
 	unsigned int slots, slot_width;
@@ -322,33 +1215,35 @@ static void bcm2835_i2s_configure(struct audio_evl_dev *audio_dev)
 	bool frame_sync_master = false;
 	bool frame_start_falling_edge = true;
 
-	data_length = BCM2835_PCM_WORD_LEN;
+	/* Packed mode keeps the slot width but only takes the top 16 bits */
+	data_length = audio_dev->packed_16bit ? BCM2835_PCM_PACKED_WORD_LEN :
+						audio_dev->tdm.slot_width;
+	/*
+	 * The block only has two channel positions, wider TDM frames are
+	 * clocked in as consecutive pairs of slots.
+	 */
 	slots = BCM2835_PCM_SLOTS;
-	slot_width = BCM2835_PCM_WORD_LEN;
+	slot_width = audio_dev->tdm.slot_width;
 	frame_length = slots * slot_width;
-	format = BCM2835_I2S_CHEN | BCM2835_I2S_CHWEX;
+	format = BCM2835_I2S_CHEN;
+	if (data_length - 8 >= 16)
+		format |= BCM2835_I2S_CHWEX;
 	format |= BCM2835_I2S_CHWID((data_length-8)&0xf);
 	framesync_length = frame_length / 2;
 	frame_start_falling_edge = false;
-	if (!strcmp(audio_dev->audio_hat, "hifi-berry")) {
+	if (audio_dev->hat->clock_master) {
 		bit_clock_master = true;
 		frame_sync_master = true;
-		bclk_rate = frame_length * HIFI_BERRY_SAMPLING_RATE;
+		bclk_rate = audio_dev->tdm.frame_length * audio_dev->sampling_rate;
 		if (clk_set_rate(audio_dev->clk, bclk_rate))
 			printk(KERN_ERR "bcm2835_i2s_configure: clk_set_rate failed\n");
 
 		audio_dev->clk_rate = bclk_rate;
 		mode = BCM2835_I2S_CLKI;
-		ch1_pos = 1;
-		ch2_pos = 33;
 		clk_prepare_enable(audio_dev->clk);
-	} else if (!strcmp(audio_dev->audio_hat, "hifi-berry-pro")) {
-		ch1_pos = 1;
-		ch2_pos = 33;
-	} else {
-		ch1_pos = 0;
-		ch2_pos = 32; /* calculated manually for now */
 	}
+	ch1_pos = audio_dev->hat->data_delay;
+	ch2_pos = slot_width + audio_dev->hat->data_delay;
 	/* CH2 format is the same as for CH1 */
 	format = BCM2835_I2S_CH1(format) | BCM2835_I2S_CH2(format);
 
@@ -364,6 +1259,10 @@ static void bcm2835_i2s_configure(struct audio_evl_dev *audio_dev)
 	if (frame_start_falling_edge)
 		mode |= BCM2835_I2S_FSI;
 
+	/* Two 16 bit samples per FIFO word */
+	if (audio_dev->packed_16bit)
+		mode |= BCM2835_I2S_FTXP | BCM2835_I2S_FRXP;
+
 	rpi_reg_write(audio_dev->i2s_base_addr, BCM2835_I2S_MODE_A_REG, mode);
 
 	rpi_reg_write(audio_dev->i2s_base_addr, BCM2835_I2S_RXC_A_REG, format
@@ -378,16 +1277,17 @@ static void bcm2835_i2s_configure(struct audio_evl_dev *audio_dev)
 			BCM2835_I2S_CLKDIS, 0);
 	/* Setup the DMA parameters */
 	rpi_reg_update_bits(audio_dev->i2s_base_addr, BCM2835_I2S_CS_A_REG,
-			BCM2835_I2S_RXTHR(1)
-			| BCM2835_I2S_TXTHR(1)
+			BCM2835_I2S_RXTHR(audio_dev->dma_params.fifo_rx_thr)
+			| BCM2835_I2S_TXTHR(audio_dev->dma_params.fifo_tx_thr)
 			| BCM2835_I2S_DMAEN, 0xffffffff);
 
 	rpi_reg_update_bits(audio_dev->i2s_base_addr, BCM2835_I2S_DREQ_A_REG,
-			  BCM2835_I2S_TX_PANIC(BCM2835_DMA_TX_PANIC_THR)
-			| BCM2835_I2S_RX_PANIC(BCM2835_DMA_RX_PANIC_THR)
-			| BCM2835_I2S_TX(BCM2835_DMA_THR_TX)
-			| BCM2835_I2S_RX(BCM2835_DMA_THR_RX), 0xffffffff);
+			  BCM2835_I2S_TX_PANIC(audio_dev->dma_params.tx_panic_thr)
+			| BCM2835_I2S_RX_PANIC(audio_dev->dma_params.rx_panic_thr)
+			| BCM2835_I2S_TX(audio_dev->dma_params.thr_tx)
+			| BCM2835_I2S_RX(audio_dev->dma_params.thr_rx), 0xffffffff);
 }
+EXPORT_SYMBOL_IF_KUNIT(bcm2835_i2s_configure);
 
 static void bcm2835_i2s_enable(struct audio_evl_dev *audio_dev)
 {
@@ -416,15 +1316,70 @@ static void bcm2835_i2s_clear_regs(struct audio_evl_dev *audio_dev)
 	rpi_reg_write(audio_dev->i2s_base_addr, BCM2835_I2S_GRAY_REG, 0);
 }
 
-int bcm2835_i2s_init(char *audio_hat)
+int audio_evl_register_hat(struct audio_evl_hat *hat)
+{
+	struct audio_evl_hat *h;
+	int ret = 0;
+
+	mutex_lock(&audio_evl_hats_lock);
+	list_for_each_entry(h, &audio_evl_hats, node) {
+		if (!strcmp(h->name, hat->name)) {
+			ret = -EEXIST;
+			goto out;
+		}
+	}
+	list_add_tail(&hat->node, &audio_evl_hats);
+out:
+	mutex_unlock(&audio_evl_hats_lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(audio_evl_register_hat);
+
+void audio_evl_unregister_hat(struct audio_evl_hat *hat)
+{
+	mutex_lock(&audio_evl_hats_lock);
+	list_del(&hat->node);
+	mutex_unlock(&audio_evl_hats_lock);
+}
+EXPORT_SYMBOL_GPL(audio_evl_unregister_hat);
+
+/* Look a hat up by name and pin the module providing it */
+const struct audio_evl_hat *audio_evl_get_hat(const char *name)
+{
+	struct audio_evl_hat *h, *hat = NULL;
+
+	mutex_lock(&audio_evl_hats_lock);
+	list_for_each_entry(h, &audio_evl_hats, node) {
+		if (!strcmp(h->name, name) && try_module_get(h->owner)) {
+			hat = h;
+			break;
+		}
+	}
+	mutex_unlock(&audio_evl_hats_lock);
+	return hat;
+}
+EXPORT_SYMBOL_GPL(audio_evl_get_hat);
+
+void audio_evl_put_hat(const struct audio_evl_hat *hat)
+{
+	module_put(hat->owner);
+}
+EXPORT_SYMBOL_GPL(audio_evl_put_hat);
+
+int bcm2835_i2s_init(struct audio_evl_dev *audio_dev,
+			const struct audio_evl_hat *hat)
 {
 	dma_addr_t dummy_phys_addr;
-	struct audio_evl_dev *audio_dev = audio_dev_static;
 	struct audio_evl_buffers *audio_buffer = audio_dev->buffer;
-	audio_dev->audio_hat = audio_hat;
+	audio_dev->hat = hat;
+	audio_dev->sampling_rate = hat->sampling_rate;
+	audio_dev->tdm = hat->tdm;
+	audio_dev->tdm.frame_length = hat->tdm.slots * hat->tdm.slot_width;
 
-	printk(KERN_INFO "Elk hat: %s\n", audio_dev->audio_hat);
+	printk(KERN_INFO "Elk hat: %s on i2s%d\n", hat->name, audio_dev->id);
 
+	if (audio_buffer->rx_buf)
+		goto out;
 	audio_buffer->rx_buf = dma_alloc_coherent(audio_dev->dma_rx->device->dev,
 	RESERVED_BUFFER_SIZE_IN_PAGES * PAGE_SIZE,
 	&dummy_phys_addr,
@@ -435,77 +1390,431 @@ int bcm2835_i2s_init(char *audio_hat)
 	}
 	audio_buffer->rx_phys_addr = dummy_phys_addr;
 
-	if (!strcmp(audio_dev->audio_hat, "elk-pi")) {
-		audio_dev->cv_gate_enabled = true;
-		bcm2835_init_cv_gates();
+out:
+	audio_dev->frame_slip_check = hat->sync == AUDIO_EVL_SYNC_GUARD_SLOTS;
+	/* There is a single set of gate pins, the first interface owns them */
+#ifdef BCM2835_I2S_CVGATES_SUPPORT
+	if (hat->cv_gates && audio_dev->id == 0 && !audio_dev->cv_gate_enabled) {
+		if (bcm2835_init_cv_gates())
+			printk(KERN_ERR "bcm2835-i2s: cv gates disabled\n");
+		else
+			audio_dev->cv_gate_enabled = true;
 	}
+#endif
 	return 0;
 }
 EXPORT_SYMBOL_GPL(bcm2835_i2s_init);
 
-int bcm2835_i2s_buffers_setup(int audio_buffer_size, int audio_channels)
+int bcm2835_i2s_set_tdm(struct audio_evl_dev *audio_dev,
+			const struct audio_evl_tdm_config *tdm)
 {
-	int ret, i;
-	struct audio_evl_dev *audio_dev = audio_dev_static;
-	struct audio_evl_buffers *audio_buffer = audio_dev->buffer;
-	dma_addr_t dummy_phys_addr = audio_buffer->rx_phys_addr;
+	uint32_t all_slots;
 
-	audio_buffer->period_len = audio_buffer_size * audio_channels
-					 * sizeof(uint32_t);
-	audio_buffer->buffer_len = 2 * audio_buffer->period_len;
-	audio_buffer->tx_buf = audio_buffer->rx_buf +
-			audio_buffer->buffer_len;
-	audio_buffer->tx_phys_addr = dummy_phys_addr + audio_buffer->buffer_len;
-	audio_buffer->cv_gate_out = audio_buffer->rx_buf +
-			audio_buffer->buffer_len * 2;
-	audio_buffer->cv_gate_in = audio_buffer->rx_buf +
-			audio_buffer->buffer_len * 2 + sizeof(uint32_t);
-	*audio_buffer->cv_gate_out = 0x0f;
+	if (tdm->slots < BCM2835_PCM_SLOTS || tdm->slots > AUDIO_EVL_MAX_TDM_SLOTS
+						|| tdm->slots % 2) {
+		printk(KERN_ERR "bcm2835-i2s: unsupported tdm slots %u\n",
+							tdm->slots);
+		return -EINVAL;
+	}
+	if (tdm->slot_width < 16 || tdm->slot_width > BCM2835_PCM_WORD_LEN
+						|| tdm->slot_width % 8) {
+		printk(KERN_ERR "bcm2835-i2s: unsupported slot width %u\n",
+							tdm->slot_width);
+		return -EINVAL;
+	}
+	if (tdm->slots * tdm->slot_width > BCM2835_I2S_MAX_FRAME_LENGTH) {
+		printk(KERN_ERR "bcm2835-i2s: tdm frame longer than %d bits\n",
+						BCM2835_I2S_MAX_FRAME_LENGTH);
+		return -EINVAL;
+	}
+	all_slots = GENMASK(tdm->slots - 1, 0);
+	if (!tdm->rx_slot_mask || !tdm->tx_slot_mask ||
+		((tdm->rx_slot_mask | tdm->tx_slot_mask) & ~all_slots)) {
+		printk(KERN_ERR "bcm2835-i2s: invalid tdm slot masks\n");
+		return -EINVAL;
+	}
+	/* As frame sync master the block can only generate 2 slot frames */
+	if (tdm->slots != BCM2835_PCM_SLOTS && audio_dev->hat->clock_master) {
+		printk(KERN_ERR "bcm2835-i2s: tdm needs an external frame sync\n");
+		return -EINVAL;
+	}
+
+	audio_dev->tdm = *tdm;
+	audio_dev->tdm.frame_length = tdm->slots * tdm->slot_width;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(bcm2835_i2s_set_tdm);
 
+/* Program the I2S block and start the cyclic DMA on the current buffers */
+static int bcm2835_i2s_stream_setup(struct audio_evl_dev *audio_dev)
+{
+	int ret, i;
+
+	trace_audio_evl_init_step_begin("i2s_dma_prepare", 0);
 	ret = bcm2835_i2s_dma_prepare(audio_dev);
+	trace_audio_evl_init_step_end("i2s_dma_prepare", ret);
 	if (ret) {
 		printk(KERN_ERR "bcm2835-i2s: dma_prepare failed\n");
 		return -EINVAL;
 	}
 
+	trace_audio_evl_init_step_begin("i2s_configure", 0);
 	bcm2835_i2s_clear_regs(audio_dev);
 	bcm2835_i2s_configure(audio_dev);
 	bcm2835_i2s_enable(audio_dev);
 	bcm2835_i2s_clear_fifos(audio_dev, true, true);
+	trace_audio_evl_init_step_end("i2s_configure", 0);
 
-	for (i = 0; i < (BCM2835_DMA_THR_TX + audio_channels); i++)
+	for (i = 0; i < (audio_dev->dma_params.thr_tx +
+		bcm2835_i2s_words_per_frame(audio_dev)); i++)
 		rpi_reg_write(audio_dev->i2s_base_addr, BCM2835_I2S_FIFO_A_REG, 0);
 
 	bcm2835_i2s_submit_dma(audio_dev);
 
 	return 0;
 }
+
+/*
+ * Re-align the frame in place: stop the stream, restart the DMA from the
+ * start of the buffers and synch on the guard slots again. The client gets
+ * -ESTRPIPE once it runs, -EIO if it couldn't be restarted.
+ */
+static int bcm2835_i2s_resync(struct audio_evl_dev *audio_dev)
+{
+	bcm2835_i2s_start_stop(audio_dev, BCM2835_I2S_STOP_CMD);
+	dmaengine_terminate_sync(audio_dev->dma_tx);
+	dmaengine_terminate_sync(audio_dev->dma_rx);
+	audio_dev->buffer_idx = 0;
+	audio_dev->slip_periods = 0;
+	audio_dev->fifo_error_periods = 0;
+
+	if (bcm2835_i2s_stream_setup(audio_dev) ||
+	    bcm2835_i2s_start_stop(audio_dev, BCM2835_I2S_START_CMD)) {
+		/* The stream is down, don't leave the client waiting */
+		printk(KERN_ERR "bcm2835-i2s: resync failed\n");
+		audio_dev->stream_error = -EIO;
+		evl_raise_flag(&audio_dev->event_flag);
+		/* The watchdog retries the restart */
+		bcm2835_i2s_arm_watchdog(audio_dev,
+				evl_read_clock(&evl_mono_clock));
+		return -EIO;
+	}
+	audio_dev->stream_error = -ESTRPIPE;
+	return 0;
+}
+
+static void bcm2835_i2s_resync_work(struct evl_work *work)
+{
+	struct audio_evl_dev *audio_dev = container_of(work,
+					struct audio_evl_dev, resync_work);
+
+	mutex_lock(&audio_dev->restart_lock);
+	if (!READ_ONCE(audio_dev->closing) && !bcm2835_i2s_resync(audio_dev)) {
+		audio_dev->resyncs++;
+		printk(KERN_INFO "bcm2835-i2s: channel slip, stream re-aligned\n");
+	}
+	WRITE_ONCE(audio_dev->resync_pending, false);
+	mutex_unlock(&audio_dev->restart_lock);
+}
+
+/* Persistent FIFO errors, restart the stream so the frame stays aligned */
+static void bcm2835_i2s_fifo_recovery_work(struct evl_work *work)
+{
+	struct audio_evl_dev *audio_dev = container_of(work,
+					struct audio_evl_dev, fifo_recovery_work);
+
+	mutex_lock(&audio_dev->restart_lock);
+	if (!READ_ONCE(audio_dev->closing) && !bcm2835_i2s_resync(audio_dev)) {
+		audio_dev->fifo_recoveries++;
+		printk(KERN_INFO "bcm2835-i2s: i2s%d FIFO errors, stream "
+			"restarted\n", audio_dev->id);
+	}
+	WRITE_ONCE(audio_dev->fifo_recovery_pending, false);
+	mutex_unlock(&audio_dev->restart_lock);
+}
+
+/*
+ * No DMA callback for watchdog_periods periods, the DMA or the bit clock
+ * stopped. Release the client with -ETIMEDOUT and restart the stream, again
+ * every watchdog_periods until it runs.
+ */
+static void bcm2835_i2s_watchdog_handler(struct evl_timer *timer)
+{
+	struct audio_evl_dev *audio_dev = container_of(timer,
+					struct audio_evl_dev, watchdog_timer);
+	struct audio_evl_flight_record *record;
+
+	if (READ_ONCE(audio_dev->watchdog_pending) ||
+	    READ_ONCE(audio_dev->closing))
+		return;
+	WRITE_ONCE(audio_dev->watchdog_pending, true);
+	/* Keep the periods around the stall, they are dumped once it restarts */
+	record = bcm2835_i2s_flight_record(audio_dev, audio_dev->kinterrupts);
+	if (record)
+		record->flags |= AUDIO_EVL_FLIGHT_STALL;
+	bcm2835_i2s_flight_trigger(audio_dev);
+	audio_dev->stream_error = -ETIMEDOUT;
+	evl_raise_flag(&audio_dev->event_flag);
+	evl_call_inband(&audio_dev->watchdog_work);
+}
+
+static void bcm2835_i2s_watchdog_work(struct evl_work *work)
+{
+	struct audio_evl_dev *audio_dev = container_of(work,
+					struct audio_evl_dev, watchdog_work);
+	bool failed = false;
+
+	mutex_lock(&audio_dev->restart_lock);
+	if (READ_ONCE(audio_dev->closing)) {
+		WRITE_ONCE(audio_dev->watchdog_pending, false);
+		mutex_unlock(&audio_dev->restart_lock);
+		return;
+	}
+	printk_ratelimited(KERN_ERR "bcm2835-i2s: i2s%d stalled, restarting\n",
+			audio_dev->id);
+	bcm2835_i2s_start_stop(audio_dev, BCM2835_I2S_STOP_CMD);
+	dmaengine_terminate_sync(audio_dev->dma_tx);
+	dmaengine_terminate_sync(audio_dev->dma_rx);
+	audio_dev->buffer_idx = 0;
+	/* Same buffers and session state, only the DMA and I2S are redone */
+	if (bcm2835_i2s_stream_setup(audio_dev) ||
+	    bcm2835_i2s_start_stop(audio_dev, BCM2835_I2S_START_CMD))
+		failed = true;
+	else
+		audio_dev->watchdog_recoveries++;
+	WRITE_ONCE(audio_dev->watchdog_pending, false);
+	if (failed) {
+		printk(KERN_ERR "bcm2835-i2s: restart failed\n");
+		bcm2835_i2s_arm_watchdog(audio_dev,
+				evl_read_clock(&evl_mono_clock));
+	}
+	mutex_unlock(&audio_dev->restart_lock);
+}
+
+/* Module params override the hat's tuned values when set */
+#define BCM2835_DMA_PARAM(param, field) \
+	((param) >= 0 ? (uint)(param) : audio_dev->hat->dma_params.field)
+
+static void bcm2835_i2s_load_dma_params(struct audio_evl_dev *audio_dev)
+{
+	struct audio_evl_dma_params *params = &audio_dev->dma_params;
+
+	/*
+	 * DREQ fields are 7 bits wide, FIFO thresholds 2 bits. The tx one
+	 * leaves room for the frame prefilled at stream setup.
+	 */
+	params->thr_tx = min_t(uint, BCM2835_DMA_PARAM(dma_thr_tx, thr_tx),
+			BCM2835_I2S_FIFO_DEPTH -
+			bcm2835_i2s_words_per_frame(audio_dev));
+	params->thr_rx = min_t(uint, BCM2835_DMA_PARAM(dma_thr_rx, thr_rx),
+			BCM2835_I2S_FIFO_DEPTH - 1);
+	params->tx_panic_thr = min_t(uint,
+			BCM2835_DMA_PARAM(dma_tx_panic_thr, tx_panic_thr), 0x7f);
+	params->rx_panic_thr = min_t(uint,
+			BCM2835_DMA_PARAM(dma_rx_panic_thr, rx_panic_thr), 0x7f);
+	params->burst_size = clamp_t(uint,
+			BCM2835_DMA_PARAM(dma_burst_size, burst_size), 1, 16);
+	params->fifo_tx_thr = min_t(uint,
+			BCM2835_DMA_PARAM(fifo_tx_thr, fifo_tx_thr), 0x3);
+	params->fifo_rx_thr = min_t(uint,
+			BCM2835_DMA_PARAM(fifo_rx_thr, fifo_rx_thr), 0x3);
+}
+
+/*
+ * Control area and recorder state of a new session. Not for restarts within
+ * a session, they would lose the client's data and the flight records.
+ */
+static void bcm2835_i2s_reset_session(struct audio_evl_dev *audio_dev)
+{
+	struct audio_evl_buffers *audio_buffer = audio_dev->buffer;
+	unsigned long flags;
+
+	*audio_buffer->cv_gate_out = 0x0f;
+	audio_buffer->cv_gate_out_events->num_events = 0;
+	audio_buffer->cv_gate_in_events->num_events = 0;
+	audio_buffer->cv_gate_in_events->dropped = 0;
+	memset(audio_buffer->status, 0, sizeof(*audio_buffer->status));
+	memset(audio_buffer->mailbox_out, 0, sizeof(*audio_buffer->mailbox_out));
+	memset(audio_buffer->mailbox_in, 0, sizeof(*audio_buffer->mailbox_in));
+	audio_buffer->events_out->num_events = 0;
+	audio_buffer->events_in->num_events = 0;
+	audio_buffer->events_in->dropped = 0;
+	raw_spin_lock_irqsave(&audio_dev->event_lock, flags);
+	audio_dev->num_pending_events = 0;
+	audio_dev->dropped_events = 0;
+	audio_dev->events_period_ts = 0;
+	raw_spin_unlock_irqrestore(&audio_dev->event_lock, flags);
+	memset(audio_dev->flight_ring, 0, sizeof(audio_dev->flight_ring));
+	audio_dev->flight_trigger = 0;
+	audio_dev->monitor_period = 0;
+}
+
+int bcm2835_i2s_buffers_setup(struct audio_evl_dev *audio_dev,
+			int audio_buffer_size, int audio_channels,
+			bool packed_16bit)
+{
+	struct audio_evl_buffers *audio_buffer = audio_dev->buffer;
+	dma_addr_t dummy_phys_addr = audio_buffer->rx_phys_addr;
+
+	if (4 * audio_buffer_size * audio_channels * sizeof(uint32_t) +
+		AUDIO_CONTROL_AREA_SIZE > RESERVED_BUFFER_SIZE_IN_PAGES * PAGE_SIZE) {
+		printk(KERN_ERR "bcm2835-i2s: buffers don't fit the dma area\n");
+		return -ENOMEM;
+	}
+
+	audio_dev->period_frames = audio_buffer_size;
+	audio_dev->tx_phase_frames = tx_phase_frames < 0 ||
+		tx_phase_frames > audio_buffer_size ?
+		audio_buffer_size : tx_phase_frames;
+	audio_dev->period_ns = div_u64((uint64_t)audio_buffer_size *
+				NSEC_PER_SEC, audio_dev->sampling_rate);
+	audio_dev->packed_16bit = packed_16bit;
+	audio_buffer->period_len = audio_buffer_size * audio_channels
+			 * (packed_16bit ? sizeof(uint16_t) : sizeof(uint32_t));
+	audio_buffer->buffer_len = 2 * audio_buffer->period_len;
+	audio_buffer->tx_buf = audio_buffer->rx_buf +
+			audio_buffer->buffer_len;
+	audio_buffer->tx_phys_addr = dummy_phys_addr + audio_buffer->buffer_len;
+	memset(audio_buffer->tx_buf, 0, audio_buffer->buffer_len);
+	audio_buffer->cv_gate_out = audio_buffer->rx_buf +
+			audio_buffer->buffer_len * 2 + AUDIO_CV_GATE_OUT_OFFSET;
+	audio_buffer->cv_gate_in = audio_buffer->rx_buf +
+			audio_buffer->buffer_len * 2 + AUDIO_CV_GATE_IN_OFFSET;
+	audio_buffer->cv_gate_out_events = audio_buffer->rx_buf +
+		audio_buffer->buffer_len * 2 + AUDIO_CV_GATE_OUT_EVENTS_OFFSET;
+	audio_buffer->cv_gate_in_events = audio_buffer->rx_buf +
+		audio_buffer->buffer_len * 2 + AUDIO_CV_GATE_IN_EVENTS_OFFSET;
+	audio_buffer->status = audio_buffer->rx_buf +
+		audio_buffer->buffer_len * 2 + AUDIO_STATUS_OFFSET;
+	audio_buffer->mailbox_out = audio_buffer->rx_buf +
+		audio_buffer->buffer_len * 2 + AUDIO_MAILBOX_OUT_OFFSET;
+	audio_buffer->mailbox_in = audio_buffer->rx_buf +
+		audio_buffer->buffer_len * 2 + AUDIO_MAILBOX_IN_OFFSET;
+	audio_buffer->events_out = audio_buffer->rx_buf +
+		audio_buffer->buffer_len * 2 + AUDIO_EVENTS_OUT_OFFSET;
+	audio_buffer->events_in = audio_buffer->rx_buf +
+		audio_buffer->buffer_len * 2 + AUDIO_EVENTS_IN_OFFSET;
+	bcm2835_i2s_reset_session(audio_dev);
+
+	audio_dev->num_channels = audio_channels;
+	bcm2835_i2s_load_dma_params(audio_dev);
+
+	return bcm2835_i2s_stream_setup(audio_dev);
+}
 EXPORT_SYMBOL_GPL(bcm2835_i2s_buffers_setup);
 
-struct audio_evl_dev *bcm2835_get_i2s_dev(void)
+/*
+ * Input to output latency of the stream set up last, the period, the tx
+ * phase and the zeros pre-loaded in the tx FIFO.
+ */
+int bcm2835_i2s_round_trip_frames(struct audio_evl_dev *audio_dev)
 {
-	return audio_dev_static;
+	int wpf = bcm2835_i2s_words_per_frame(audio_dev);
+
+	if (!audio_dev->period_frames || !wpf)
+		return 0;
+	return audio_dev->period_frames + audio_dev->tx_phase_frames +
+		(audio_dev->dma_params.thr_tx + wpf) / wpf;
 }
-EXPORT_SYMBOL_GPL(bcm2835_get_i2s_dev);
+EXPORT_SYMBOL_GPL(bcm2835_i2s_round_trip_frames);
 
-int bcm2835_i2s_exit(void)
+/*
+ * Measure the latency from the rx_slot input to the tx_slot output with
+ * an impulse, on a stream set up but not started. Returns the latency in
+ * frames. The tx buffer has to be set up again afterwards.
+ */
+int bcm2835_i2s_calibrate(struct audio_evl_dev *audio_dev,
+			unsigned tx_slot, unsigned rx_slot, int32_t impulse,
+			uint32_t threshold, unsigned timeout_ms)
 {
-	int ret = 0;
-	struct audio_evl_dev *audio_dev = audio_dev_static;
+	struct audio_evl_calibration *calib = &audio_dev->calib;
+	unsigned long timeout;
+	int ret;
+
+	if (audio_dev->packed_16bit || tx_slot >= audio_dev->num_channels ||
+	    rx_slot >= audio_dev->num_channels)
+		return -EINVAL;
 
-	ret = dmaengine_terminate_async(audio_dev->dma_tx);
-	if (ret < 0) {
-		printk(KERN_ERR "bcm2835-i2s: dmaengine_terminate_async \
-		 failed\n");
-		return ret;
+	calib->tx_slot = tx_slot;
+	calib->rx_slot = rx_slot;
+	calib->impulse = impulse;
+	calib->threshold = threshold;
+	calib->latency_frames = 0;
+	WRITE_ONCE(calib->state, AUDIO_EVL_CALIB_ARMED);
+
+	timeout = jiffies + msecs_to_jiffies(timeout_ms) +
+		nsecs_to_jiffies(BCM2835_I2S_CALIB_SETTLE_PERIODS *
+				audio_dev->period_ns);
+	ret = bcm2835_i2s_start_stop(audio_dev, BCM2835_I2S_START_CMD);
+	while (!ret && (READ_ONCE(calib->state) == AUDIO_EVL_CALIB_ARMED ||
+	       READ_ONCE(calib->state) == AUDIO_EVL_CALIB_WAITING)) {
+		if (time_after(jiffies, timeout))
+			break;
+		msleep(1);
 	}
-	ret = dmaengine_terminate_async(audio_dev->dma_rx);
-	if (ret < 0) {
-		printk(KERN_ERR "bcm2835-i2s: dmaengine_terminate_async \
-		 failed\n");
-		return ret;
+	bcm2835_i2s_start_stop(audio_dev, BCM2835_I2S_STOP_CMD);
+	dmaengine_terminate_sync(audio_dev->dma_tx);
+	dmaengine_terminate_sync(audio_dev->dma_rx);
+
+	switch (calib->state) {
+	case AUDIO_EVL_CALIB_DONE:
+		ret = calib->latency_frames;
+		break;
+	case AUDIO_EVL_CALIB_NOISY:
+		printk(KERN_ERR "bcm2835-i2s: calibration input above "
+			"threshold before the impulse\n");
+		ret = -EIO;
+		break;
+	default:
+		ret = -ETIMEDOUT;
+		break;
 	}
-	return 0;
+	calib->state = AUDIO_EVL_CALIB_IDLE;
+	return ret;
+}
+EXPORT_SYMBOL_GPL(bcm2835_i2s_calibrate);
+
+struct audio_evl_dev *bcm2835_get_i2s_dev(int id)
+{
+	if (id < 0 || id >= AUDIO_EVL_MAX_DEVS)
+		return NULL;
+	return READ_ONCE(audio_devs[id]);
+}
+EXPORT_SYMBOL_GPL(bcm2835_get_i2s_dev);
+
+int bcm2835_i2s_num_devs(void)
+{
+	return num_audio_devs;
+}
+EXPORT_SYMBOL_GPL(bcm2835_i2s_num_devs);
+
+int bcm2835_i2s_exit(struct audio_evl_dev *audio_dev)
+{
+	int ret;
+
+	/*
+	 * Keep the works from restarting the stream and let a running one
+	 * finish before the DMA goes down.
+	 */
+	WRITE_ONCE(audio_dev->closing, true);
+	evl_flush_work(&audio_dev->resync_work);
+	evl_flush_work(&audio_dev->fifo_recovery_work);
+	evl_flush_work(&audio_dev->watchdog_work);
+	ret = dmaengine_terminate_sync(audio_dev->dma_tx);
+	if (ret < 0)
+		printk(KERN_ERR "bcm2835-i2s: dmaengine_terminate_sync "
+			"failed\n");
+	ret = dmaengine_terminate_sync(audio_dev->dma_rx);
+	if (ret < 0)
+		printk(KERN_ERR "bcm2835-i2s: dmaengine_terminate_sync "
+			"failed\n");
+	/* No callback can re-arm the watchdog from here on */
+	evl_stop_timer(&audio_dev->watchdog_timer);
+#ifdef BCM2835_I2S_CVGATES_SUPPORT
+	if (audio_dev->cv_gate_enabled)
+		evl_stop_timer(&cv_gate_timer);
+#endif
+	return ret < 0 ? ret : 0;
 }
 EXPORT_SYMBOL_GPL(bcm2835_i2s_exit);
 
@@ -518,6 +1827,13 @@ static int bcm2835_i2s_probe(struct platform_device *pdev)
 	const __be32 *addr;
 	dma_addr_t dma_base;
 	struct audio_evl_buffers *audio_buffer;
+	char name[16];
+	int id;
+
+	if (READ_ONCE(num_audio_devs) == AUDIO_EVL_MAX_DEVS) {
+		dev_err(&pdev->dev, "too many i2s interfaces\n");
+		return -ENOSPC;
+	}
 
 	audio_dev = devm_kzalloc(&pdev->dev, sizeof(*audio_dev),
 			   GFP_KERNEL);
@@ -531,8 +1847,6 @@ static int bcm2835_i2s_probe(struct platform_device *pdev)
 		return PTR_ERR(audio_dev->clk);
 	}
 
-	audio_dev_static = audio_dev;
-
 	mem_resource = platform_get_resource(pdev, IORESOURCE_MEM, 0);
 	base = devm_ioremap_resource(&pdev->dev, mem_resource);
 	if (IS_ERR(base)) {
@@ -550,9 +1864,17 @@ static int bcm2835_i2s_probe(struct platform_device *pdev)
 	dma_base = be32_to_cpup(addr);
 	audio_dev->fifo_dma_addr = dma_base + BCM2835_I2S_FIFO_A_REG;
 	audio_dev->addr_width = DMA_SLAVE_BUSWIDTH_4_BYTES;
-	audio_dev->dma_burst_size = 2;
 	audio_dev->dev = &pdev->dev;
 	evl_init_flag(&audio_dev->event_flag);
+	evl_init_work(&audio_dev->resync_work, bcm2835_i2s_resync_work);
+	evl_init_work(&audio_dev->fifo_recovery_work,
+			bcm2835_i2s_fifo_recovery_work);
+	mutex_init(&audio_dev->restart_lock);
+	raw_spin_lock_init(&audio_dev->event_lock);
+	raw_spin_lock_init(&audio_dev->flight_lock);
+	raw_spin_lock_init(&audio_dev->monitor_lock);
+	evl_init_work(&audio_dev->watchdog_work, bcm2835_i2s_watchdog_work);
+	evl_init_timer(&audio_dev->watchdog_timer, bcm2835_i2s_watchdog_handler);
 
 	if (bcm2835_i2s_dma_setup(audio_dev))
 		return -ENODEV;
@@ -565,15 +1887,50 @@ static int bcm2835_i2s_probe(struct platform_device *pdev)
 		return -ENOMEM;
 	}
 	audio_dev->buffer = audio_buffer;
+
+	mutex_lock(&audio_devs_lock);
+	for (id = 0; id < AUDIO_EVL_MAX_DEVS && audio_devs[id]; id++)
+		;
+	if (id < AUDIO_EVL_MAX_DEVS) {
+		audio_dev->id = id;
+		audio_devs[id] = audio_dev;
+		num_audio_devs++;
+	}
+	mutex_unlock(&audio_devs_lock);
+	if (id == AUDIO_EVL_MAX_DEVS) {
+		dev_err(&pdev->dev, "too many i2s interfaces\n");
+		kfree(audio_buffer);
+		dma_release_channel(audio_dev->dma_tx);
+		dma_release_channel(audio_dev->dma_rx);
+		return -ENOSPC;
+	}
+	platform_set_drvdata(pdev, audio_dev);
+
+	snprintf(name, sizeof(name), "flight%d", audio_dev->id);
+	audio_dev->debugfs = debugfs_create_file(name, 0400,
+			bcm2835_i2s_debugfs_dir, audio_dev,
+			&bcm2835_i2s_flight_fops);
 	return ret;
 }
 
 static int bcm2835_i2s_remove(struct platform_device *pdev)
 {
-	struct audio_evl_dev *audio_dev = audio_dev_static;
-	struct audio_evl_buffers *audio_buffers =
-					audio_dev_static->buffer;
+	struct audio_evl_dev *audio_dev = platform_get_drvdata(pdev);
+	struct audio_evl_buffers *audio_buffers = audio_dev->buffer;
 
+	mutex_lock(&audio_devs_lock);
+	audio_devs[audio_dev->id] = NULL;
+	num_audio_devs--;
+	mutex_unlock(&audio_devs_lock);
+
+	debugfs_remove(audio_dev->debugfs);
+	/* No timer or work may touch the device once it is freed */
+	WRITE_ONCE(audio_dev->closing, true);
+	evl_stop_timer(&audio_dev->watchdog_timer);
+	evl_flush_work(&audio_dev->resync_work);
+	evl_flush_work(&audio_dev->fifo_recovery_work);
+	evl_flush_work(&audio_dev->watchdog_work);
+	evl_destroy_timer(&audio_dev->watchdog_timer);
 /*
 	if (bcm2835_dma_free_evl_resources(audio_dev->dma_tx,
 				DMA_MEM_TO_DEV)) {
@@ -584,20 +1941,21 @@ static int bcm2835_i2s_remove(struct platform_device *pdev)
 		printk(KERN_INFO "Failed to free evl dma resources\n");
 	}
 */
-	dma_free_coherent(audio_dev->dma_rx->device->dev,
+	if (audio_buffers->rx_buf)
+		dma_free_coherent(audio_dev->dma_rx->device->dev,
 				RESERVED_BUFFER_SIZE_IN_PAGES * PAGE_SIZE,
-				audio_dev->buffer->rx_buf,
-				audio_dev->buffer->rx_phys_addr);
+				audio_buffers->rx_buf,
+				audio_buffers->rx_phys_addr);
 	dma_release_channel(audio_dev->dma_tx);
 	dma_release_channel(audio_dev->dma_rx);
 	kfree(audio_buffers);
 
 #ifdef BCM2835_I2S_CVGATES_SUPPORT
-	if (audio_dev_static->cv_gate_enabled)
+	if (audio_dev->cv_gate_enabled)
 		bcm2835_free_cv_gates();
 #endif
-	devm_iounmap(&pdev->dev, (void *)audio_dev_static->i2s_base_addr);
-	devm_kfree(&pdev->dev, (void *)audio_dev_static);
+	devm_iounmap(&pdev->dev, (void *)audio_dev->i2s_base_addr);
+	devm_kfree(&pdev->dev, (void *)audio_dev);
 	return 0;
 }
 
@@ -617,7 +1975,156 @@ static struct platform_driver bcm2835_i2s_driver = {
 	},
 };
 
-module_platform_driver(bcm2835_i2s_driver);
+#ifdef AUDIO_EVL_PROFILING
+static struct dentry *audio_evl_prof_dir;
+
+static inline int audio_evl_prof_bucket(uint32_t ns)
+{
+	int msb;
+
+	if (ns < 4)
+		return ns;
+	msb = fls(ns) - 1;
+	return (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+}
+
+/* Largest value falling in the bucket */
+static inline uint32_t audio_evl_prof_bucket_max(int bucket)
+{
+	int msb = bucket / 4 + 1;
+
+	if (bucket < 4)
+		return bucket;
+	return ((4 + (bucket & 3)) << (msb - 2)) + (1 << (msb - 2)) - 1;
+}
+
+void audio_evl_prof_end(struct audio_evl_prof *prof, ktime_t start)
+{
+	int64_t delta = ktime_to_ns(ktime_sub(evl_read_clock(&evl_mono_clock),
+					start));
+	uint32_t ns = clamp_t(int64_t, delta, 0, U32_MAX);
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&prof->lock, flags);
+	if (!prof->count || ns < prof->min_ns)
+		prof->min_ns = ns;
+	if (ns > prof->max_ns)
+		prof->max_ns = ns;
+	prof->hist[audio_evl_prof_bucket(ns)]++;
+	prof->count++;
+	raw_spin_unlock_irqrestore(&prof->lock, flags);
+}
+EXPORT_SYMBOL_GPL(audio_evl_prof_end);
+
+/* Upper bound of the bucket holding the given fraction, in permille */
+static uint32_t audio_evl_prof_percentile(const uint32_t *hist,
+				uint64_t count, uint permille)
+{
+	uint64_t target = div_u64(count * permille + 999, 1000);
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < AUDIO_EVL_PROF_BUCKETS; i++) {
+		sum += hist[i];
+		if (sum >= target)
+			return audio_evl_prof_bucket_max(i);
+	}
+	return 0;
+}
+
+static int audio_evl_prof_show(struct seq_file *m, void *v)
+{
+	struct audio_evl_prof *prof = m->private;
+	uint32_t hist[AUDIO_EVL_PROF_BUCKETS], min_ns, max_ns;
+	unsigned long flags;
+	uint64_t count;
+
+	raw_spin_lock_irqsave(&prof->lock, flags);
+	count = prof->count;
+	min_ns = prof->min_ns;
+	max_ns = prof->max_ns;
+	memcpy(hist, prof->hist, sizeof(hist));
+	raw_spin_unlock_irqrestore(&prof->lock, flags);
+
+	seq_printf(m, "count=%llu min_ns=%u p50_ns=%u p99_ns=%u p999_ns=%u "
+		"max_ns=%u\n", count, min_ns,
+		audio_evl_prof_percentile(hist, count, 500),
+		audio_evl_prof_percentile(hist, count, 990),
+		audio_evl_prof_percentile(hist, count, 999),
+		max_ns);
+	return 0;
+}
+
+static int audio_evl_prof_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, audio_evl_prof_show, inode->i_private);
+}
+
+/* Any write clears the statistics */
+static ssize_t audio_evl_prof_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct audio_evl_prof *prof = file_inode(file)->i_private;
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&prof->lock, flags);
+	prof->count = 0;
+	prof->min_ns = 0;
+	prof->max_ns = 0;
+	memset(prof->hist, 0, sizeof(prof->hist));
+	raw_spin_unlock_irqrestore(&prof->lock, flags);
+	return count;
+}
+
+static const struct file_operations audio_evl_prof_fops = {
+	.owner		= THIS_MODULE,
+	.open		= audio_evl_prof_open,
+	.read		= seq_read,
+	.write		= audio_evl_prof_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+void audio_evl_prof_add(struct audio_evl_prof *prof)
+{
+	raw_spin_lock_init(&prof->lock);
+	prof->dentry = debugfs_create_file(prof->name, 0600,
+			audio_evl_prof_dir, prof, &audio_evl_prof_fops);
+}
+EXPORT_SYMBOL_GPL(audio_evl_prof_add);
+
+void audio_evl_prof_remove(struct audio_evl_prof *prof)
+{
+	debugfs_remove(prof->dentry);
+}
+EXPORT_SYMBOL_GPL(audio_evl_prof_remove);
+#endif
+
+static int __init bcm2835_i2s_module_init(void)
+{
+	int ret;
+
+	bcm2835_i2s_debugfs_dir = debugfs_create_dir("audio_evl", NULL);
+#ifdef AUDIO_EVL_PROFILING
+	audio_evl_prof_dir = debugfs_create_dir("profile",
+					bcm2835_i2s_debugfs_dir);
+#endif
+	audio_evl_prof_add(&dma_callback);
+	audio_evl_prof_add(&cv_gates);
+	ret = platform_driver_register(&bcm2835_i2s_driver);
+	if (ret)
+		debugfs_remove_recursive(bcm2835_i2s_debugfs_dir);
+	return ret;
+}
+
+static void __exit bcm2835_i2s_module_exit(void)
+{
+	platform_driver_unregister(&bcm2835_i2s_driver);
+	debugfs_remove_recursive(bcm2835_i2s_debugfs_dir);
+}
+
+module_init(bcm2835_i2s_module_init);
+module_exit(bcm2835_i2s_module_exit);
 MODULE_DESCRIPTION("BCM2835 I2S interface for ELK Pi");
 MODULE_AUTHOR("Nitin Kulkarni (nitin@elk.audio)");
 MODULE_LICENSE("GPL");
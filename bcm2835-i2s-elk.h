@@ -11,6 +11,8 @@
 #include <linux/err.h>
 #include <linux/sizes.h>
 
+#include "audio-evl-hw.h"
+
 #define BCM2835_I2S_IRQ_NUM 85
 
 #define BCM2835_I2S_PERIPHERAL_BASE	0x20203000
@@ -20,6 +22,10 @@
 #define BCM2835_DMA_THR_RX		8
 #define BCM2835_DMA_TX_PANIC_THR	8
 #define BCM2835_DMA_RX_PANIC_THR	40
+#define BCM2835_DMA_BURST_SIZE		2
+#define BCM2835_FIFO_THR_TX		1
+#define BCM2835_FIFO_THR_RX		1
+#define BCM2835_I2S_FIFO_DEPTH		64
 
 /* I2S registers */
 #define BCM2835_I2S_CS_A_REG		0x00
@@ -90,14 +96,30 @@
 #define BCM2835_I2S_INT_RXR		BIT(1)
 #define BCM2835_I2S_INT_TXW		BIT(0)
 
+/* GPIO registers, used for the CV gates */
+#define BCM2835_GPIO_GPSET0_REG		0x1c
+#define BCM2835_GPIO_GPCLR0_REG		0x28
+#define BCM2835_GPIO_GPLEV0_REG		0x34
+
 /* Frame length register is 10 bit, maximum length 1024 */
 #define BCM2835_I2S_MAX_FRAME_LENGTH	1024
 #define RESERVED_BUFFER_SIZE_IN_PAGES	20
+/* Max FIFO words per frame looked back at when synching on the guard slots */
+#define BCM2835_I2S_SYNCH_MAX_LAG	32
+/* Give up synching on the guard slots after this, e.g. with no bit clock */
+#define BCM2835_I2S_SYNCH_TIMEOUT_MS	100
+/* Silent periods before the calibration impulse, lets the codec settle */
+#define BCM2835_I2S_CALIB_SETTLE_PERIODS	8
 
 static inline void rpi_reg_write(void *base_addr, uint32_t reg_addr,
 				uint32_t value)
 {
 	uint32_t *reg = base_addr + reg_addr;
+
+	if (static_branch_unlikely(&audio_evl_hw_sim)) {
+		audio_evl_hw_sim_write(base_addr, reg_addr, value);
+		return;
+	}
 	wmb();
 	*reg = value;
 }
@@ -106,6 +128,13 @@ static inline void rpi_reg_update_bits(void *base_addr, uint32_t reg_addr,
 				uint32_t mask, uint32_t value)
 {
 	uint32_t *reg = base_addr + reg_addr;
+
+	if (static_branch_unlikely(&audio_evl_hw_sim)) {
+		audio_evl_hw_sim_write(base_addr, reg_addr,
+			(audio_evl_hw_sim_read(base_addr, reg_addr) & ~mask) |
+			(mask & value));
+		return;
+	}
 	wmb();
 	*reg &= (~mask);
 	*reg |= (mask & value);
@@ -115,14 +144,56 @@ static inline void rpi_reg_read(void *base_addr, uint32_t reg_addr,
 			uint32_t *value)
 {
 	uint32_t *reg = base_addr + reg_addr;
+
+	if (static_branch_unlikely(&audio_evl_hw_sim)) {
+		*value = audio_evl_hw_sim_read(base_addr, reg_addr);
+		return;
+	}
 	rmb();
 	*value = *reg;
 }
 
-extern int bcm2835_i2s_init(char *audio_hat);
-extern int bcm2835_i2s_exit(void);
-extern struct audio_evl_dev *bcm2835_get_i2s_dev(void);
-extern int bcm2835_i2s_buffers_setup(int audio_buffer_size, int audio_channels);
-extern void bcm2835_i2s_start_stop(struct audio_evl_dev *audio_dev, int cmd);
+/* Record of the given period in the flight recorder ring */
+static inline struct audio_evl_flight_record *
+bcm2835_i2s_flight_record(struct audio_evl_dev *audio_dev, uint64_t period)
+{
+	struct audio_evl_flight_record *record =
+		&audio_dev->flight_ring[period & (AUDIO_EVL_FLIGHT_RING - 1)];
+
+	return record->period == period ? record : NULL;
+}
+
+struct audio_evl_hat;
+extern int bcm2835_i2s_init(struct audio_evl_dev *audio_dev,
+			const struct audio_evl_hat *hat);
+extern int bcm2835_i2s_exit(struct audio_evl_dev *audio_dev);
+extern struct audio_evl_dev *bcm2835_get_i2s_dev(int id);
+extern int bcm2835_i2s_num_devs(void);
+extern int bcm2835_i2s_round_trip_frames(struct audio_evl_dev *audio_dev);
+extern int bcm2835_i2s_calibrate(struct audio_evl_dev *audio_dev,
+			unsigned tx_slot, unsigned rx_slot, int32_t impulse,
+			uint32_t threshold, unsigned timeout_ms);
+extern int bcm2835_i2s_buffers_setup(struct audio_evl_dev *audio_dev,
+			int audio_buffer_size, int audio_channels,
+			bool packed_16bit);
+extern int bcm2835_i2s_set_tdm(struct audio_evl_dev *audio_dev,
+			const struct audio_evl_tdm_config *tdm);
+extern int bcm2835_i2s_start_stop(struct audio_evl_dev *audio_dev, int cmd);
+extern int bcm2835_i2s_post_event(struct audio_evl_dev *audio_dev,
+				const struct audio_event *event, ktime_t date);
+extern void bcm2835_i2s_flight_trigger(struct audio_evl_dev *audio_dev);
+extern void bcm2835_i2s_set_monitor(struct audio_evl_dev *audio_dev,
+			const struct audio_evl_monitor_route *routes,
+			int num_routes);
+extern void bcm2835_i2s_monitor_mix(struct audio_evl_dev *audio_dev,
+			int idx, bool replace);
+extern void bcm2835_i2s_start_stop_group(struct audio_evl_dev **devs,
+			int num_devs, int cmd);
+
+#if IS_ENABLED(CONFIG_KUNIT)
+extern void bcm2835_i2s_configure(struct audio_evl_dev *audio_dev);
+extern void bcm2835_i2s_clear_fifos(struct audio_evl_dev *audio_dev,
+				bool tx, bool rx);
+#endif
 
 #endif
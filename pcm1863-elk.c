@@ -12,6 +12,7 @@
 #include <linux/delay.h>
 
 #include "pcm1863-elk.h"
+#include "audio-evl-hw.h"
 
 #define PCM1863_I2C_BUS_NUM 1
 
@@ -25,10 +26,7 @@ static int pcm1863_reg_write(struct i2c_client *dev,
 				unsigned int reg, unsigned int val)
 {
 	int ret;
-	char cmd[2];
-	cmd[0] = reg & 0xff;
-	cmd[1] = val;
-	ret = i2c_master_send(dev, (const char *)cmd, 2);
+	ret = audio_evl_hw_i2c_write(dev, reg, val);
 	if (ret < 0) {
 		printk("pcm1863: Failed to write reg\n");
 		return ret;
@@ -78,14 +76,14 @@ int pcm1863_codec_init(bool enable_low_latency)
 {
 	struct i2c_client *client = NULL;
 	struct i2c_adapter *adapter = NULL;
-	adapter = i2c_get_adapter(PCM1863_I2C_BUS_NUM);
+	adapter = audio_evl_hw_i2c_get_adapter(PCM1863_I2C_BUS_NUM);
 	if (!adapter) {
 		printk(KERN_ERR "pcm1863-elk: Failed to get i2c adapter\n");
 		return -1;
 	}
 
-	client = i2c_new_client_device(adapter, i2c_pcm1863_board_info);
-	if (!client) {
+	client = audio_evl_hw_i2c_new_client(adapter, i2c_pcm1863_board_info);
+	if (IS_ERR(client)) {
 		printk(KERN_ERR "pcm1863-elk: Failed to get i2c client\n");
 		return -1;
 	}
@@ -94,8 +92,8 @@ int pcm1863_codec_init(bool enable_low_latency)
 		printk(KERN_ERR "pcm1863-elk: config_codec failed\n");
 		return -1;
 	}
-	i2c_unregister_device(client);
-	i2c_put_adapter(adapter);
+	audio_evl_hw_i2c_unregister(client);
+	audio_evl_hw_i2c_put_adapter(adapter);
 	printk(KERN_INFO "pcm1863-elk: codec configured\n");
 	return 0;
 }
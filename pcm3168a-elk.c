@@ -10,9 +10,10 @@
 #include <linux/kernel.h>
 #include <linux/i2c.h>
 #include <linux/delay.h>
-#include <linux/gpio.h>
+#include <kunit/visibility.h>
 
 #include "pcm3168a-elk.h"
+#include "audio-evl-hw.h"
 
 #define PCM3168A_CODEC_RST_PIN  16
 #define PCM3168A_CPLD_RST_PIN 	4
@@ -81,10 +82,7 @@ static int pcm3168_reg_write(struct i2c_client *dev,
 				unsigned int reg, unsigned int val)
 {
 	int ret;
-	char cmd[2];
-	cmd[0] = reg & 0xff;
-	cmd[1] = val;
-	ret = i2c_master_send(dev, (const char *)cmd, 2);
+	ret = audio_evl_hw_i2c_write(dev, reg, val);
 	if (ret < 0) {
 		printk("pcm5122: Failed to write reg\n");
 		return ret;
@@ -120,7 +118,7 @@ static int pcm3168a_config_clk_gen(struct i2c_client *dev)
 	return 0;
 }
 
-static int pcm3168a_config_codec(struct i2c_client *i2c_client_dev)
+VISIBLE_IF_KUNIT int pcm3168a_config_codec(struct i2c_client *i2c_client_dev)
 {
 	int ret = -1;
 
@@ -185,51 +183,79 @@ static int pcm3168a_config_codec(struct i2c_client *i2c_client_dev)
 	}
 	return 0;
 }
+EXPORT_SYMBOL_IF_KUNIT(pcm3168a_config_codec);
 
 int pcm3168a_codec_init(void)
 {
 	int ret;
-	struct i2c_adapter *adapter = i2c_get_adapter(PCM3168A_I2C_BUS_NUM);
-	struct i2c_client *client = i2c_new_client_device
-					(adapter, i2c_clkgen_board_info);
+	struct i2c_client *client;
+	struct i2c_adapter *adapter;
 
-	ret = gpio_request(PCM3168A_CODEC_RST_PIN, "CODEC_RST");
+	adapter = audio_evl_hw_i2c_get_adapter(PCM3168A_I2C_BUS_NUM);
+	if (!adapter) {
+		printk(KERN_ERR "pcm3168a-elk: Failed to get i2c adapter\n");
+		return -ENODEV;
+	}
+	client = audio_evl_hw_i2c_new_client(adapter, i2c_clkgen_board_info);
+	if (IS_ERR(client)) {
+		printk(KERN_ERR "pcm3168a-elk: Failed to get clk-gen client\n");
+		audio_evl_hw_i2c_put_adapter(adapter);
+		return PTR_ERR(client);
+	}
+
+	ret = audio_evl_hw_gpio_request(PCM3168A_CODEC_RST_PIN, "CODEC_RST");
 	if (ret < 0) {
 		printk(KERN_ERR "pcm3168a-elk: Failed to get CODEC_RST_GPIO\n");
-		return ret;
+		goto fail_client;
 	}
-	ret = gpio_request(PCM3168A_CPLD_RST_PIN, "SIKA_RST");
+	ret = audio_evl_hw_gpio_request(PCM3168A_CPLD_RST_PIN, "SIKA_RST");
 	if (ret < 0) {
 		printk(KERN_ERR "pcm3168a-elk: Failed to get CPLD_RST\n");
-		return ret;
+		audio_evl_hw_gpio_free(PCM3168A_CODEC_RST_PIN);
+		goto fail_client;
 	}
-	gpio_direction_output(PCM3168A_CPLD_RST_PIN, 1);
-	gpio_direction_output(PCM3168A_CODEC_RST_PIN, 0);
+	audio_evl_hw_gpio_direction_output(PCM3168A_CPLD_RST_PIN, 1);
+	audio_evl_hw_gpio_direction_output(PCM3168A_CODEC_RST_PIN, 0);
 	if (pcm3168a_config_clk_gen(client))
 		printk(KERN_ERR "pcm3168a-elk: clk generator config failed\n");
 	msleep(200); // let the clk settle
-	gpio_direction_output(PCM3168A_CODEC_RST_PIN, 1);
+	audio_evl_hw_gpio_direction_output(PCM3168A_CODEC_RST_PIN, 1);
 	msleep(5);
-	i2c_unregister_device(client);
-	client = i2c_new_client_device(adapter, i2c_pcm3168a_board_info);
+	audio_evl_hw_i2c_unregister(client);
+	client = audio_evl_hw_i2c_new_client(adapter, i2c_pcm3168a_board_info);
+	if (IS_ERR(client)) {
+		printk(KERN_ERR "pcm3168a-elk: Failed to get codec client\n");
+		ret = PTR_ERR(client);
+		client = NULL;
+		goto fail_gpio;
+	}
 	if (pcm3168a_config_codec(client)) {
 		printk(KERN_ERR "pcm31681-elk: config_codec failed\n");
-		return -1;
+		ret = -EIO;
+		goto fail_gpio;
 	}
 	msleep(5);
-	gpio_direction_output(PCM3168A_CPLD_RST_PIN, 0);
-	i2c_unregister_device(client);
-	i2c_put_adapter(adapter);
+	audio_evl_hw_gpio_direction_output(PCM3168A_CPLD_RST_PIN, 0);
+	audio_evl_hw_i2c_unregister(client);
+	audio_evl_hw_i2c_put_adapter(adapter);
 	printk(KERN_INFO "pcm31681-elk: codec configured\n");
 	return 0;
+
+fail_gpio:
+	audio_evl_hw_gpio_free(PCM3168A_CPLD_RST_PIN);
+	audio_evl_hw_gpio_free(PCM3168A_CODEC_RST_PIN);
+fail_client:
+	audio_evl_hw_i2c_unregister(client);
+	audio_evl_hw_i2c_put_adapter(adapter);
+	return ret;
 }
 EXPORT_SYMBOL_GPL(pcm3168a_codec_init);
 
 void pcm3168a_codec_exit(void)
 {
 	printk(KERN_INFO "pcm31681-elk: unregister i2c-client\n");
-	gpio_free(PCM3168A_CODEC_RST_PIN);
-	gpio_free(PCM3168A_CPLD_RST_PIN);
+	audio_evl_hw_gpio_free(PCM3168A_CODEC_RST_PIN);
+	audio_evl_hw_gpio_free(PCM3168A_CPLD_RST_PIN);
 }
 EXPORT_SYMBOL_GPL(pcm3168a_codec_exit);
 
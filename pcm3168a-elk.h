@@ -216,4 +216,9 @@
 extern int pcm3168a_codec_init(void);
 extern void pcm3168a_codec_exit(void);
 
+#if IS_ENABLED(CONFIG_KUNIT)
+struct i2c_client;
+extern int pcm3168a_config_codec(struct i2c_client *i2c_client_dev);
+#endif
+
 #endif
\ No newline at end of file
@@ -12,6 +12,7 @@
 #include <linux/delay.h>
 
 #include "pcm5122-elk.h"
+#include "audio-evl-hw.h"
 
 #define PCM5122_I2C_BUS_NUM 	1
 #define PCM5122_SCLK_RATE 	24576000
@@ -31,10 +32,7 @@ static int pcm5122_reg_write(struct i2c_client *dev,
 				unsigned int reg, unsigned int val)
 {
 	int ret;
-	char cmd[2];
-	cmd[0] = reg & 0xff;
-	cmd[1] = val;
-	ret = i2c_master_send(dev, (const char *)cmd, 2);
+	ret = audio_evl_hw_i2c_write(dev, reg, val);
 	if (ret < 0) {
 		printk("pcm5122: Failed to write reg\n");
 		return ret;
@@ -144,7 +142,7 @@ int pcm5122_codec_init(int mode, int sampling_freq, bool enable_low_latency)
 	struct i2c_adapter *adapter = NULL;
 	struct i2c_board_info i2c_info;
 
-	adapter = i2c_get_adapter(PCM5122_I2C_BUS_NUM);
+	adapter = audio_evl_hw_i2c_get_adapter(PCM5122_I2C_BUS_NUM);
 	if (!adapter) {
 		printk(KERN_ERR "pcm5122: Failed to get i2c adapter\n");
 		return -1;
@@ -152,8 +150,9 @@ int pcm5122_codec_init(int mode, int sampling_freq, bool enable_low_latency)
 
 	memset(&i2c_info, 0, sizeof(struct i2c_board_info));
 	strscpy(i2c_info.type, I2C_DEV_TYPE, sizeof(i2c_info.type));
-	client = i2c_new_scanned_device(adapter, &i2c_info, i2c_probe_addr, NULL);
-	if (!client) {
+	client = audio_evl_hw_i2c_new_scanned(adapter, &i2c_info,
+					i2c_probe_addr);
+	if (IS_ERR(client)) {
 		printk(KERN_ERR "pcm5122: Failed to get i2c client 5122\n");
 		return -1;
 	}
@@ -162,8 +161,8 @@ int pcm5122_codec_init(int mode, int sampling_freq, bool enable_low_latency)
 		printk(KERN_ERR "pcm5122-elk: config_codec failed\n");
 		return -1;
 	}
-	i2c_unregister_device(client);
-	i2c_put_adapter(adapter);
+	audio_evl_hw_i2c_unregister(client);
+	audio_evl_hw_i2c_put_adapter(adapter);
 	printk(KERN_INFO "pcm5122-elk: codec configured\n");
 	return 0;
 }
@@ -14,6 +14,9 @@
 #include <linux/sysfs.h>
 #include <linux/uaccess.h>
 #include <linux/device.h>
+#include <linux/bitops.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
 
 /* EVL headers */
 #include <evl/file.h>
@@ -23,25 +26,20 @@
 #include <evl/uaccess.h>
 
 #include "rpi-audio-evl.h"
-#include "elk-pi-config.h"
-#include "hifi-berry-config.h"
-#include "hifi-berry-pro-config.h"
-#include "pcm3168a-elk.h"
-#include "pcm5122-elk.h"
-#include "pcm1863-elk.h"
+#include "audio-evl-hat.h"
+#include "audio-evl-bridge.h"
+#include "audio-evl-mailbox.h"
+#include "audio-evl-events.h"
+#include "audio-evl-profile.h"
 #include "bcm2835-i2s-elk.h"
+#include "audio-evl-trace.h"
 
 MODULE_AUTHOR("Nitin Kulkarni (nitin@elk.audio)");
 MODULE_AUTHOR("Marco Del Fiasco (marco@elk.audio)");
 MODULE_DESCRIPTION("EVL audio driver for RPi");
 MODULE_LICENSE("GPL");
 
-#define DEFAULT_AUDIO_SAMPLING_RATE			48000
-#define DEFAULT_AUDIO_NUM_INPUT_CHANNELS		8
-#define DEFAULT_AUDIO_NUM_OUTPUT_CHANNELS		8
-#define DEFAULT_AUDIO_NUM_CODEC_CHANNELS		8
 #define DEFAULT_AUDIO_N_FRAMES_PER_BUFFER		64
-#define DEFAULT_AUDIO_CODEC_FORMAT			INT24_LJ
 #define DEFAULT_AUDIO_LOW_LATENCY_VAL			1
 #define PLATFORM_TYPE					NATIVE_AUDIO
 #define USB_AUDIO_TYPE			NONE
@@ -51,36 +49,187 @@ MODULE_LICENSE("GPL");
 static uint audio_ver_maj = AUDIO_EVL_VERSION_MAJ;
 static uint audio_ver_min = AUDIO_EVL_VERSION_MIN;
 static uint audio_ver_rev = AUDIO_EVL_VERSION_VER;
-static uint audio_input_channels = DEFAULT_AUDIO_NUM_INPUT_CHANNELS;
-static uint audio_output_channels = DEFAULT_AUDIO_NUM_OUTPUT_CHANNELS;
-static uint audio_sampling_rate = DEFAULT_AUDIO_SAMPLING_RATE;
 static uint platform_type = PLATFORM_TYPE;
 static const uint usb_audio_type = USB_AUDIO_TYPE;
 
 static uint audio_buffer_size = DEFAULT_AUDIO_N_FRAMES_PER_BUFFER;
 module_param(audio_buffer_size, uint, 0644);
-static char *audio_hat = "elk-pi";
-module_param(audio_hat, charp, 0644);
+/* One hat per I2S interface, in probe order */
+static char *audio_hat[AUDIO_EVL_MAX_DEVS] = {"elk-pi"};
+static int num_audio_hats = 1;
+module_param_array(audio_hat, charp, &num_audio_hats, 0444);
+/* Also expose all the interfaces as a single device, audio_evl_all */
+static uint audio_aggregate = 0;
+module_param(audio_aggregate, uint, 0444);
 static uint audio_enable_low_latency = DEFAULT_AUDIO_LOW_LATENCY_VAL;
 module_param(audio_enable_low_latency, uint, 0644);
+/* Value of audio_enable_low_latency the codecs were set up with */
+static bool codec_low_latency;
+/* Run the self-test of every device when the driver is loaded */
+static bool audio_self_test;
+module_param(audio_self_test, bool, 0444);
+/* Duration of the stream run by the self-test */
+static uint audio_self_test_ms = 200;
+module_param(audio_self_test_ms, uint, 0644);
 static int session_under_runs = 0;
 module_param(session_under_runs, int, 0644);
 static uint kernel_interrupts = 0;
 module_param(kernel_interrupts, uint, 0444);
 static uint audio_irq_affinity = DEFAULT_IRQ_AFFINITY;
 module_param(audio_irq_affinity, uint, 0644);
+/* Take 16 bit samples, two per FIFO word, to halve the DMA traffic */
+static uint audio_packed_16bit = 0;
+module_param(audio_packed_16bit, uint, 0644);
+
+/* TDM overrides, 0 keeps the hat defaults */
+static uint audio_tdm_slots = 0;
+module_param(audio_tdm_slots, uint, 0444);
+static uint audio_tdm_slot_width = 0;
+module_param(audio_tdm_slot_width, uint, 0444);
+static uint audio_rx_slot_mask = 0;
+module_param(audio_rx_slot_mask, uint, 0444);
+static uint audio_tx_slot_mask = 0;
+module_param(audio_tx_slot_mask, uint, 0444);
 
 static const int supported_buffer_sizes[] = {SUPPORTED_BUFFER_SIZES};
-static uint num_codec_channels = DEFAULT_AUDIO_NUM_CODEC_CHANNELS;
-static uint audio_format = DEFAULT_AUDIO_CODEC_FORMAT;
+/* Time spent in the ioctls, excluding the wait for the DMA callback */
+static AUDIO_EVL_PROF(oob_ioctl);
 static unsigned long user_proc_completions = 0;
 
+enum audio_evl_alignment {
+	AUDIO_EVL_ALIGNMENT_NOT_CHECKED,
+	AUDIO_EVL_ALIGNMENT_OK,
+	AUDIO_EVL_ALIGNMENT_SLIPPED,
+};
+
+struct audio_evl_self_test {
+	bool				run;
+	bool				pass;
+	uint64_t			codec_init_ns;
+	uint64_t			i2s_init_ns;
+	uint64_t			stream_setup_ns;
+	uint64_t			periods;
+	uint64_t			expected_periods;
+	int64_t				period_interval_min_ns;
+	int64_t				period_interval_max_ns;
+	unsigned long			fifo_errors;
+	enum audio_evl_alignment	alignment;
+	/* Error starting the stream, e.g. no frame synch, 0 if it started */
+	int				start_error;
+};
+
+/*
+ * A char device driving one or more I2S interfaces. The aggregate one has
+ * no hat of its own and lays out the buffers of its interfaces one
+ * reserved area after the other in its mmap.
+ */
+struct audio_evl_instance {
+	const char			*name;
+	const struct audio_evl_hat	*hat;
+	struct audio_evl_dev		*i2s_devs[AUDIO_EVL_MAX_DEVS];
+	int				num_i2s_devs;
+	uint				input_channels;
+	uint				output_channels;
+	uint				codec_channels;
+	uint				format;
+	uint				sampling_rate;
+	struct audio_evl_self_test	self_test;
+	/* DSP load in permille, avg is scaled by 16 and max by 256 */
+	uint				dsp_load_avg;
+	uint				dsp_load_peak;
+	uint				dsp_load_max;
+	/* Set by AUDIO_CALIBRATE_LATENCY, 0 = not measured this session */
+	int				measured_latency_frames;
+};
+
+static struct audio_evl_instance audio_evl_instances[AUDIO_EVL_MAX_DEVS + 1];
+static int num_audio_evl_instances;
+
+static DEFINE_MUTEX(audio_evl_users_lock);
+
+/*
+ * The aggregate device shares its interfaces with the other ones, so a
+ * session claims all the interfaces of its instance or none of them.
+ * Called with audio_evl_users_lock held.
+ */
+static int audio_evl_claim_devs(struct audio_evl_instance *inst)
+{
+	int i;
+
+	for (i = 0; i < inst->num_i2s_devs; i++)
+		if (inst->i2s_devs[i]->busy)
+			return -EBUSY;
+	for (i = 0; i < inst->num_i2s_devs; i++)
+		inst->i2s_devs[i]->busy = true;
+	return 0;
+}
+
+static void audio_evl_unclaim_devs(struct audio_evl_instance *inst)
+{
+	int i;
+
+	for (i = 0; i < inst->num_i2s_devs; i++)
+		inst->i2s_devs[i]->busy = false;
+}
+
+static struct audio_evl_bridge *audio_evl_bridge;
+static DEFINE_MUTEX(audio_evl_bridge_lock);
+
+static void audio_evl_put_bridge(struct audio_evl_bridge *bridge)
+{
+	/* The bridge may be freed as soon as it is released */
+	struct module *owner = bridge->owner;
+
+	if (refcount_dec_and_test(&bridge->users))
+		complete(&bridge->released);
+	module_put(owner);
+}
+
+static struct audio_evl_mailbox_transport *audio_evl_mailbox;
+static DEFINE_MUTEX(audio_evl_mailbox_lock);
+
+static void audio_evl_put_mailbox(struct audio_evl_mailbox_transport *mailbox)
+{
+	/* The transport may be freed as soon as it is released */
+	struct module *owner = mailbox->owner;
+
+	if (refcount_dec_and_test(&mailbox->users))
+		complete(&mailbox->released);
+	module_put(owner);
+}
+
+static struct audio_evl_event_sink *audio_evl_event_sink;
+static DEFINE_MUTEX(audio_evl_event_sink_lock);
+
+static void audio_evl_put_event_sink(struct audio_evl_event_sink *sink)
+{
+	/* The sink may be freed as soon as it is released */
+	struct module *owner = sink->owner;
+
+	if (refcount_dec_and_test(&sink->users))
+		complete(&sink->released);
+	module_put(owner);
+}
+
 struct audio_dev_context {
+	struct audio_evl_instance *inst;
+	/* First interface of the instance, it paces the client */
 	struct audio_evl_dev *i2s_dev;
 	struct audio_channel_info_data* audio_input_info;
 	struct audio_channel_info_data* audio_output_info;
 	struct evl_file	efile;
 	uint64_t user_proc_calls;
+	/* Start of the period the client is processing */
+	ktime_t period_ts;
+	/* Between AUDIO_PROC_START and AUDIO_PROC_STOP */
+	bool running;
+	/* Scratch of AUDIO_SET_MONITOR, too large for the oob stack */
+	struct audio_monitor_config monitor_config;
+	struct audio_evl_monitor_route monitor_routes[AUDIO_MONITOR_MAX_ROUTES];
+	/* Pinned for the whole session, so it can be used oob */
+	struct audio_evl_bridge *bridge;
+	struct audio_evl_mailbox_transport *mailbox;
+	struct audio_evl_event_sink *event_sink;
 };
 
 static ssize_t audio_buffer_size_show(struct class *cls,
@@ -102,13 +251,13 @@ static ssize_t audio_buffer_size_store(struct class *class,
 
 static ssize_t audio_hat_show(struct class *cls, struct class_attribute *attr,
                               char *buf) {
-  return sprintf(buf, "%s\n", audio_hat);
+  return sprintf(buf, "%s\n", audio_hat[0]);
 }
 
 static ssize_t audio_sampling_rate_show(struct class *cls,
                                         struct class_attribute *attr,
                                         char *buf) {
-  return sprintf(buf, "%du\n", audio_sampling_rate);
+  return sprintf(buf, "%du\n", audio_evl_instances[0].sampling_rate);
 }
 
 static ssize_t audio_ver_maj_show(struct class *cls,
@@ -132,13 +281,13 @@ static ssize_t audio_ver_rev_show(struct class *cls,
 static ssize_t audio_input_channels_show(struct class *cls,
                                          struct class_attribute *attr,
                                          char *buf) {
-  return sprintf(buf, "%d\n", audio_input_channels);
+  return sprintf(buf, "%d\n", audio_evl_instances[0].input_channels);
 }
 
 static ssize_t audio_output_channels_show(struct class *cls,
                                           struct class_attribute *attr,
                                           char *buf) {
-  return sprintf(buf, "%d\n", audio_output_channels);
+  return sprintf(buf, "%d\n", audio_evl_instances[0].output_channels);
 }
 
 static ssize_t platform_type_show(struct class *cls,
@@ -158,6 +307,110 @@ static ssize_t audio_irq_affinity_show(struct class *cls,
 	return sprintf(buf, "%d\n", audio_irq_affinity);
 }
 
+static ssize_t i2s_tx_fifo_errors_show(struct class *cls,
+				struct class_attribute *attr, char *buf)
+{
+	struct audio_evl_dev *i2s_dev = bcm2835_get_i2s_dev(0);
+
+	if (!i2s_dev)
+		return -ENODEV;
+	return sprintf(buf, "%lu\n", i2s_dev->tx_fifo_errors);
+}
+
+static ssize_t i2s_rx_fifo_errors_show(struct class *cls,
+				struct class_attribute *attr, char *buf)
+{
+	struct audio_evl_dev *i2s_dev = bcm2835_get_i2s_dev(0);
+
+	if (!i2s_dev)
+		return -ENODEV;
+	return sprintf(buf, "%lu\n", i2s_dev->rx_fifo_errors);
+}
+
+static ssize_t i2s_fifo_recoveries_show(struct class *cls,
+				struct class_attribute *attr, char *buf)
+{
+	struct audio_evl_dev *i2s_dev = bcm2835_get_i2s_dev(0);
+
+	if (!i2s_dev)
+		return -ENODEV;
+	return sprintf(buf, "%lu\n", i2s_dev->fifo_recoveries);
+}
+
+static ssize_t i2s_resyncs_show(struct class *cls,
+				struct class_attribute *attr, char *buf)
+{
+	struct audio_evl_dev *i2s_dev = bcm2835_get_i2s_dev(0);
+
+	if (!i2s_dev)
+		return -ENODEV;
+	return sprintf(buf, "%lu\n", i2s_dev->resyncs);
+}
+
+static ssize_t i2s_watchdog_recoveries_show(struct class *cls,
+				struct class_attribute *attr, char *buf)
+{
+	struct audio_evl_dev *i2s_dev = bcm2835_get_i2s_dev(0);
+
+	if (!i2s_dev)
+		return -ENODEV;
+	return sprintf(buf, "%lu\n", i2s_dev->watchdog_recoveries);
+}
+
+static ssize_t dma_period_interval_min_ns_show(struct class *cls,
+				struct class_attribute *attr, char *buf)
+{
+	struct audio_evl_dev *i2s_dev = bcm2835_get_i2s_dev(0);
+
+	if (!i2s_dev)
+		return -ENODEV;
+	return sprintf(buf, "%lld\n", i2s_dev->period_interval_min_ns);
+}
+
+static ssize_t dma_period_interval_max_ns_show(struct class *cls,
+				struct class_attribute *attr, char *buf)
+{
+	struct audio_evl_dev *i2s_dev = bcm2835_get_i2s_dev(0);
+
+	if (!i2s_dev)
+		return -ENODEV;
+	return sprintf(buf, "%lld\n", i2s_dev->period_interval_max_ns);
+}
+
+static ssize_t audio_tdm_config_show(struct class *cls,
+				struct class_attribute *attr, char *buf)
+{
+	struct audio_evl_dev *i2s_dev = bcm2835_get_i2s_dev(0);
+	struct audio_evl_tdm_config *tdm;
+
+	if (!i2s_dev)
+		return -ENODEV;
+	tdm = &i2s_dev->tdm;
+	return sprintf(buf, "slots=%u slot_width=%u frame_length=%u "
+			"rx_slot_mask=0x%x tx_slot_mask=0x%x\n",
+			tdm->slots, tdm->slot_width, tdm->frame_length,
+			tdm->rx_slot_mask, tdm->tx_slot_mask);
+}
+
+/* 1 when the buffers hold packed 16 bit samples, 32 bit ones otherwise */
+static ssize_t audio_packed_16bit_show(struct class *cls,
+				struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", audio_packed_16bit);
+}
+
+static ssize_t mailbox_transport_show(struct class *cls,
+				struct class_attribute *attr, char *buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&audio_evl_mailbox_lock);
+	ret = sprintf(buf, "%s\n",
+		audio_evl_mailbox ? audio_evl_mailbox->name : "none");
+	mutex_unlock(&audio_evl_mailbox_lock);
+	return ret;
+}
+
 static CLASS_ATTR_RW(audio_buffer_size);
 static CLASS_ATTR_RO(audio_hat);
 static CLASS_ATTR_RO(audio_sampling_rate);
@@ -169,6 +422,16 @@ static CLASS_ATTR_RO(audio_output_channels);
 static CLASS_ATTR_RO(platform_type);
 static CLASS_ATTR_RO(usb_audio_type);
 static CLASS_ATTR_RO(audio_irq_affinity);
+static CLASS_ATTR_RO(i2s_tx_fifo_errors);
+static CLASS_ATTR_RO(i2s_rx_fifo_errors);
+static CLASS_ATTR_RO(i2s_fifo_recoveries);
+static CLASS_ATTR_RO(i2s_resyncs);
+static CLASS_ATTR_RO(i2s_watchdog_recoveries);
+static CLASS_ATTR_RO(dma_period_interval_min_ns);
+static CLASS_ATTR_RO(dma_period_interval_max_ns);
+static CLASS_ATTR_RO(audio_tdm_config);
+static CLASS_ATTR_RO(mailbox_transport);
+static CLASS_ATTR_RO(audio_packed_16bit);
 
 static struct attribute *audio_evl_class_attrs[] = {
 	&class_attr_audio_buffer_size.attr,
@@ -182,6 +445,16 @@ static struct attribute *audio_evl_class_attrs[] = {
 	&class_attr_platform_type.attr,
 	&class_attr_usb_audio_type.attr,
 	&class_attr_audio_irq_affinity.attr,
+	&class_attr_i2s_tx_fifo_errors.attr,
+	&class_attr_i2s_rx_fifo_errors.attr,
+	&class_attr_i2s_fifo_recoveries.attr,
+	&class_attr_i2s_resyncs.attr,
+	&class_attr_i2s_watchdog_recoveries.attr,
+	&class_attr_dma_period_interval_min_ns.attr,
+	&class_attr_dma_period_interval_max_ns.attr,
+	&class_attr_mailbox_transport.attr,
+	&class_attr_audio_tdm_config.attr,
+	&class_attr_audio_packed_16bit.attr,
 	NULL,
 };
 ATTRIBUTE_GROUPS(audio_evl_class);
@@ -191,17 +464,84 @@ struct class audio_evl_class = {
     .class_groups = audio_evl_class_groups,
 };
 
+/* Offset, in samples, of an interface's buffers in the instance mmap */
+static uint audio_evl_dev_offset(int idx)
+{
+	return idx * RESERVED_BUFFER_SIZE_IN_PAGES * PAGE_SIZE /
+		(audio_packed_16bit ? sizeof(uint16_t) : sizeof(uint32_t));
+}
+
+static void audio_evl_fill_chan_info(struct audio_evl_instance *inst,
+		struct audio_channel_info_data *info, int direction)
+{
+	int idx, slot, chan_num = 0;
+	unsigned long slots;
+	uint sample_format = audio_packed_16bit ? INT16_PACKED : inst->format;
+
+	/* Channels map to the active slots of the tdm frame, in slot order */
+	for (idx = 0; idx < inst->num_i2s_devs; idx++) {
+		slots = direction == INPUT_DIRECTION ?
+			inst->i2s_devs[idx]->tdm.rx_slot_mask :
+			inst->i2s_devs[idx]->tdm.tx_slot_mask;
+		for_each_set_bit(slot, &slots, AUDIO_EVL_MAX_TDM_SLOTS) {
+			struct audio_channel_info_data *chan_info =
+							&info[chan_num];
+
+			chan_info->sw_ch_id = chan_num;
+			chan_info->hw_ch_id = idx * AUDIO_EVL_MAX_TDM_SLOTS + slot;
+			chan_info->direction = direction;
+			chan_info->sample_format = sample_format;
+			snprintf((char *)chan_info->channel_name,
+					AUDIO_CHANNEL_NAME_SIZE - 1,
+					"IN-%d",
+					chan_num);
+			chan_info->start_offset_in_words =
+					audio_evl_dev_offset(idx) + slot;
+			chan_info->stride_in_words = inst->codec_channels;
+			chan_num++;
+		}
+	}
+}
+
+/* Counters and stream state of a new session */
+static void audio_evl_reset_dev(struct audio_evl_dev *i2s_dev)
+{
+	i2s_dev->wait_flag = 0;
+	i2s_dev->kinterrupts = 0;
+	i2s_dev->buffer_idx = 0;
+	i2s_dev->tx_fifo_errors = 0;
+	i2s_dev->rx_fifo_errors = 0;
+	i2s_dev->fifo_recoveries = 0;
+	i2s_dev->fifo_error_periods = 0;
+	i2s_dev->resyncs = 0;
+	i2s_dev->watchdog_recoveries = 0;
+	i2s_dev->slip_periods = 0;
+	i2s_dev->stream_error = 0;
+	WRITE_ONCE(i2s_dev->closing, false);
+	i2s_dev->period_interval_min_ns = S64_MAX;
+	i2s_dev->period_interval_max_ns = 0;
+	evl_init_flag(&i2s_dev->event_flag);
+}
+
 static int audio_driver_open(struct inode *inode, struct file *filp)
 {
 	int ret = 0;
+	int i;
 	struct audio_dev_context *dev_context;
-	int chan_num;
+	struct audio_evl_instance *inst = &audio_evl_instances[iminor(inode)];
 
 	dev_context = kzalloc(sizeof(*dev_context), GFP_KERNEL);
 	if (dev_context == NULL)
 		return -ENOMEM;
+	mutex_lock(&audio_evl_users_lock);
+	ret = audio_evl_claim_devs(inst);
+	mutex_unlock(&audio_evl_users_lock);
+	if (ret) {
+		kfree(dev_context);
+		return ret;
+	}
 
-	dev_context->audio_input_info = kcalloc(audio_input_channels,
+	dev_context->audio_input_info = kcalloc(inst->input_channels,
 				sizeof(struct audio_channel_info_data), GFP_KERNEL);
 	if (!dev_context->audio_input_info) {
 		printk(KERN_ERR "audio_evl: Failed to allocate input chan info\n");
@@ -209,7 +549,7 @@ static int audio_driver_open(struct inode *inode, struct file *filp)
 		goto fail_in_ch;
 	}
 
-	dev_context->audio_output_info = kcalloc(audio_output_channels,
+	dev_context->audio_output_info = kcalloc(inst->output_channels,
 				sizeof(struct audio_channel_info_data), GFP_KERNEL);	
 	if (!dev_context->audio_output_info) {
 		printk(KERN_ERR "audio_evl: Failed to allocate output chan info\n");
@@ -217,37 +557,21 @@ static int audio_driver_open(struct inode *inode, struct file *filp)
 		goto fail_out_ch;
 	}
 
-	// fill dummy chan info
-	for (chan_num = 0; chan_num < audio_input_channels; chan_num++) {
-		struct audio_channel_info_data *audio_input_info =
-			&dev_context->audio_input_info[chan_num];
+	audio_evl_fill_chan_info(inst, dev_context->audio_input_info,
+				INPUT_DIRECTION);
+	audio_evl_fill_chan_info(inst, dev_context->audio_output_info,
+				OUTPUT_DIRECTION);
 
-		audio_input_info->sw_ch_id = chan_num;
-		audio_input_info->hw_ch_id = chan_num;
-		audio_input_info->direction = INPUT_DIRECTION;
-		audio_input_info->sample_format = audio_format;
-		snprintf((char *)audio_input_info->channel_name,
-				AUDIO_CHANNEL_NAME_SIZE - 1,
-				"IN-%d",
-				chan_num);
-		audio_input_info->start_offset_in_words = chan_num;
-		audio_input_info->stride_in_words = num_codec_channels;
-	}
-
-	for (chan_num = 0; chan_num < audio_output_channels; chan_num++) {
-		struct audio_channel_info_data *audio_output_info =
-			&dev_context->audio_output_info[chan_num];
+	for (i = 0; i < inst->num_i2s_devs; i++) {
+		struct audio_evl_dev *i2s_dev = inst->i2s_devs[i];
 
-		audio_output_info->sw_ch_id = chan_num;
-		audio_output_info->hw_ch_id = chan_num;
-		audio_output_info->direction = OUTPUT_DIRECTION;
-		audio_output_info->sample_format = audio_format;
-		snprintf((char *)audio_output_info->channel_name,
-				AUDIO_CHANNEL_NAME_SIZE - 1,
-				"IN-%d",
-				chan_num);
-		audio_output_info->start_offset_in_words = chan_num;
-		audio_output_info->stride_in_words = num_codec_channels;
+		audio_evl_reset_dev(i2s_dev);
+		ret = bcm2835_i2s_buffers_setup(i2s_dev, audio_buffer_size,
+				inst->codec_channels, audio_packed_16bit);
+		if (ret) {
+			printk(KERN_ERR "audio_evl: buffers setup failed\n");
+			goto fail_buffers;
+		}
 	}
 
 	ret = evl_open_file(&dev_context->efile, filp);
@@ -257,51 +581,94 @@ static int audio_driver_open(struct inode *inode, struct file *filp)
 	filp->private_data = dev_context;
 	stream_open(inode, filp);
 
-	dev_context->i2s_dev = bcm2835_get_i2s_dev();
-	dev_context->i2s_dev->wait_flag = 0;
-	dev_context->i2s_dev->kinterrupts = 0;
-	dev_context->i2s_dev->buffer_idx = 0;
-	evl_init_flag(&dev_context->i2s_dev->event_flag);
-
-	bcm2835_i2s_buffers_setup(audio_buffer_size, audio_output_channels);
+	dev_context->inst = inst;
+	dev_context->i2s_dev = inst->i2s_devs[0];
+	mutex_lock(&audio_evl_bridge_lock);
+	if (audio_evl_bridge && try_module_get(audio_evl_bridge->owner)) {
+		refcount_inc(&audio_evl_bridge->users);
+		dev_context->bridge = audio_evl_bridge;
+	}
+	mutex_unlock(&audio_evl_bridge_lock);
+	mutex_lock(&audio_evl_mailbox_lock);
+	if (audio_evl_mailbox && try_module_get(audio_evl_mailbox->owner)) {
+		refcount_inc(&audio_evl_mailbox->users);
+		dev_context->mailbox = audio_evl_mailbox;
+	}
+	mutex_unlock(&audio_evl_mailbox_lock);
+	mutex_lock(&audio_evl_event_sink_lock);
+	if (audio_evl_event_sink &&
+	    try_module_get(audio_evl_event_sink->owner)) {
+		refcount_inc(&audio_evl_event_sink->users);
+		dev_context->event_sink = audio_evl_event_sink;
+	}
+	mutex_unlock(&audio_evl_event_sink_lock);
 
 	user_proc_completions = 0;
 	kernel_interrupts = 0;
 	session_under_runs = 0;
+	inst->dsp_load_avg = 0;
+	inst->dsp_load_peak = 0;
+	inst->dsp_load_max = 0;
+	inst->measured_latency_frames = 0;
 
 	printk(KERN_INFO "audio_evl: audio_driver_open\n");
 
 	return 0;
 
 fail_evl_open_file:
+	i = inst->num_i2s_devs - 1;
+fail_buffers:
+	/* The failing interface may have its DMA prepared as well */
+	for (; i >= 0; i--) {
+		bcm2835_i2s_exit(inst->i2s_devs[i]);
+		evl_destroy_flag(&inst->i2s_devs[i]->event_flag);
+	}
 	kfree(dev_context->audio_output_info);
 fail_out_ch:
 	kfree(dev_context->audio_input_info);
 fail_in_ch:
 	kfree(dev_context);
+	mutex_lock(&audio_evl_users_lock);
+	audio_evl_unclaim_devs(inst);
+	mutex_unlock(&audio_evl_users_lock);
 
 	return ret;
 }
 
 static int  audio_driver_release(struct inode *inode, struct file *filp)
 {
-	int i;
+	int i, j;
 	struct audio_dev_context *dev_context = filp->private_data;
-	struct audio_evl_buffers *i2s_buffer = dev_context->i2s_dev->buffer;
-	int *tx = i2s_buffer->tx_buf;
+	struct audio_evl_instance *inst = dev_context->inst;
+
+	for (j = 0; j < inst->num_i2s_devs; j++) {
+		struct audio_evl_dev *i2s_dev = inst->i2s_devs[j];
+		struct audio_evl_buffers *i2s_buffer = i2s_dev->buffer;
+		int *tx = i2s_buffer->tx_buf;
 
-	evl_destroy_flag(&dev_context->i2s_dev->event_flag);
-	if (dev_context->i2s_dev->wait_flag) {
-		for (i = 0; i < i2s_buffer->buffer_len/4; i++) {
-			tx[i] = 0;
+		/* Stops the DMA and the watchdog before the flag goes away */
+		bcm2835_i2s_exit(i2s_dev);
+		evl_destroy_flag(&i2s_dev->event_flag);
+		if (i2s_dev->wait_flag) {
+			for (i = 0; i < i2s_buffer->buffer_len/4; i++) {
+				tx[i] = 0;
+			}
+			i2s_dev->wait_flag = 0;
 		}
-		dev_context->i2s_dev->wait_flag = 0;
 	}
-	bcm2835_i2s_exit();
+	if (dev_context->bridge)
+		audio_evl_put_bridge(dev_context->bridge);
+	if (dev_context->mailbox)
+		audio_evl_put_mailbox(dev_context->mailbox);
+	if (dev_context->event_sink)
+		audio_evl_put_event_sink(dev_context->event_sink);
 
 	kfree(dev_context->audio_output_info);
 	kfree(dev_context->audio_input_info);
 	kfree(dev_context);
+	mutex_lock(&audio_evl_users_lock);
+	audio_evl_unclaim_devs(inst);
+	mutex_unlock(&audio_evl_users_lock);
 
 	printk(KERN_INFO "audio_evl: audio_driver_release\n");
 
@@ -311,13 +678,137 @@ static int  audio_driver_release(struct inode *inode, struct file *filp)
 static int audio_driver_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	struct audio_dev_context *dev_context = filp->private_data;
-	struct audio_evl_buffers *i2s_buffer = dev_context->i2s_dev->buffer;
+	struct audio_evl_instance *inst = dev_context->inst;
+	unsigned long start = vma->vm_start, end = vma->vm_end;
+	size_t size = RESERVED_BUFFER_SIZE_IN_PAGES * PAGE_SIZE;
+	int i, ret = 0;
+
+	if (vma->vm_pgoff || end - start > inst->num_i2s_devs * size)
+		return -EINVAL;
 	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
 
-	return dma_mmap_coherent(dev_context->i2s_dev->dma_rx->device->dev,
-		vma,
-		i2s_buffer->rx_buf, i2s_buffer->rx_phys_addr,
-		RESERVED_BUFFER_SIZE_IN_PAGES * PAGE_SIZE);
+	/* Map the reserved area of each interface one after the other */
+	for (i = 0; i < inst->num_i2s_devs && !ret; i++) {
+		struct audio_evl_dev *i2s_dev = inst->i2s_devs[i];
+
+		vma->vm_start = start + i * size;
+		vma->vm_end = min(end, vma->vm_start + size);
+		if (vma->vm_start >= end)
+			break;
+		ret = dma_mmap_coherent(i2s_dev->dma_rx->device->dev, vma,
+			i2s_dev->buffer->rx_buf, i2s_dev->buffer->rx_phys_addr,
+			size);
+	}
+	vma->vm_start = start;
+	vma->vm_end = end;
+
+	return ret;
+}
+
+/* Send what the client queued last period, publish what came back */
+static void audio_evl_exchange_mailbox(struct audio_evl_mailbox_transport *mailbox,
+				struct audio_evl_dev *dev)
+{
+	struct audio_mailbox *out = dev->buffer->mailbox_out;
+	struct audio_mailbox *in = dev->buffer->mailbox_in;
+	uint32_t len = min_t(uint32_t, READ_ONCE(out->size), AUDIO_MAILBOX_SIZE);
+	int ret;
+
+	ret = mailbox->exchange(mailbox, out->data, len, in->data);
+	if (ret < 0) {
+		/* Keep the out frame queued for the next period */
+		in->size = 0;
+	} else {
+		out->size = 0;
+		in->size = ret;
+	}
+	in->period_count = dev->kinterrupts;
+}
+
+static void audio_evl_update_dsp_load(struct audio_evl_instance *inst,
+				struct audio_evl_dev *dev, ktime_t period_ts)
+{
+	struct audio_status *status = dev->buffer->status;
+	uint64_t period_ns = div_u64((uint64_t)dev->period_frames *
+				NSEC_PER_SEC, dev->sampling_rate);
+	int64_t elapsed = ktime_to_ns(ktime_sub(
+				evl_read_clock(&evl_mono_clock), period_ts));
+	uint load;
+
+	if (elapsed < 0 || !period_ns)
+		return;
+	load = div64_u64((uint64_t)elapsed * 1000, period_ns);
+
+	inst->dsp_load_avg += load - (inst->dsp_load_avg >> 4);
+	if (load > inst->dsp_load_peak)
+		inst->dsp_load_peak = load;
+	/* Loses 1/256 of itself per period, halving in about 177 periods */
+	inst->dsp_load_max -= inst->dsp_load_max >> 8;
+	if ((load << 8) > inst->dsp_load_max)
+		inst->dsp_load_max = load << 8;
+
+	status->dsp_load = load;
+	status->dsp_load_avg = inst->dsp_load_avg >> 4;
+	status->dsp_load_peak = inst->dsp_load_peak;
+	status->dsp_load_max = inst->dsp_load_max >> 8;
+}
+
+/* Hand the output events the client queued with this period's buffer */
+static void audio_evl_dispatch_events(struct audio_evl_event_sink *sink,
+				struct audio_evl_dev *dev)
+{
+	struct audio_event_queue *queue = dev->buffer->events_out;
+	uint32_t num_events = min_t(uint32_t, READ_ONCE(queue->num_events),
+					AUDIO_MAX_EVENTS);
+
+	if (num_events)
+		sink->process(sink, queue->events, num_events, dev->period_ts,
+			div_u64((uint64_t)dev->period_frames * NSEC_PER_SEC,
+				dev->sampling_rate));
+	WRITE_ONCE(queue->num_events, 0);
+}
+
+/* Hand every interface its share of the routes, oob */
+static int audio_evl_set_monitor(struct audio_dev_context *dev_context)
+{
+	struct audio_evl_instance *inst = dev_context->inst;
+	struct audio_monitor_config *config = &dev_context->monitor_config;
+	struct audio_evl_monitor_route *routes = dev_context->monitor_routes;
+	uint dev_size = audio_evl_dev_offset(1);
+	uint in, out;
+	int i, idx, num_routes;
+
+	if (config->num_routes > AUDIO_MONITOR_MAX_ROUTES)
+		return -EINVAL;
+	for (i = 0; i < config->num_routes; i++) {
+		if (config->routes[i].input_channel >= inst->input_channels ||
+		    config->routes[i].output_channel >= inst->output_channels)
+			return -EINVAL;
+		in = dev_context->audio_input_info[
+			config->routes[i].input_channel].start_offset_in_words;
+		out = dev_context->audio_output_info[
+			config->routes[i].output_channel].start_offset_in_words;
+		if (in / dev_size != out / dev_size)
+			return -EINVAL;
+	}
+
+	for (idx = 0; idx < inst->num_i2s_devs; idx++) {
+		num_routes = 0;
+		for (i = 0; i < config->num_routes; i++) {
+			in = dev_context->audio_input_info[
+			config->routes[i].input_channel].start_offset_in_words;
+			out = dev_context->audio_output_info[
+			config->routes[i].output_channel].start_offset_in_words;
+			if (in / dev_size != idx)
+				continue;
+			routes[num_routes].in_slot = in - idx * dev_size;
+			routes[num_routes].out_slot = out - idx * dev_size;
+			routes[num_routes].gain = config->routes[i].gain;
+			num_routes++;
+		}
+		bcm2835_i2s_set_monitor(inst->i2s_devs[idx], routes, num_routes);
+	}
+	return 0;
 }
 
 static long audio_driver_oob_ioctl(struct file *filp, unsigned int cmd,
@@ -326,16 +817,36 @@ static long audio_driver_oob_ioctl(struct file *filp, unsigned int cmd,
 	int result = 0;
 	int under_runs;
 	int buffer_idx;
+	int i;
 	struct audio_dev_context *dev_context = filp->private_data;
+	struct audio_evl_instance *inst = dev_context->inst;
 	struct audio_evl_dev *dev = dev_context->i2s_dev;
+	struct audio_evl_flight_record *record;
+	ktime_t prof_start;
 
 	switch (cmd) {
 	case AUDIO_IRQ_WAIT:
-		result = evl_wait_flag(&dev->event_flag);
-		if (result != 0) {
-			printk(KERN_ERR "evl_event_wait failed\n");
-			return result;
+		/* Wake up once every interface has completed the period */
+		for (i = 0; i < inst->num_i2s_devs; i++) {
+			result = evl_wait_flag(&inst->i2s_devs[i]->event_flag);
+			if (result != 0) {
+				printk(KERN_ERR "evl_event_wait failed\n");
+				return result;
+			}
+		}
+		prof_start = audio_evl_prof_begin();
+		for (i = 0; i < inst->num_i2s_devs; i++) {
+			result = xchg(&inst->i2s_devs[i]->stream_error, 0);
+			if (result)
+				return result;
+		}
+		/* An interface out of phase with the first one can't be used */
+		for (i = 1; i < inst->num_i2s_devs; i++) {
+			if (inst->i2s_devs[i]->buffer_idx != dev->buffer_idx)
+				return -ESTRPIPE;
 		}
+		if (dev_context->mailbox)
+			audio_evl_exchange_mailbox(dev_context->mailbox, dev);
 		buffer_idx = dev->buffer_idx ? 0 : 1;
 		result = raw_copy_to_user((void __user *)arg, &buffer_idx,
 					  sizeof(buffer_idx));
@@ -344,13 +855,75 @@ static long audio_driver_oob_ioctl(struct file *filp, unsigned int cmd,
  		}
 		kernel_interrupts = dev->kinterrupts;
 		user_proc_completions = kernel_interrupts;
+		dev_context->period_ts = dev->period_ts;
+		record = bcm2835_i2s_flight_record(dev, dev->kinterrupts);
+		if (record)
+			record->wakeup_ns = ktime_to_ns(
+					evl_read_clock(&evl_mono_clock));
+		trace_audio_evl_irq_wait_return(kernel_interrupts, buffer_idx);
+		audio_evl_prof_end(&oob_ioctl, prof_start);
 		return result;
 	case AUDIO_USERPROC_FINISHED:
+		prof_start = audio_evl_prof_begin();
 		kernel_interrupts = dev->kinterrupts;
 		under_runs = kernel_interrupts - user_proc_completions;
 		if (under_runs) {
 			session_under_runs += under_runs;
 		}
+		record = bcm2835_i2s_flight_record(dev, user_proc_completions);
+		if (record) {
+			record->finish_ns = ktime_to_ns(
+					evl_read_clock(&evl_mono_clock));
+			if (under_runs) {
+				record->flags |= AUDIO_EVL_FLIGHT_XRUN;
+				bcm2835_i2s_flight_trigger(dev);
+			}
+		}
+		audio_evl_update_dsp_load(inst, dev, dev_context->period_ts);
+		/* With a short tx phase the output may already be playing */
+		if (!under_runs && dev->tx_phase_frames < dev->period_frames &&
+		    (uint64_t)dev->buffer->status->dsp_load *
+				dev->period_frames >
+				(uint64_t)dev->tx_phase_frames * 1000) {
+			session_under_runs++;
+			if (record)
+				record->flags |= AUDIO_EVL_FLIGHT_XRUN;
+			bcm2835_i2s_flight_trigger(dev);
+		}
+		trace_audio_evl_userproc_finished(kernel_interrupts,
+				dev->buffer_idx ? 0 : 1, under_runs);
+		/*
+		 * The client's output is in, add the monitor mix on top. A late
+		 * finish still gets it, in the half the client was handed,
+		 * which buffer_idx has moved away from by under_runs periods.
+		 */
+		for (i = 0; i < inst->num_i2s_devs; i++) {
+			struct audio_evl_dev *i2s_dev = inst->i2s_devs[i];
+
+			bcm2835_i2s_monitor_mix(i2s_dev,
+				(i2s_dev->buffer_idx ^ (under_runs & 1)) ? 0 : 1,
+				false);
+			i2s_dev->monitor_period = user_proc_completions;
+		}
+		if (dev_context->bridge && !audio_packed_16bit) {
+			size_t offset = (dev->buffer_idx ? 0 : 1) *
+						dev->buffer->period_len;
+
+			dev_context->bridge->process(dev_context->bridge,
+					dev->buffer->rx_buf + offset,
+					dev->buffer->tx_buf + offset,
+					dev->period_frames, inst->codec_channels);
+		}
+		if (dev_context->event_sink)
+			audio_evl_dispatch_events(dev_context->event_sink, dev);
+		audio_evl_prof_end(&oob_ioctl, prof_start);
+		break;
+	case AUDIO_SET_MONITOR:
+		if (raw_copy_from_user(&dev_context->monitor_config,
+				(void __user *)arg,
+				sizeof(dev_context->monitor_config)))
+			return -EFAULT;
+		result = audio_evl_set_monitor(dev_context);
 		break;
 	default:
 		printk(KERN_WARNING "audio_evl : audio_ioctl_rt: invalid value"
@@ -360,18 +933,157 @@ static long audio_driver_oob_ioctl(struct file *filp, unsigned int cmd,
 	return result;
 }
 
+/*
+ * Inject input events from userspace, e.g. MIDI from a non RT thread. They
+ * are stamped on arrival and delivered with the next period, frame_offset
+ * is ignored.
+ */
+static ssize_t audio_driver_oob_write(struct file *filp,
+				const char __user *u_buf, size_t count)
+{
+	struct audio_dev_context *dev_context = filp->private_data;
+	ktime_t now = evl_read_clock(&evl_mono_clock);
+	struct audio_event event;
+	size_t done;
+
+	if (count % sizeof(event))
+		return -EINVAL;
+
+	for (done = 0; done < count; done += sizeof(event)) {
+		if (raw_copy_from_user(&event, u_buf + done, sizeof(event)))
+			return -EFAULT;
+		if (event.size > AUDIO_EVENT_DATA_SIZE)
+			return -EINVAL;
+		if (bcm2835_i2s_post_event(dev_context->i2s_dev, &event, now))
+			break;
+	}
+
+	return done ? done : -ENOSPC;
+}
+
+static void audio_evl_get_latency(struct audio_evl_instance *inst,
+				struct audio_latency_info *info)
+{
+	struct audio_evl_dev *i2s_dev = inst->i2s_devs[0];
+	const struct audio_evl_hat *hat = i2s_dev->hat;
+	int round_trip = bcm2835_i2s_round_trip_frames(i2s_dev);
+
+	memset(info, 0, sizeof(*info));
+	if (hat) {
+		info->input_codec_frames = codec_low_latency ?
+			hat->input_delay_low_latency : hat->input_delay;
+		info->output_codec_frames = codec_low_latency ?
+			hat->output_delay_low_latency : hat->output_delay;
+	}
+	/* The first frame of a period waits the whole period for the client */
+	info->input_frames = info->input_codec_frames;
+	info->output_frames = info->output_codec_frames;
+	if (round_trip) {
+		info->input_frames += i2s_dev->period_frames;
+		info->output_frames += round_trip - i2s_dev->period_frames;
+	}
+	info->measured_frames = inst->measured_latency_frames;
+}
+
+/*
+ * Play an impulse on an output and time its return on an input, both on
+ * the same interface. The stream is set up again for the client after.
+ */
+static int audio_evl_calibrate_latency(struct audio_dev_context *dev_context,
+				struct audio_latency_calibration *req)
+{
+	struct audio_evl_instance *inst = dev_context->inst;
+	struct audio_channel_info_data *out, *in;
+	struct audio_evl_dev *i2s_dev;
+	int32_t impulse;
+	uint idx;
+	int ret;
+
+	if (dev_context->running)
+		return -EBUSY;
+	if (audio_packed_16bit)
+		return -EOPNOTSUPP;
+	if (req->output_channel >= inst->output_channels ||
+	    req->input_channel >= inst->input_channels)
+		return -EINVAL;
+	out = &dev_context->audio_output_info[req->output_channel];
+	in = &dev_context->audio_input_info[req->input_channel];
+	idx = out->start_offset_in_words / audio_evl_dev_offset(1);
+	if (in->start_offset_in_words / audio_evl_dev_offset(1) != idx)
+		return -EINVAL;
+	i2s_dev = inst->i2s_devs[idx];
+
+	/* Half of full scale, on the bits the format uses */
+	impulse = inst->format == INT24_RJ || inst->format == INT24_32RJ ?
+			0x400000 : 0x40000000;
+	ret = bcm2835_i2s_calibrate(i2s_dev,
+			out->start_offset_in_words - audio_evl_dev_offset(idx),
+			in->start_offset_in_words - audio_evl_dev_offset(idx),
+			impulse, req->threshold ? req->threshold : impulse / 8,
+			req->timeout_ms ? req->timeout_ms : 1000);
+
+	bcm2835_i2s_exit(i2s_dev);
+	evl_destroy_flag(&i2s_dev->event_flag);
+	audio_evl_reset_dev(i2s_dev);
+	if (bcm2835_i2s_buffers_setup(i2s_dev, audio_buffer_size,
+			inst->codec_channels, audio_packed_16bit))
+		printk(KERN_ERR "audio_evl: stream setup after calibration"
+			" failed\n");
+	if (ret < 0)
+		return ret;
+
+	req->latency_frames = ret;
+	inst->measured_latency_frames = ret;
+	return 0;
+}
+
 static long audio_driver_ioctl(struct file *filp, unsigned int cmd,
 			 unsigned long arg)
 {
+	struct audio_latency_calibration calibration;
+	struct audio_latency_info latency;
 	struct audio_dev_context *dev_context = filp->private_data;
+	struct audio_evl_instance *inst = dev_context->inst;
 	int result = 0;
 
 	switch(cmd) {
 	case AUDIO_PROC_START:
-		bcm2835_i2s_start_stop(dev_context->i2s_dev, BCM2835_I2S_START_CMD);
+		trace_audio_evl_proc_start(dev_context->i2s_dev->kinterrupts,
+					dev_context->i2s_dev->buffer_idx);
+		if (inst->num_i2s_devs > 1)
+			bcm2835_i2s_start_stop_group(inst->i2s_devs,
+				inst->num_i2s_devs, BCM2835_I2S_START_CMD);
+		else
+			result = bcm2835_i2s_start_stop(dev_context->i2s_dev,
+						BCM2835_I2S_START_CMD);
+		dev_context->running = !result;
 		break;
 	case AUDIO_PROC_STOP:
-		bcm2835_i2s_start_stop(dev_context->i2s_dev, BCM2835_I2S_STOP_CMD);
+		trace_audio_evl_proc_stop(dev_context->i2s_dev->kinterrupts,
+					dev_context->i2s_dev->buffer_idx);
+		if (inst->num_i2s_devs > 1)
+			bcm2835_i2s_start_stop_group(inst->i2s_devs,
+				inst->num_i2s_devs, BCM2835_I2S_STOP_CMD);
+		else
+			bcm2835_i2s_start_stop(dev_context->i2s_dev,
+						BCM2835_I2S_STOP_CMD);
+		dev_context->running = false;
+		break;
+	case AUDIO_CALIBRATE_LATENCY:
+		if (raw_copy_from_user(&calibration, (void *)arg,
+					sizeof(calibration)))
+			return -EFAULT;
+		result = audio_evl_calibrate_latency(dev_context, &calibration);
+		if (result)
+			return result;
+		if (raw_copy_to_user((void *)arg, &calibration,
+					sizeof(calibration)))
+			return -EFAULT;
+		break;
+	case AUDIO_GET_LATENCY:
+		audio_evl_get_latency(inst, &latency);
+		if (raw_copy_to_user((void *)arg, &latency, sizeof(latency)))
+			return -EFAULT;
 		break;
 	case AUDIO_GET_INPUT_CHAN_INFO:
 		if (dev_context->audio_input_info == NULL) {
@@ -379,7 +1091,7 @@ static long audio_driver_ioctl(struct file *filp, unsigned int cmd,
 		}
 		result = raw_copy_to_user((void *)arg, dev_context->audio_input_info,
 					sizeof(struct audio_channel_info_data) *
-					audio_input_channels);
+					inst->input_channels);
 		if (result < 0) {
 			printk(	KERN_INFO
 				"audio_evl: AUDIO_GET_INPUT_CHAN_INFO"
@@ -393,7 +1105,7 @@ static long audio_driver_ioctl(struct file *filp, unsigned int cmd,
 		}
 		result = raw_copy_to_user((void *)arg, dev_context->audio_output_info,
 					sizeof(struct audio_channel_info_data) *
-					audio_output_channels);
+					inst->output_channels);
 		if (result < 0) {
 			printk(	KERN_INFO
 				"audio_evl: AUDIO_GET_OUTPUT_CHAN_INFO"
@@ -417,87 +1129,801 @@ static const struct file_operations audio_driver_fops = {
 	.unlocked_ioctl	= audio_driver_ioctl,
 	.mmap		= audio_driver_mmap,
 	.oob_ioctl	= audio_driver_oob_ioctl,
+	.oob_write	= audio_driver_oob_write,
 };
 
+int audio_evl_register_bridge(struct audio_evl_bridge *bridge)
+{
+	int ret = 0;
+
+	mutex_lock(&audio_evl_bridge_lock);
+	if (audio_evl_bridge) {
+		ret = -EBUSY;
+	} else {
+		/* The registry holds one reference until unregistered */
+		refcount_set(&bridge->users, 1);
+		init_completion(&bridge->released);
+		audio_evl_bridge = bridge;
+	}
+	mutex_unlock(&audio_evl_bridge_lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(audio_evl_register_bridge);
+
+/*
+ * The bridge lives in the ALSA card, which an unbind frees with the module
+ * still loaded, so wait for the sessions calling process() to drop it.
+ */
+void audio_evl_unregister_bridge(struct audio_evl_bridge *bridge)
+{
+	bool registered;
+
+	mutex_lock(&audio_evl_bridge_lock);
+	registered = audio_evl_bridge == bridge;
+	if (registered)
+		audio_evl_bridge = NULL;
+	mutex_unlock(&audio_evl_bridge_lock);
+
+	if (registered && !refcount_dec_and_test(&bridge->users))
+		wait_for_completion(&bridge->released);
+}
+EXPORT_SYMBOL_GPL(audio_evl_unregister_bridge);
+
+int audio_evl_register_mailbox(struct audio_evl_mailbox_transport *transport)
+{
+	int ret = 0;
+
+	mutex_lock(&audio_evl_mailbox_lock);
+	if (audio_evl_mailbox) {
+		ret = -EBUSY;
+	} else {
+		/* The registry holds one reference until unregistered */
+		refcount_set(&transport->users, 1);
+		init_completion(&transport->released);
+		audio_evl_mailbox = transport;
+	}
+	mutex_unlock(&audio_evl_mailbox_lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(audio_evl_register_mailbox);
+
+/*
+ * The module reference alone does not cover a device unbind, which frees
+ * the transport with the module still loaded. So wait for the last
+ * session to put the transport before the caller can free it.
+ */
+void audio_evl_unregister_mailbox(struct audio_evl_mailbox_transport *transport)
+{
+	bool registered;
+
+	mutex_lock(&audio_evl_mailbox_lock);
+	registered = audio_evl_mailbox == transport;
+	if (registered)
+		audio_evl_mailbox = NULL;
+	mutex_unlock(&audio_evl_mailbox_lock);
+
+	if (registered && !refcount_dec_and_test(&transport->users))
+		wait_for_completion(&transport->released);
+}
+EXPORT_SYMBOL_GPL(audio_evl_unregister_mailbox);
+
+int audio_evl_register_event_sink(struct audio_evl_event_sink *sink)
+{
+	int ret = 0;
+
+	mutex_lock(&audio_evl_event_sink_lock);
+	if (audio_evl_event_sink) {
+		ret = -EBUSY;
+	} else {
+		/* The registry holds one reference until unregistered */
+		refcount_set(&sink->users, 1);
+		init_completion(&sink->released);
+		audio_evl_event_sink = sink;
+	}
+	mutex_unlock(&audio_evl_event_sink_lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(audio_evl_register_event_sink);
+
+/* As for the mailbox, wait for the sessions to drop the sink */
+void audio_evl_unregister_event_sink(struct audio_evl_event_sink *sink)
+{
+	bool registered;
+
+	mutex_lock(&audio_evl_event_sink_lock);
+	registered = audio_evl_event_sink == sink;
+	if (registered)
+		audio_evl_event_sink = NULL;
+	mutex_unlock(&audio_evl_event_sink_lock);
+
+	if (registered && !refcount_dec_and_test(&sink->users))
+		wait_for_completion(&sink->released);
+}
+EXPORT_SYMBOL_GPL(audio_evl_unregister_event_sink);
+
+int audio_evl_sampling_rate(void)
+{
+	return audio_evl_instances[0].sampling_rate;
+}
+EXPORT_SYMBOL_GPL(audio_evl_sampling_rate);
+
 static dev_t rt_audio_devt;
 static struct cdev rt_audio_cdev;
 
-static int __init audio_evl_driver_init(void)
+/* Per device attributes, the class wide ones describe the first device */
+static ssize_t hat_show(struct device *dev, struct device_attribute *attr,
+			char *buf)
 {
-	int ret;
-	struct device *dev;
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
 
-	ret = class_register(&audio_evl_class);
+	return sprintf(buf, "%s\n", inst->hat ? inst->hat->name : "aggregate");
+}
+
+static ssize_t input_channels_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", inst->input_channels);
+}
+
+static ssize_t output_channels_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", inst->output_channels);
+}
+
+static ssize_t sampling_rate_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", inst->sampling_rate);
+}
+
+static ssize_t mmap_size_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lu\n", inst->num_i2s_devs *
+			RESERVED_BUFFER_SIZE_IN_PAGES * PAGE_SIZE);
+}
+
+/* The buffer layout, of the first interface which also holds the status */
+static ssize_t tdm_config_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+	struct audio_evl_tdm_config *tdm = &inst->i2s_devs[0]->tdm;
+
+	return sprintf(buf, "slots=%u slot_width=%u frame_length=%u "
+			"rx_slot_mask=0x%x tx_slot_mask=0x%x\n",
+			tdm->slots, tdm->slot_width, tdm->frame_length,
+			tdm->rx_slot_mask, tdm->tx_slot_mask);
+}
+
+static ssize_t packed_16bit_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", audio_packed_16bit);
+}
+
+static ssize_t i2s_devs_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < inst->num_i2s_devs; i++)
+		len += sprintf(buf + len, "%si2s%d", i ? " " : "",
+				inst->i2s_devs[i]->id);
+	return len + sprintf(buf + len, "\n");
+}
+
+static ssize_t resyncs_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+	unsigned long resyncs = 0;
+	int i;
+
+	for (i = 0; i < inst->num_i2s_devs; i++)
+		resyncs += inst->i2s_devs[i]->resyncs;
+	return sprintf(buf, "%lu\n", resyncs);
+}
+
+static ssize_t tx_fifo_errors_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+	unsigned long errors = 0;
+	int i;
+
+	for (i = 0; i < inst->num_i2s_devs; i++)
+		errors += inst->i2s_devs[i]->tx_fifo_errors;
+	return sprintf(buf, "%lu\n", errors);
+}
+
+static ssize_t rx_fifo_errors_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+	unsigned long errors = 0;
+	int i;
+
+	for (i = 0; i < inst->num_i2s_devs; i++)
+		errors += inst->i2s_devs[i]->rx_fifo_errors;
+	return sprintf(buf, "%lu\n", errors);
+}
+
+static ssize_t fifo_recoveries_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+	unsigned long recoveries = 0;
+	int i;
+
+	for (i = 0; i < inst->num_i2s_devs; i++)
+		recoveries += inst->i2s_devs[i]->fifo_recoveries;
+	return sprintf(buf, "%lu\n", recoveries);
+}
+
+/* Extremes over the interfaces of the device, since the last open */
+static ssize_t period_interval_min_ns_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+	int64_t interval = S64_MAX;
+	int i;
+
+	for (i = 0; i < inst->num_i2s_devs; i++)
+		interval = min(interval,
+				inst->i2s_devs[i]->period_interval_min_ns);
+	return sprintf(buf, "%lld\n", interval);
+}
+
+static ssize_t period_interval_max_ns_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+	int64_t interval = 0;
+	int i;
+
+	for (i = 0; i < inst->num_i2s_devs; i++)
+		interval = max(interval,
+				inst->i2s_devs[i]->period_interval_max_ns);
+	return sprintf(buf, "%lld\n", interval);
+}
+
+static ssize_t round_trip_frames_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n",
+		bcm2835_i2s_round_trip_frames(inst->i2s_devs[0]));
+}
+
+static ssize_t input_latency_frames_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+	struct audio_latency_info latency;
+
+	audio_evl_get_latency(inst, &latency);
+	return sprintf(buf, "%u\n", latency.input_frames);
+}
+
+static ssize_t output_latency_frames_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+	struct audio_latency_info latency;
+
+	audio_evl_get_latency(inst, &latency);
+	return sprintf(buf, "%u\n", latency.output_frames);
+}
+
+static ssize_t measured_latency_frames_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", inst->measured_latency_frames);
+}
+
+static ssize_t watchdog_recoveries_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+	unsigned long recoveries = 0;
+	int i;
+
+	for (i = 0; i < inst->num_i2s_devs; i++)
+		recoveries += inst->i2s_devs[i]->watchdog_recoveries;
+	return sprintf(buf, "%lu\n", recoveries);
+}
+
+static ssize_t dsp_load_avg_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(inst->dsp_load_avg) >> 4);
+}
+
+static ssize_t dsp_load_peak_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(inst->dsp_load_peak));
+}
+
+/* Any write resets the peak */
+static ssize_t dsp_load_peak_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+
+	WRITE_ONCE(inst->dsp_load_peak, 0);
+	return size;
+}
+
+static ssize_t dsp_load_max_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(inst->dsp_load_max) >> 8);
+}
+
+static DEVICE_ATTR_RO(hat);
+static DEVICE_ATTR_RO(input_channels);
+static DEVICE_ATTR_RO(output_channels);
+static DEVICE_ATTR_RO(sampling_rate);
+static DEVICE_ATTR_RO(mmap_size);
+static DEVICE_ATTR_RO(tdm_config);
+static DEVICE_ATTR_RO(packed_16bit);
+static DEVICE_ATTR_RO(i2s_devs);
+static DEVICE_ATTR_RO(resyncs);
+static DEVICE_ATTR_RO(watchdog_recoveries);
+static DEVICE_ATTR_RO(tx_fifo_errors);
+static DEVICE_ATTR_RO(rx_fifo_errors);
+static DEVICE_ATTR_RO(fifo_recoveries);
+static DEVICE_ATTR_RO(period_interval_min_ns);
+static DEVICE_ATTR_RO(period_interval_max_ns);
+static DEVICE_ATTR_RO(round_trip_frames);
+static DEVICE_ATTR_RO(measured_latency_frames);
+static DEVICE_ATTR_RO(input_latency_frames);
+static DEVICE_ATTR_RO(output_latency_frames);
+static DEVICE_ATTR_RO(dsp_load_avg);
+static DEVICE_ATTR_RW(dsp_load_peak);
+static DEVICE_ATTR_RO(dsp_load_max);
+
+static struct attribute *audio_evl_dev_attrs[] = {
+	&dev_attr_hat.attr,
+	&dev_attr_input_channels.attr,
+	&dev_attr_output_channels.attr,
+	&dev_attr_sampling_rate.attr,
+	&dev_attr_mmap_size.attr,
+	&dev_attr_tdm_config.attr,
+	&dev_attr_packed_16bit.attr,
+	&dev_attr_i2s_devs.attr,
+	&dev_attr_resyncs.attr,
+	&dev_attr_watchdog_recoveries.attr,
+	&dev_attr_tx_fifo_errors.attr,
+	&dev_attr_rx_fifo_errors.attr,
+	&dev_attr_fifo_recoveries.attr,
+	&dev_attr_period_interval_min_ns.attr,
+	&dev_attr_period_interval_max_ns.attr,
+	&dev_attr_round_trip_frames.attr,
+	&dev_attr_measured_latency_frames.attr,
+	&dev_attr_input_latency_frames.attr,
+	&dev_attr_output_latency_frames.attr,
+	&dev_attr_dsp_load_avg.attr,
+	&dev_attr_dsp_load_peak.attr,
+	&dev_attr_dsp_load_max.attr,
+	NULL,
+};
+
+static const struct attribute_group audio_evl_dev_group = {
+	.attrs = audio_evl_dev_attrs,
+};
+
+/*
+ * Run the stream for audio_self_test_ms with silent outputs and check the
+ * periods arrive at the expected rate, without FIFO errors or channel slip.
+ */
+static int audio_evl_run_self_test(struct audio_evl_instance *inst)
+{
+	struct audio_evl_self_test *st = &inst->self_test;
+	struct audio_evl_dev *first = inst->i2s_devs[0];
+	unsigned long recoveries = 0;
+	bool slip_check = false;
+	ktime_t start, elapsed;
+	int i, ret = 0;
+
+	/* The claim keeps sessions out, the lock is not held while streaming */
+	mutex_lock(&audio_evl_users_lock);
+	ret = audio_evl_claim_devs(inst);
+	mutex_unlock(&audio_evl_users_lock);
 	if (ret)
 		return ret;
 
-	if (!strcmp(audio_hat, "hifi-berry")) {
-		printk(KERN_INFO "audio_evl: hifi-berry hat\n");
-		if (pcm5122_codec_init(HIFI_BERRY_DAC_MODE,
-				HIFI_BERRY_SAMPLING_RATE,
-				audio_enable_low_latency)) {
-			printk(KERN_ERR "audio_evl: codec init failed\n");
-			return -1;
-		}
-		audio_input_channels = HIFI_BERRY_NUM_INPUT_CHANNELS;
-		audio_output_channels = HIFI_BERRY_NUM_OUTPUT_CHANNELS;
-		num_codec_channels = HIFI_BERRY_NUM_CODEC_CHANNELS;
-		audio_format = HIFI_BERRY_CODEC_FORMAT;
-		audio_sampling_rate = HIFI_BERRY_SAMPLING_RATE;
-	} else if (!strcmp(audio_hat, "hifi-berry-pro")) {
-		printk(KERN_INFO "audio_evl: hifi-berry-pro hat\n");
-		if (pcm1863_codec_init(audio_enable_low_latency)) {
-			printk(KERN_ERR "audio_evl: pcm3168 codec failed\n");
-			return -1;
-		}
-		if (pcm5122_codec_init(HIFI_BERRY_PRO_DAC_MODE,
-					HIFI_BERRY_PRO_SAMPLING_RATE,
-					audio_enable_low_latency)) {
-			printk(KERN_ERR "audio_evl: pcm5122 codec failed\n");
-			return -1;
-		}
-		audio_input_channels = HIFI_BERRY_PRO_NUM_INPUT_CHANNELS;
-		audio_output_channels = HIFI_BERRY_PRO_NUM_OUTPUT_CHANNELS;
-		num_codec_channels = HIFI_BERRY_PRO_NUM_CODEC_CHANNELS;
-		audio_format = HIFI_BERRY_PRO_CODEC_FORMAT;
-		audio_sampling_rate = HIFI_BERRY_PRO_SAMPLING_RATE;
-	} else if (!strcmp(audio_hat, "elk-pi")) {
-		printk(KERN_INFO "audio_evl: elk-pi hat\n");
-		if (pcm3168a_codec_init()) {
-			printk(KERN_ERR "audio_evl: codec init failed\n");
-			return -1;
+	st->run = true;
+	st->pass = false;
+	st->start_error = 0;
+	start = ktime_get();
+	for (i = 0; i < inst->num_i2s_devs; i++) {
+		struct audio_evl_dev *i2s_dev = inst->i2s_devs[i];
+
+		audio_evl_reset_dev(i2s_dev);
+		ret = bcm2835_i2s_buffers_setup(i2s_dev, audio_buffer_size,
+				inst->codec_channels, audio_packed_16bit);
+		if (ret)
+			goto out;
+		memset(i2s_dev->buffer->tx_buf, 0, i2s_dev->buffer->buffer_len);
+	}
+	st->stream_setup_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	if (inst->num_i2s_devs > 1)
+		bcm2835_i2s_start_stop_group(inst->i2s_devs,
+				inst->num_i2s_devs, BCM2835_I2S_START_CMD);
+	else
+		st->start_error = bcm2835_i2s_start_stop(first,
+						BCM2835_I2S_START_CMD);
+	if (!st->start_error)
+		msleep(audio_self_test_ms);
+	else
+		printk(KERN_ERR "audio_evl: %s self-test stream did not "
+			"start\n", inst->name);
+	if (inst->num_i2s_devs > 1)
+		bcm2835_i2s_start_stop_group(inst->i2s_devs,
+				inst->num_i2s_devs, BCM2835_I2S_STOP_CMD);
+	else
+		bcm2835_i2s_start_stop(first, BCM2835_I2S_STOP_CMD);
+	elapsed = ktime_sub(ktime_get(), start);
+
+	st->periods = first->kinterrupts;
+	st->expected_periods = first->period_ns ?
+		div64_u64(ktime_to_ns(elapsed), first->period_ns) : 0;
+	st->period_interval_min_ns = S64_MAX;
+	st->period_interval_max_ns = 0;
+	st->fifo_errors = 0;
+	st->alignment = AUDIO_EVL_ALIGNMENT_NOT_CHECKED;
+	for (i = 0; i < inst->num_i2s_devs; i++) {
+		struct audio_evl_dev *i2s_dev = inst->i2s_devs[i];
+
+		st->period_interval_min_ns = min(st->period_interval_min_ns,
+					i2s_dev->period_interval_min_ns);
+		st->period_interval_max_ns = max(st->period_interval_max_ns,
+					i2s_dev->period_interval_max_ns);
+		st->fifo_errors += i2s_dev->tx_fifo_errors +
+					i2s_dev->rx_fifo_errors;
+		recoveries += i2s_dev->watchdog_recoveries;
+		if (i2s_dev->frame_slip_check) {
+			slip_check = true;
+			if (i2s_dev->resyncs || i2s_dev->slip_periods)
+				st->alignment = AUDIO_EVL_ALIGNMENT_SLIPPED;
 		}
-		audio_input_channels = ELK_PI_NUM_INPUT_CHANNELS;
-		audio_output_channels = ELK_PI_NUM_OUTPUT_CHANNELS;
-		num_codec_channels = ELK_PI_NUM_CODEC_CHANNELS;
-		audio_format = ELK_PI_CODEC_FORMAT;
-		audio_sampling_rate = ELK_PI_SAMPLING_RATE;
-	} else {
-		printk(KERN_ERR "audio_evl: Unsupported hat\n");
 	}
+	if (slip_check && st->alignment != AUDIO_EVL_ALIGNMENT_SLIPPED)
+		st->alignment = AUDIO_EVL_ALIGNMENT_OK;
+
+	/* Within 10% of the expected count, no period late by half a period */
+	st->pass = !st->start_error &&
+		st->periods * 10 >= st->expected_periods * 9 &&
+		st->periods * 10 <= st->expected_periods * 11 + 10 &&
+		st->period_interval_max_ns * 2 <= first->period_ns * 3 &&
+		!st->fifo_errors && !recoveries &&
+		st->alignment != AUDIO_EVL_ALIGNMENT_SLIPPED;
+
+out:
+	for (i = 0; i < inst->num_i2s_devs; i++) {
+		bcm2835_i2s_exit(inst->i2s_devs[i]);
+		evl_destroy_flag(&inst->i2s_devs[i]->event_flag);
+	}
+	mutex_lock(&audio_evl_users_lock);
+	audio_evl_unclaim_devs(inst);
+	mutex_unlock(&audio_evl_users_lock);
+	return ret;
+}
+
+static ssize_t run_store(struct device *dev, struct device_attribute *attr,
+			const char *buf, size_t size)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+	int ret;
+
+	ret = audio_evl_run_self_test(inst);
+	return ret ? ret : size;
+}
+
+static ssize_t result_show(struct device *dev, struct device_attribute *attr,
+			char *buf)
+{
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+
+	if (!inst->self_test.run)
+		return sprintf(buf, "not run\n");
+	return sprintf(buf, "%s\n", inst->self_test.pass ? "pass" : "fail");
+}
+
+static ssize_t frame_alignment_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	static const char * const names[] = {
+		[AUDIO_EVL_ALIGNMENT_NOT_CHECKED] = "not checked",
+		[AUDIO_EVL_ALIGNMENT_OK] = "ok",
+		[AUDIO_EVL_ALIGNMENT_SLIPPED] = "slipped",
+	};
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n", names[inst->self_test.alignment]);
+}
+
+#define AUDIO_EVL_SELF_TEST_ATTR(_name, _fmt, _value)			\
+static ssize_t _name##_show(struct device *dev,				\
+			struct device_attribute *attr, char *buf)	\
+{									\
+	struct audio_evl_instance *inst = dev_get_drvdata(dev);		\
+	struct audio_evl_self_test *st = &inst->self_test;		\
+									\
+	return sprintf(buf, _fmt "\n", _value);				\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+AUDIO_EVL_SELF_TEST_ATTR(codec_init_us, "%llu",
+			div_u64(st->codec_init_ns, NSEC_PER_USEC));
+AUDIO_EVL_SELF_TEST_ATTR(i2s_init_us, "%llu",
+			div_u64(st->i2s_init_ns, NSEC_PER_USEC));
+AUDIO_EVL_SELF_TEST_ATTR(stream_setup_us, "%llu",
+			div_u64(st->stream_setup_ns, NSEC_PER_USEC));
+AUDIO_EVL_SELF_TEST_ATTR(periods, "%llu", st->periods);
+AUDIO_EVL_SELF_TEST_ATTR(expected_periods, "%llu", st->expected_periods);
+AUDIO_EVL_SELF_TEST_ATTR(period_interval_min_ns, "%lld",
+			st->run ? st->period_interval_min_ns : 0);
+AUDIO_EVL_SELF_TEST_ATTR(period_interval_max_ns, "%lld",
+			st->period_interval_max_ns);
+AUDIO_EVL_SELF_TEST_ATTR(fifo_errors, "%lu", st->fifo_errors);
+AUDIO_EVL_SELF_TEST_ATTR(start_error, "%d", st->start_error);
+static DEVICE_ATTR_WO(run);
+static DEVICE_ATTR_RO(result);
+static DEVICE_ATTR_RO(frame_alignment);
+
+static struct attribute *audio_evl_self_test_attrs[] = {
+	&dev_attr_run.attr,
+	&dev_attr_result.attr,
+	&dev_attr_codec_init_us.attr,
+	&dev_attr_i2s_init_us.attr,
+	&dev_attr_stream_setup_us.attr,
+	&dev_attr_periods.attr,
+	&dev_attr_expected_periods.attr,
+	&dev_attr_period_interval_min_ns.attr,
+	&dev_attr_period_interval_max_ns.attr,
+	&dev_attr_fifo_errors.attr,
+	&dev_attr_frame_alignment.attr,
+	&dev_attr_start_error.attr,
+	NULL,
+};
+
+static const struct attribute_group audio_evl_self_test_group = {
+	.name = "self_test",
+	.attrs = audio_evl_self_test_attrs,
+};
+
+static const struct attribute_group *audio_evl_dev_groups[] = {
+	&audio_evl_dev_group,
+	&audio_evl_self_test_group,
+	NULL,
+};
+
+/*
+ * Build the tdm frame from the hat defaults and the module params, the
+ * channel counts are then derived from the active slots.
+ */
+static int audio_evl_setup_tdm(struct audio_evl_instance *inst)
+{
+	struct audio_evl_tdm_config tdm = inst->hat->tdm;
+	int max_buffer_size = supported_buffer_sizes[
+				ARRAY_SIZE(supported_buffer_sizes) - 1];
+	int ret;
+
+	if (audio_tdm_slots > AUDIO_EVL_MAX_TDM_SLOTS)
+		return -EINVAL;
+	if (audio_tdm_slots && audio_tdm_slots != tdm.slots) {
+		tdm.slots = audio_tdm_slots;
+		tdm.rx_slot_mask = GENMASK(tdm.slots - 1, 0);
+		tdm.tx_slot_mask = GENMASK(tdm.slots - 1, 0);
+	}
+	if (audio_tdm_slot_width)
+		tdm.slot_width = audio_tdm_slot_width;
+	if (audio_rx_slot_mask)
+		tdm.rx_slot_mask = audio_rx_slot_mask;
+	if (audio_tx_slot_mask)
+		tdm.tx_slot_mask = audio_tx_slot_mask;
 
-	if (bcm2835_i2s_init(audio_hat)) {
+	/* Both directions, double buffered, plus the control area */
+	if (4 * max_buffer_size * tdm.slots * sizeof(uint32_t) +
+		AUDIO_CONTROL_AREA_SIZE > RESERVED_BUFFER_SIZE_IN_PAGES * PAGE_SIZE)
+		return -EINVAL;
+
+	ret = bcm2835_i2s_set_tdm(inst->i2s_devs[0], &tdm);
+	if (ret)
+		return ret;
+
+	inst->codec_channels = tdm.slots;
+	inst->input_channels = hweight32(tdm.rx_slot_mask);
+	inst->output_channels = hweight32(tdm.tx_slot_mask);
+	return 0;
+}
+
+static int audio_evl_instance_init(struct audio_evl_instance *inst, int id)
+{
+	int ret;
+	ktime_t start;
+
+	inst->i2s_devs[0] = bcm2835_get_i2s_dev(id);
+	if (!inst->i2s_devs[0]) {
+		printk(KERN_ERR "audio_evl: no i2s%d interface\n", id);
+		return -ENODEV;
+	}
+	inst->num_i2s_devs = 1;
+	inst->hat = audio_evl_get_hat(audio_hat[id]);
+	if (!inst->hat) {
+		printk(KERN_ERR "audio_evl: Unsupported hat %s\n", audio_hat[id]);
+		return -ENODEV;
+	}
+	printk(KERN_INFO "audio_evl: %s hat\n", inst->hat->name);
+
+	trace_audio_evl_init_step_begin("codec_init", 0);
+	start = ktime_get();
+	codec_low_latency = audio_enable_low_latency;
+	ret = inst->hat->ops->codec_init(inst->hat, codec_low_latency);
+	inst->self_test.codec_init_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	trace_audio_evl_init_step_end("codec_init", ret);
+	if (ret) {
+		printk(KERN_ERR "audio_evl: codec init failed\n");
+		goto fail_codec;
+	}
+	inst->format = inst->hat->format;
+	inst->sampling_rate = inst->hat->sampling_rate;
+
+	trace_audio_evl_init_step_begin("i2s_init", 0);
+	start = ktime_get();
+	ret = bcm2835_i2s_init(inst->i2s_devs[0], inst->hat);
+	inst->self_test.i2s_init_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	trace_audio_evl_init_step_end("i2s_init", ret);
+	if (ret) {
 		printk(KERN_ERR "audio_evl: i2s init failed\n");
-		return -1;
+		goto fail_i2s;
 	}
 
-	ret = alloc_chrdev_region(&rt_audio_devt, 0, 1, "audio_evl");
+	ret = audio_evl_setup_tdm(inst);
+	if (ret) {
+		printk(KERN_ERR "audio_evl: invalid tdm configuration\n");
+		goto fail_i2s;
+	}
+	return 0;
+
+fail_i2s:
+	inst->hat->ops->codec_exit(inst->hat);
+fail_codec:
+	audio_evl_put_hat(inst->hat);
+	inst->hat = NULL;
+	return ret;
+}
+
+static void audio_evl_instance_exit(struct audio_evl_instance *inst)
+{
+	if (!inst->hat)
+		return;
+	inst->hat->ops->codec_exit(inst->hat);
+	audio_evl_put_hat(inst->hat);
+}
+
+/*
+ * All the interfaces must share the bit clock and frame sync, the
+ * aggregate then runs them as one stream with the channels concatenated.
+ */
+static int audio_evl_aggregate_init(struct audio_evl_instance *aggr,
+				int num_instances)
+{
+	int i;
+
+	for (i = 0; i < num_instances; i++) {
+		struct audio_evl_instance *inst = &audio_evl_instances[i];
+
+		if (inst->codec_channels != audio_evl_instances[0].codec_channels ||
+		    inst->format != audio_evl_instances[0].format ||
+		    inst->sampling_rate != audio_evl_instances[0].sampling_rate) {
+			printk(KERN_ERR "audio_evl: can't aggregate %s, "
+				"its frame differs from %s\n",
+				inst->name, audio_evl_instances[0].name);
+			return -EINVAL;
+		}
+		aggr->i2s_devs[i] = inst->i2s_devs[0];
+		aggr->input_channels += inst->input_channels;
+		aggr->output_channels += inst->output_channels;
+	}
+	aggr->name = "audio_evl_all";
+	aggr->num_i2s_devs = num_instances;
+	aggr->codec_channels = audio_evl_instances[0].codec_channels;
+	aggr->format = audio_evl_instances[0].format;
+	aggr->sampling_rate = audio_evl_instances[0].sampling_rate;
+	return 0;
+}
+
+static const char *audio_evl_instance_names[AUDIO_EVL_MAX_DEVS] = {
+	"audio_evl", "audio_evl1", "audio_evl2", "audio_evl3",
+};
+
+static int __init audio_evl_driver_init(void)
+{
+	int ret, i, num_devs;
+	struct device *dev;
+
+	ret = class_register(&audio_evl_class);
+	if (ret)
+		return ret;
+
+	num_devs = min(num_audio_hats, bcm2835_i2s_num_devs());
+	if (!num_devs) {
+		printk(KERN_ERR "audio_evl: no i2s interface\n");
+		ret = -ENODEV;
+		goto fail_instances;
+	}
+	for (i = 0; i < num_devs; i++) {
+		audio_evl_instances[i].name = audio_evl_instance_names[i];
+		ret = audio_evl_instance_init(&audio_evl_instances[i], i);
+		if (ret)
+			goto fail_instances;
+		num_audio_evl_instances++;
+	}
+	if (audio_aggregate && num_devs > 1) {
+		ret = audio_evl_aggregate_init(
+			&audio_evl_instances[num_devs], num_devs);
+		if (ret)
+			goto fail_instances;
+		num_audio_evl_instances++;
+	}
+
+	ret = alloc_chrdev_region(&rt_audio_devt, 0, num_audio_evl_instances,
+				"audio_evl");
 	if (ret) {
 		printk(KERN_ERR "audio_evl:alloc_chrdev_region failed\n");
-		goto fail_region;
+		goto fail_instances;
 	}
 
 	cdev_init(&rt_audio_cdev, &audio_driver_fops);
-	ret = cdev_add(&rt_audio_cdev, rt_audio_devt, 1);
+	ret = cdev_add(&rt_audio_cdev, rt_audio_devt, num_audio_evl_instances);
  	if (ret) {
 		goto fail_add;
 	}
-	dev = device_create(&audio_evl_class, NULL, rt_audio_devt,
-				NULL, "audio_evl");
-	if (IS_ERR(dev)) {
-		ret = PTR_ERR(dev);
-		goto fail_dev;
- 	}
+	for (i = 0; i < num_audio_evl_instances; i++) {
+		dev = device_create_with_groups(&audio_evl_class, NULL,
+				MKDEV(MAJOR(rt_audio_devt), i),
+				&audio_evl_instances[i], audio_evl_dev_groups,
+				"%s", audio_evl_instances[i].name);
+		if (IS_ERR(dev)) {
+			ret = PTR_ERR(dev);
+			goto fail_dev;
+		}
+	}
+	audio_evl_prof_add(&oob_ioctl);
+	for (i = 0; audio_self_test && i < num_audio_evl_instances; i++) {
+		ret = audio_evl_run_self_test(&audio_evl_instances[i]);
+		printk(KERN_INFO "audio_evl: %s self-test %s\n",
+			audio_evl_instances[i].name,
+			ret ? "not run" : audio_evl_instances[i].self_test.pass ?
+			"passed" : "failed");
+	}
 	printk(KERN_INFO "audio_evl: buffer size = %d\n", audio_buffer_size);
 	printk(KERN_INFO "audio_evl: v%d.%d.%d - driver initialized\n",
 	       AUDIO_EVL_VERSION_MAJ, AUDIO_EVL_VERSION_MIN,
@@ -505,10 +1931,14 @@ static int __init audio_evl_driver_init(void)
 	return 0;
 
 fail_dev:
+	while (--i >= 0)
+		device_destroy(&audio_evl_class, MKDEV(MAJOR(rt_audio_devt), i));
 	cdev_del(&rt_audio_cdev);
 fail_add:
-	unregister_chrdev_region(rt_audio_devt, 1);
-fail_region:
+	unregister_chrdev_region(rt_audio_devt, num_audio_evl_instances);
+fail_instances:
+	for (i = 0; i < num_devs && i < num_audio_evl_instances; i++)
+		audio_evl_instance_exit(&audio_evl_instances[i]);
 	class_unregister(&audio_evl_class);
 
 	return ret;
@@ -516,14 +1946,16 @@ fail_region:
 
 static void __exit audio_evl_driver_exit(void)
 {
+	int i;
+
 	printk(KERN_INFO "audio_evl: driver exiting...\n");
-	if (!strcmp(audio_hat, "hifi-berry")) {
-		pcm5122_codec_exit();
-	} else if (!strcmp(audio_hat, "elk-pi")) {
-		pcm3168a_codec_exit();
+	audio_evl_prof_remove(&oob_ioctl);
+	for (i = 0; i < num_audio_evl_instances; i++) {
+		device_destroy(&audio_evl_class, MKDEV(MAJOR(rt_audio_devt), i));
+		audio_evl_instance_exit(&audio_evl_instances[i]);
 	}
-	device_destroy(&audio_evl_class, MKDEV(MAJOR(rt_audio_devt), 0));
 	cdev_del(&rt_audio_cdev);
+	unregister_chrdev_region(rt_audio_devt, num_audio_evl_instances);
 	class_unregister(&audio_evl_class);
 }
 
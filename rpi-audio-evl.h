@@ -6,9 +6,17 @@
 #ifndef AUDIO_EVL_H
 #define AUDIO_EVL_H
 
-#include <linux/io.h>
 #include <linux/ioctl.h>
+/* The ioctls and the control area layout are also used by clients */
+#ifdef __KERNEL__
+#include <linux/io.h>
+#include <linux/mutex.h>
 #include <evl/flag.h>
+#include <evl/work.h>
+#include <evl/timer.h>
+#else
+#include <stdint.h>
+#endif
 
 #define EVL_SUBCLASS_GPIO	0
 #define DEVICE_NAME		"audio_evl"
@@ -19,7 +27,12 @@
 
 #define AUDIO_IOC_MAGIC		'r'
 
-/* ioctl request to wait on dma callback */
+/*
+ * ioctl request to wait on dma callback, fails once with -ESTRPIPE after
+ * the driver had to re-align the stream, with -EIO when re-aligning it
+ * failed and the stream is stopped, and with -ETIMEDOUT when the DMA
+ * callbacks stopped and the stream is being restarted.
+ */
 #define AUDIO_IRQ_WAIT			_IOR(AUDIO_IOC_MAGIC, 1, int)
 /* This ioctl not used anymore but kept for backwards compatibility */
 #define AUDIO_IMMEDIATE_SEND		_IOW(AUDIO_IOC_MAGIC, 2, int)
@@ -33,6 +46,12 @@
 #define AUDIO_GET_INPUT_CHAN_INFO		_IOWR(AUDIO_IOC_MAGIC, 11, struct audio_channel_info_data)
 /* ioctl for getting audio channel information */
 #define AUDIO_GET_OUTPUT_CHAN_INFO		_IOWR(AUDIO_IOC_MAGIC, 12, struct audio_channel_info_data)
+/* ioctl measuring the round-trip latency through an output looped to an input */
+#define AUDIO_CALIBRATE_LATENCY		_IOWR(AUDIO_IOC_MAGIC, 13, struct audio_latency_calibration)
+/* ioctl for getting the input and output latency of the stream */
+#define AUDIO_GET_LATENCY		_IOR(AUDIO_IOC_MAGIC, 14, struct audio_latency_info)
+/* oob ioctl setting the direct monitoring routes */
+#define AUDIO_SET_MONITOR		_IOW(AUDIO_IOC_MAGIC, 15, struct audio_monitor_config)
 
 enum audio_channel_direction {
 	INPUT_DIRECTION = 0,
@@ -46,6 +65,7 @@ enum codec_sample_format {
 	INT24_32RJ,
 	INT32,
 	BINARY,
+	INT16_PACKED,
 };
 
 struct audio_channel_info_req {
@@ -55,6 +75,10 @@ struct audio_channel_info_req {
 };
 
 #define AUDIO_CHANNEL_NAME_SIZE 32
+/*
+ * Offsets and strides are in samples, i.e. 16 bit words for INT16_PACKED
+ * and 32 bit words for all the other formats.
+ */
 struct audio_channel_info_data {
 	uint8_t sw_ch_id;
 	uint8_t hw_ch_id;
@@ -66,6 +90,173 @@ struct audio_channel_info_data {
 };
 #define AUDIO_CHANNEL_NOT_VALID 255
 
+/*
+ * An impulse is played on output_channel and looked for on input_channel,
+ * which have to be joined, e.g. by a cable. Only while the stream is
+ * stopped. threshold is in sample units, 0 = an eighth of the impulse,
+ * timeout_ms 0 = 1 s. latency_frames is set to the measured input to
+ * output latency, which is kept until the device is closed.
+ */
+struct audio_latency_calibration {
+	uint32_t output_channel;
+	uint32_t input_channel;
+	uint32_t threshold;
+	uint32_t timeout_ms;
+	int32_t latency_frames;
+	uint32_t reserved;
+};
+
+/*
+ * Latency in frames of the stream set up last. Input is from the analog
+ * input to the end of the period handed to the client, output from there
+ * to the analog output, so their sum is the round-trip. The codec parts
+ * are the filters' group delays, included in the totals. measured_frames
+ * is the last AUDIO_CALIBRATE_LATENCY result, 0 = not measured.
+ */
+struct audio_latency_info {
+	uint32_t input_frames;
+	uint32_t output_frames;
+	uint32_t input_codec_frames;
+	uint32_t output_codec_frames;
+	int32_t measured_frames;
+	uint32_t reserved;
+};
+
+/*
+ * Direct monitoring, input_channel is added to output_channel by the
+ * driver every period with gain in Q15, 32768 = unity, negative values
+ * invert. The mix is done in AUDIO_USERPROC_FINISHED, on top of the
+ * client's output, or by the DMA callback alone for periods the client
+ * missed. So the routes only play while a session's stream runs, and
+ * stop with AUDIO_PROC_STOP or when the device is closed. Both channels
+ * of a route have to be on the same interface. num_routes = 0 turns
+ * monitoring off.
+ */
+#define AUDIO_MONITOR_MAX_ROUTES		32
+
+struct audio_monitor_route {
+	uint32_t input_channel;
+	uint32_t output_channel;
+	int32_t gain;
+};
+
+struct audio_monitor_config {
+	uint32_t num_routes;
+	uint32_t reserved;
+	struct audio_monitor_route routes[AUDIO_MONITOR_MAX_ROUTES];
+};
+
+/*
+ * Layout of the control area which follows the tx buffers in the mmap,
+ * offsets are in bytes from the end of the tx buffers.
+ */
+#define AUDIO_CV_GATE_OUT_OFFSET		0x00
+#define AUDIO_CV_GATE_IN_OFFSET			0x04
+#define AUDIO_CV_GATE_OUT_EVENTS_OFFSET		0x40
+#define AUDIO_CV_GATE_IN_EVENTS_OFFSET		0x100
+#define AUDIO_STATUS_OFFSET			0x200
+#define AUDIO_MAILBOX_OUT_OFFSET		0x400
+#define AUDIO_MAILBOX_IN_OFFSET			0x600
+#define AUDIO_EVENTS_OUT_OFFSET			0x800
+#define AUDIO_EVENTS_IN_OFFSET			0xc00
+#define AUDIO_CONTROL_AREA_SIZE			0x1000
+
+#define AUDIO_MAX_CV_GATE_EVENTS		16
+
+/*
+ * Gate output change at frame_offset of the period in which the current
+ * output buffer is played, mask holds the new state of all gate outputs.
+ * For gate inputs, an edge detected at frame_offset of the period which
+ * was just captured, mask holds the state of all gate inputs after it.
+ */
+struct audio_cv_gate_event {
+	uint32_t frame_offset;
+	uint32_t mask;
+};
+
+/*
+ * Output events are filled by the client together with its output buffer,
+ * sorted by frame_offset. The driver consumes the list on the next period
+ * and resets num_events. The word at AUDIO_CV_GATE_OUT_OFFSET is only
+ * applied, at the start of the period, when no output events are queued
+ * for it, otherwise the gates keep their state until the first event.
+ * So the client should leave it at the mask of its last event.
+ * Input events are filled by the driver every period, in time order,
+ * dropped counts the edges of the period which didn't fit.
+ */
+struct audio_cv_gate_events {
+	uint32_t num_events;
+	uint32_t dropped;
+	struct audio_cv_gate_event events[AUDIO_MAX_CV_GATE_EVENTS];
+};
+
+/*
+ * Stream status, updated by the driver at the start of every period.
+ * period_ts_ns is on the EVL monotonic clock.
+ * The DSP load is the time from the DMA callback to AUDIO_USERPROC_FINISHED
+ * in permille of the period, updated on every AUDIO_USERPROC_FINISHED:
+ * last period, running average, peak since open and a max decaying by
+ * half about every 177 periods (1/256 per period).
+ */
+struct audio_status {
+	uint64_t period_count;
+	uint64_t period_ts_ns;
+	uint32_t dsp_load;
+	uint32_t dsp_load_avg;
+	uint32_t dsp_load_peak;
+	uint32_t dsp_load_max;
+};
+
+/*
+ * Control data exchanged with the board's microcontroller once per period.
+ * The client fills the out mailbox together with its output buffer, the
+ * driver sends it on the next period and resets size. If the transport
+ * can't take it, e.g. the previous frame is still on the wire, size is
+ * left as is and the frame goes out on a later period. The in mailbox is
+ * refreshed when AUDIO_IRQ_WAIT returns, period_count is the period it
+ * was received in. size is 0 when the exchange failed or brought nothing.
+ */
+#define AUDIO_MAILBOX_SIZE			256
+struct audio_mailbox {
+	uint64_t period_count;
+	uint32_t size;
+	uint32_t reserved;
+	uint8_t data[AUDIO_MAILBOX_SIZE];
+};
+
+/*
+ * Timestamped events travelling with the audio, e.g. gate edges or MIDI.
+ * Input events are filled by the driver every period, in time order, with
+ * frame_offset in the period which was just captured. Events from all the
+ * producers are merged, dropped counts the ones which didn't fit.
+ * Output events are filled by the client together with its output buffer,
+ * sorted by frame_offset, and handed to the kernel consumer, if any, once
+ * the client reports AUDIO_USERPROC_FINISHED. The driver resets num_events.
+ */
+#define AUDIO_MAX_EVENTS			48
+#define AUDIO_EVENT_DATA_SIZE			8
+
+enum audio_event_type {
+	/* data holds the state of all gate inputs after the edge, 32 bit */
+	AUDIO_EVENT_GATE = 1,
+	/* data holds one MIDI message */
+	AUDIO_EVENT_MIDI,
+	AUDIO_EVENT_USER,
+};
+
+struct audio_event {
+	uint32_t frame_offset;
+	uint16_t type;
+	uint16_t size;
+	uint8_t data[AUDIO_EVENT_DATA_SIZE];
+};
+
+struct audio_event_queue {
+	uint32_t num_events;
+	uint32_t dropped;
+	struct audio_event events[AUDIO_MAX_EVENTS];
+};
+
 enum platform_type {
 	NATIVE_AUDIO = 1,
 	SYNC_WITH_UC_AUDIO,
@@ -79,9 +270,17 @@ enum usb_audio_type
     EXTERNAL_UC
 };
 
+#ifdef __KERNEL__
 struct audio_evl_buffers {
 	uint32_t 	 	*cv_gate_out;
 	uint32_t 	 	*cv_gate_in;
+	struct audio_cv_gate_events	*cv_gate_out_events;
+	struct audio_cv_gate_events	*cv_gate_in_events;
+	struct audio_status		*status;
+	struct audio_mailbox		*mailbox_out;
+	struct audio_mailbox		*mailbox_in;
+	struct audio_event_queue	*events_out;
+	struct audio_event_queue	*events_in;
 	void			*tx_buf;
 	void			*rx_buf;
 	size_t			buffer_len;
@@ -90,25 +289,186 @@ struct audio_evl_buffers {
 	dma_addr_t		rx_phys_addr;
 };
 
+/*
+ * TDM frame as seen on the I2S bus: slots * slot_width bits, of which the
+ * slots set in the masks are exposed as input and output channels.
+ */
+#define AUDIO_EVL_MAX_TDM_SLOTS		32
+struct audio_evl_tdm_config {
+	unsigned	slots;
+	unsigned	slot_width;
+	unsigned	frame_length;
+	uint32_t	rx_slot_mask;
+	uint32_t	tx_slot_mask;
+};
+
+/* DMA request and FIFO thresholds of the I2S block, in FIFO words */
+struct audio_evl_dma_params {
+	unsigned	thr_tx;
+	unsigned	thr_rx;
+	unsigned	tx_panic_thr;
+	unsigned	rx_panic_thr;
+	unsigned	burst_size;
+	unsigned	fifo_tx_thr;
+	unsigned	fifo_rx_thr;
+};
+
+/*
+ * Flight recorder, one record per period. Dates are on the EVL monotonic
+ * clock, 0 when the client didn't wake up or finish for that period. irqs
+ * counts the interrupts taken by the CPU of the DMA callback in the period.
+ * The debugfs dump is a header followed by num_records records, the
+ * trigger period in the middle.
+ */
+#define AUDIO_EVL_FLIGHT_MAGIC		0x46455641	/* "AVEF" */
+#define AUDIO_EVL_FLIGHT_VERSION	1
+#define AUDIO_EVL_FLIGHT_RING		128
+
+#define AUDIO_EVL_FLIGHT_TX_ERR		BIT(0)
+#define AUDIO_EVL_FLIGHT_RX_ERR		BIT(1)
+#define AUDIO_EVL_FLIGHT_XRUN		BIT(2)
+/* Last period before the DMA callbacks stopped */
+#define AUDIO_EVL_FLIGHT_STALL		BIT(3)
+
+struct audio_evl_flight_record {
+	uint64_t period;
+	int64_t callback_ns;
+	int64_t wakeup_ns;
+	int64_t finish_ns;
+	uint32_t callback_duration_ns;
+	uint16_t flags;
+	uint16_t irqs;
+};
+
+struct audio_evl_flight_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t num_records;
+	uint32_t triggers;
+	uint64_t trigger_period;
+};
+
+/* Event posted by a kernel producer, stamped on the EVL monotonic clock */
+struct audio_evl_pending_event {
+	ktime_t			date;
+	struct audio_event	event;
+};
+
+enum audio_evl_calib_state {
+	AUDIO_EVL_CALIB_IDLE,
+	AUDIO_EVL_CALIB_ARMED,
+	AUDIO_EVL_CALIB_WAITING,
+	AUDIO_EVL_CALIB_DONE,
+	/* The input crossed the threshold before the impulse was played */
+	AUDIO_EVL_CALIB_NOISY,
+};
+
+/* Impulse loopback measurement, run by the DMA callback */
+struct audio_evl_calibration {
+	int		state;
+	unsigned	tx_slot;
+	unsigned	rx_slot;
+	int32_t		impulse;
+	uint32_t	threshold;
+	uint64_t	emit_period;
+	int		latency_frames;
+};
+
+/* Monitor route, slots are the words of the interface's frame */
+struct audio_evl_monitor_route {
+	unsigned	in_slot;
+	unsigned	out_slot;
+	int32_t		gain;
+};
+
+struct audio_evl_hat;
+
+/* Max I2S interfaces driven at the same time */
+#define AUDIO_EVL_MAX_DEVS		4
+
 /* General audio evl device struct */
 struct audio_evl_dev {
 	struct device			*dev;
+	int				id;
 	void __iomem			*i2s_base_addr;
 	struct dma_chan			*dma_tx;
 	struct dma_chan			*dma_rx;
 	struct dma_async_tx_descriptor 	*tx_desc;
 	struct dma_async_tx_descriptor	*rx_desc;
+	/* Silence played before the tx ring when tx_phase_frames < period */
+	struct dma_async_tx_descriptor	*tx_lead_desc;
 	dma_addr_t			fifo_dma_addr;
 	unsigned			addr_width;
-	unsigned			dma_burst_size;
+	struct audio_evl_dma_params	dma_params;
+	struct audio_evl_tdm_config	tdm;
 	struct audio_evl_buffers	*buffer;
 	struct evl_flag 	event_flag;
 	unsigned			wait_flag;
 	unsigned			buffer_idx;
 	uint64_t			kinterrupts;
+	ktime_t				period_ts;
+	int64_t				period_interval_min_ns;
+	int64_t				period_interval_max_ns;
+	unsigned long			tx_fifo_errors;
+	unsigned long			rx_fifo_errors;
+	unsigned long			fifo_recoveries;
+	unsigned			fifo_error_periods;
+	/* Restarts the stream after fifo_error_recovery_periods bad periods */
+	struct evl_work			fifo_recovery_work;
+	bool				fifo_recovery_pending;
+	unsigned long			resyncs;
+	unsigned			slip_periods;
+	bool				frame_slip_check;
+	bool				packed_16bit;
+	bool				resync_pending;
+	/* Set by bcm2835_i2s_exit(), the works must not restart the stream */
+	bool				closing;
+	/* Claimed by an open session or the self-test, see audio_evl_users_lock */
+	bool				busy;
+	int				stream_error;
+	struct evl_work			resync_work;
+	/* Serialises the works stopping and restarting the stream */
+	struct mutex			restart_lock;
+	/* Fires when the DMA callbacks stop, see watchdog_periods */
+	struct evl_timer		watchdog_timer;
+	struct evl_work			watchdog_work;
+	bool				watchdog_pending;
+	unsigned long			watchdog_recoveries;
+	uint64_t			period_ns;
+	/* Events posted since the start of the current period */
+	hard_spinlock_t			event_lock;
+	struct audio_evl_pending_event	pending_events[AUDIO_MAX_EVENTS];
+	int				num_pending_events;
+	uint32_t			dropped_events;
+	ktime_t				events_period_ts;
+	struct audio_evl_flight_record	flight_ring[AUDIO_EVL_FLIGHT_RING];
+	struct audio_evl_flight_record	flight_frozen[AUDIO_EVL_FLIGHT_RING];
+	struct audio_evl_flight_header	flight_header;
+	/* Period of the pending trigger, 0 = none */
+	uint64_t			flight_trigger;
+	uint32_t			flight_triggers;
+	unsigned int			flight_irqs;
+	hard_spinlock_t			flight_lock;
+	struct dentry			*debugfs;
+	struct audio_evl_calibration	calib;
+	/* Direct monitoring, kept across sessions */
+	hard_spinlock_t			monitor_lock;
+	struct audio_evl_monitor_route	monitor_routes[AUDIO_MONITOR_MAX_ROUTES];
+	int				num_monitor_routes;
+	/* Last period the client's output got the monitor mix */
+	uint64_t			monitor_period;
+	int				num_channels;
+	int				period_frames;
+	/* Frames from the end of a capture period to the start of its output */
+	int				tx_phase_frames;
+	int				sampling_rate;
 	struct clk			*clk;
 	bool				cv_gate_enabled;
 	int				clk_rate;
-	char 				*audio_hat;
+	const struct audio_evl_hat	*hat;
 };
+
+#endif /* __KERNEL__ */
+
 #endif
@@ -0,0 +1,354 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * @brief Round-trip and wakeup latency benchmark for the EVL audio driver.
+ *	  Runs an EVL attached RT thread against /dev/audio_evl for each
+ *	  buffer size and synthetic DSP load, and reports wakeup latency,
+ *	  finish margin and xruns as JSON.
+ * @copyright 2017-2019 Modern Ancient Instruments Networked AB, dba Elk,
+ * Stockholm
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <libgen.h>
+#include <evl/evl.h>
+
+#include "rpi-audio-evl.h"
+
+#define AUDIO_EVL_DEVICE	"/dev/audio_evl"
+#define AUDIO_EVL_SYSFS		"/sys/class/audio_evl/"
+#define MAX_SWEEP		16
+#define HIST_BINS		2000	/* 1 us bins */
+#define RT_PRIORITY		90
+
+struct histogram {
+	uint64_t bins[HIST_BINS + 1];
+	int64_t min_ns;
+	int64_t max_ns;
+	double sum_ns;
+	uint64_t count;
+};
+
+struct run_result {
+	int buffer_size;
+	int load_percent;
+	uint64_t periods;
+	uint64_t xruns;
+	uint64_t resyncs;
+	struct histogram wakeup;
+	struct histogram margin;
+};
+
+static const char *device = AUDIO_EVL_DEVICE;
+/* Name of the device in the audio_evl class, its attributes are under it */
+static char *device_name;
+static int buffer_sizes[MAX_SWEEP] = { 16, 32, 64, 128 };
+static int num_buffer_sizes = 4;
+static int loads[MAX_SWEEP] = { 0, 25, 50, 75 };
+static int num_loads = 4;
+static uint64_t periods_per_run = 10000;
+
+static int sysfs_read_int(const char *attr, int *value)
+{
+	char path[128];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), AUDIO_EVL_SYSFS "%s", attr);
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	ret = fscanf(f, "%d", value) == 1 ? 0 : -EINVAL;
+	fclose(f);
+	return ret;
+}
+
+static int sysfs_read_dev_int(const char *attr, int *value)
+{
+	char path[128];
+
+	snprintf(path, sizeof(path), "%s/%s", device_name, attr);
+	return sysfs_read_int(path, value);
+}
+
+/* Slots per frame, the buffers are interleaved by this many samples */
+static int sysfs_read_slots(int *slots)
+{
+	char path[128];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), AUDIO_EVL_SYSFS "%s/tdm_config",
+		 device_name);
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	ret = fscanf(f, "slots=%d", slots) == 1 ? 0 : -EINVAL;
+	fclose(f);
+	return ret;
+}
+
+static int sysfs_write_int(const char *attr, int value)
+{
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), AUDIO_EVL_SYSFS "%s", attr);
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+	fprintf(f, "%d\n", value);
+	return fclose(f) ? -errno : 0;
+}
+
+static int parse_list(const char *arg, int *list)
+{
+	char *copy = strdup(arg), *tok, *save = NULL;
+	int n = 0;
+
+	for (tok = strtok_r(copy, ",", &save); tok && n < MAX_SWEEP;
+	     tok = strtok_r(NULL, ",", &save))
+		list[n++] = atoi(tok);
+	free(copy);
+	return n;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	evl_read_clock(EVL_CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void hist_init(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min_ns = INT64_MAX;
+	h->max_ns = INT64_MIN;
+}
+
+static void hist_add(struct histogram *h, int64_t ns)
+{
+	int64_t bin = ns / 1000;
+
+	if (bin < 0)
+		bin = 0;
+	if (bin > HIST_BINS)
+		bin = HIST_BINS;
+	h->bins[bin]++;
+	if (ns < h->min_ns)
+		h->min_ns = ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->sum_ns += ns;
+	h->count++;
+}
+
+static void hist_print(FILE *out, const char *name, const struct histogram *h)
+{
+	int i, first = 1;
+
+	fprintf(out, "\"%s\": {\"min_ns\": %lld, \"max_ns\": %lld, "
+		"\"mean_ns\": %.0f, \"bin_us\": 1, \"histogram\": [",
+		name, h->count ? (long long)h->min_ns : 0,
+		h->count ? (long long)h->max_ns : 0,
+		h->count ? h->sum_ns / h->count : 0.0);
+	for (i = 0; i <= HIST_BINS; i++) {
+		if (!h->bins[i])
+			continue;
+		fprintf(out, "%s[%d, %llu]", first ? "" : ", ", i,
+			(unsigned long long)h->bins[i]);
+		first = 0;
+	}
+	fprintf(out, "]}");
+}
+
+static int run_one(struct run_result *res, int sampling_rate)
+{
+	int64_t period_ns, period_ts, wake, finish, busy_until;
+	volatile struct audio_status *status;
+	uint64_t period_count, last_period = 0;
+	int fd, efd, ret = 0, buffer_idx, slots, packed, map_size;
+	size_t buffer_len, map_len, sample_size;
+	void *map;
+
+	if (sysfs_write_int("audio_buffer_size", res->buffer_size)) {
+		fprintf(stderr, "cannot set buffer size %d\n", res->buffer_size);
+		return -1;
+	}
+	if (sysfs_read_slots(&slots) ||
+	    sysfs_read_dev_int("packed_16bit", &packed) ||
+	    sysfs_read_dev_int("mmap_size", &map_size)) {
+		fprintf(stderr, "cannot read the buffer layout\n");
+		return -1;
+	}
+	sample_size = packed ? sizeof(int16_t) : sizeof(int32_t);
+	map_len = map_size;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return -1;
+	}
+	buffer_len = 2 * (size_t)res->buffer_size * slots * sample_size;
+	status = (struct audio_status *)((char *)map + 2 * buffer_len +
+						AUDIO_STATUS_OFFSET);
+	period_ns = (int64_t)res->buffer_size * 1000000000LL / sampling_rate;
+
+	efd = evl_attach_self("audio-evl-bench:%d", getpid());
+	if (efd < 0) {
+		fprintf(stderr, "evl_attach_self: %s\n", strerror(-efd));
+		ret = -1;
+		goto out;
+	}
+
+	hist_init(&res->wakeup);
+	hist_init(&res->margin);
+	if (ioctl(fd, AUDIO_PROC_START)) {
+		perror("AUDIO_PROC_START");
+		evl_detach_self();
+		ret = -1;
+		goto out;
+	}
+
+	while (res->periods < periods_per_run) {
+		ret = oob_ioctl(fd, AUDIO_IRQ_WAIT, &buffer_idx);
+		if (ret) {
+			if (errno == ESTRPIPE || errno == ETIMEDOUT) {
+				res->resyncs++;
+				last_period = 0;
+				continue;
+			}
+			perror("AUDIO_IRQ_WAIT");
+			ret = -1;
+			break;
+		}
+		wake = now_ns();
+		/* The driver moves on to the next period while we run */
+		period_ts = (int64_t)status->period_ts_ns;
+		period_count = status->period_count;
+		if (last_period && period_count > last_period + 1)
+			res->xruns += period_count - last_period - 1;
+		last_period = period_count;
+		hist_add(&res->wakeup, wake - period_ts);
+
+		/* Synthetic DSP load */
+		busy_until = period_ts + period_ns * res->load_percent / 100;
+		while (now_ns() < busy_until)
+			;
+
+		oob_ioctl(fd, AUDIO_USERPROC_FINISHED, NULL);
+		finish = now_ns();
+		hist_add(&res->margin, period_ts + period_ns - finish);
+		res->periods++;
+	}
+	ioctl(fd, AUDIO_PROC_STOP);
+	evl_detach_self();
+out:
+	munmap(map, map_len);
+	close(fd);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-b 16,32,64,128] [-l 0,25,50,75]\n"
+		"       [-n periods] [-o output.json]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct sched_param param = { .sched_priority = RT_PRIORITY };
+	struct run_result *results;
+	int i, j, opt, sampling_rate, num_results = 0;
+	FILE *out = stdout;
+
+	while ((opt = getopt(argc, argv, "d:b:l:n:o:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'b':
+			num_buffer_sizes = parse_list(optarg, buffer_sizes);
+			break;
+		case 'l':
+			num_loads = parse_list(optarg, loads);
+			break;
+		case 'n':
+			periods_per_run = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (!out) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	device_name = basename(strdup(device));
+	if (sysfs_read_dev_int("sampling_rate", &sampling_rate)) {
+		fprintf(stderr, "audio_evl driver not loaded\n");
+		return 1;
+	}
+	pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+	results = calloc(num_buffer_sizes * num_loads, sizeof(*results));
+	if (!results)
+		return 1;
+
+	for (i = 0; i < num_buffer_sizes; i++) {
+		for (j = 0; j < num_loads; j++) {
+			struct run_result *res = &results[num_results];
+
+			memset(res, 0, sizeof(*res));
+			res->buffer_size = buffer_sizes[i];
+			res->load_percent = loads[j];
+			if (run_one(res, sampling_rate))
+				continue;
+			num_results++;
+		}
+	}
+
+	fprintf(out, "{\"sampling_rate\": %d, \"runs\": [\n", sampling_rate);
+	for (i = 0; i < num_results; i++) {
+		struct run_result *res = &results[i];
+
+		fprintf(out, "  {\"buffer_size\": %d, \"load_percent\": %d, "
+			"\"periods\": %llu, \"xruns\": %llu, \"resyncs\": %llu, ",
+			res->buffer_size, res->load_percent,
+			(unsigned long long)res->periods,
+			(unsigned long long)res->xruns,
+			(unsigned long long)res->resyncs);
+		hist_print(out, "wakeup_latency", &res->wakeup);
+		fprintf(out, ", ");
+		hist_print(out, "finish_margin", &res->margin);
+		fprintf(out, "}%s\n", i + 1 < num_results ? "," : "");
+	}
+	fprintf(out, "]}\n");
+
+	free(results);
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
@@ -0,0 +1,56 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0
+#
+# Sweep the bcm2835-i2s-elk DMA/FIFO thresholds under memory bandwidth
+# stress and report FIFO errors and DMA callback jitter for each setting.
+#
+# Usage: dma-threshold-sweep.sh <client command> [seconds]
+#
+# The client command must open the device under test and run the stream
+# for the whole run, e.g. the audio-evl-bench tool or an audio host. The
+# device defaults to audio_evl, override with $DEVICE (e.g. audio_evl1).
+# Settings are given one per line on stdin as:
+#   dma_thr_tx dma_thr_rx dma_tx_panic_thr dma_rx_panic_thr dma_burst_size
+#   fifo_tx_thr fifo_rx_thr
+# Stress defaults to stress-ng memory streaming, override with $STRESS.
+
+CLIENT="$1"
+DURATION="${2:-30}"
+STRESS="${STRESS:-stress-ng --stream 4 --vm 2 --vm-bytes 64M}"
+PARAMS=/sys/module/bcm2835_i2s_elk/parameters
+DEVICE="${DEVICE:-audio_evl}"
+ATTRS=/sys/class/audio_evl/$DEVICE
+
+if [ -z "$CLIENT" ]; then
+	echo "usage: $0 <client command> [seconds] < settings" >&2
+	exit 1
+fi
+if [ ! -d "$ATTRS" ]; then
+	echo "$0: no device $DEVICE" >&2
+	exit 1
+fi
+
+echo "thr_tx,thr_rx,tx_panic,rx_panic,burst,fifo_tx_thr,fifo_rx_thr,tx_fifo_errors,rx_fifo_errors,fifo_recoveries,interval_min_ns,interval_max_ns"
+
+while read thr_tx thr_rx tx_panic rx_panic burst fifo_tx fifo_rx; do
+	[ -z "$thr_tx" ] && continue
+	if [ -z "$fifo_rx" ]; then
+		echo "$0: skipping incomplete setting: $thr_tx $thr_rx $tx_panic $rx_panic $burst $fifo_tx" >&2
+		continue
+	fi
+	echo "$thr_tx" > $PARAMS/dma_thr_tx
+	echo "$thr_rx" > $PARAMS/dma_thr_rx
+	echo "$tx_panic" > $PARAMS/dma_tx_panic_thr
+	echo "$rx_panic" > $PARAMS/dma_rx_panic_thr
+	echo "$burst" > $PARAMS/dma_burst_size
+	echo "$fifo_tx" > $PARAMS/fifo_tx_thr
+	echo "$fifo_rx" > $PARAMS/fifo_rx_thr
+
+	$STRESS --timeout "$((DURATION + 2))s" > /dev/null 2>&1 &
+	stress_pid=$!
+	sleep 1
+	timeout "$DURATION" $CLIENT > /dev/null 2>&1
+
+	echo "$thr_tx,$thr_rx,$tx_panic,$rx_panic,$burst,$fifo_tx,$fifo_rx,$(cat $ATTRS/tx_fifo_errors),$(cat $ATTRS/rx_fifo_errors),$(cat $ATTRS/fifo_recoveries),$(cat $ATTRS/period_interval_min_ns),$(cat $ATTRS/period_interval_max_ns)"
+	wait $stress_pid
+done